@@ -18,28 +18,89 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
-#include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <jni.h>
 
 #include "jp2library.h"
 #include "osapi.h"
 #include "jp12serial_compat.h"
 
-/* Unfortunately, there is no jni handle attribute in the io.JP12Serial class.
- * Therefore, we have to remember our state here. */
-static struct jp2_remote *r;
-static struct jp2_info info;
+/* state of one opened remote */
+struct jp12_session {
+	struct jp2_remote *r;
+	struct jp2_info info;
+	struct jp2_mirror *image;	/* of the update area, may be NULL */
+	uint32_t block_size;		/* of the image */
+};
 
-static void jp2_initialize(void)
+/*
+ * Every io.JP12Serial object has its own session if the class declares a
+ * "long nativeHandle" field, so a JVM may drive several remotes from
+ * different threads. Older versions of the class don't, they all share
+ * one session and must not be used concurrently.
+ */
+static struct jp12_session *legacy_session;
+
+static jfieldID jp12_handle_field(JNIEnv *env, jobject obj)
+{
+	jfieldID id;
+
+	id = (*env)->GetFieldID(env, (*env)->GetObjectClass(env, obj),
+			"nativeHandle", "J");
+	if (id == NULL) {
+		/* don't leave the NoSuchFieldError pending */
+		(*env)->ExceptionClear(env);
+	}
+	return id;
+}
+
+static struct jp12_session *jp12_get_session(JNIEnv *env, jobject obj)
+{
+	jfieldID id = jp12_handle_field(env, obj);
+
+	if (id == NULL) {
+		return legacy_session;
+	}
+	return (struct jp12_session *)(intptr_t)
+		(*env)->GetLongField(env, obj, id);
+}
+
+static void jp12_set_session(JNIEnv *env, jobject obj,
+		struct jp12_session *s)
 {
-	static bool init_done = false;
-	if (!init_done) {
-		jp2_init();
-		init_done = true;
+	jfieldID id = jp12_handle_field(env, obj);
+
+	if (id == NULL) {
+		legacy_session = s;
+		return;
 	}
+	(*env)->SetLongField(env, obj, id, (jlong)(intptr_t)s);
+}
+
+static void jp12_close_session(struct jp12_session *s)
+{
+	if (s->image) {
+		jp2_mirror_free(s->image);
+	}
+	jp2_exit_loader(s->r);
+	jp2_close_remote(s->r);
+	free(s);
+}
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void jp2_init_once(void)
+{
+	jp2_init();
+}
+
+static void jp2_initialize(void)
+{
+	pthread_once(&init_once, jp2_init_once);
 }
 
 JP12FUNC_1(getInterfaceName, jstring, jobject obj)
@@ -68,83 +129,276 @@ JP12FUNC_3(getJP2info, jboolean, jobject obj, jbyteArray buffer, jint length)
 	return false;
 }
 
+#define JP12_MAX_PORTS 32
+
+struct jp12_ports {
+	JNIEnv *env;
+	jstring names[JP12_MAX_PORTS];
+	int count;
+};
+
+static void jp12_add_port(void *priv, const struct osapi_port *port)
+{
+	struct jp12_ports *ports = priv;
+	JNIEnv *env = ports->env;
+
+	if (ports->count < JP12_MAX_PORTS) {
+		ports->names[ports->count++] =
+			(*env)->NewStringUTF(env, port->devname);
+	}
+}
+
 JP12FUNC_1(getPortNames, jobjectArray, jobject obj)
 {
 	jobjectArray array;
-	const char *name;
-	int port = 0;
-	jstring portnames[32];
+	struct jp12_ports ports = { .env = env };
 
 	jp2_initialize();
 
-	while ((name = osapi->enumerate()) && port < 32) {
-		portnames[port++] = (*env)->NewStringUTF(env, name);
-	}
+	osapi->enumerate(jp12_add_port, &ports);
 
-	array = (*env)->NewObjectArray(env, port,
+	array = (*env)->NewObjectArray(env, ports.count,
 			(*env)->FindClass(env, "java/lang/String"),
 			NULL);
 
-	while (port--)
+	while (ports.count--)
 	{
-		(*env)->SetObjectArrayElement(env, array, port,
-				portnames[port]);
+		(*env)->SetObjectArrayElement(env, array, ports.count,
+				ports.names[ports.count]);
 	}
 
 	return array;
 }
 
+/*
+ * RMIR reads the whole update area and writes all of it back on every save.
+ * The session keeps what was read and written in a mirror, so a write only
+ * erases and programs the blocks which differ from it.
+ */
+static struct jp2_mirror *jp12_new_image(struct jp12_session *s)
+{
+	uint32_t begin;
+	uint32_t end;
+
+	if (s->info.update_area_end < s->info.update_area_begin) {
+		return NULL;
+	}
+	begin = s->info.update_area_begin / s->block_size * s->block_size;
+	end = (s->info.update_area_end / s->block_size + 1) * s->block_size;
+
+	return jp2_mirror_new(s->r, begin, end - begin, s->block_size);
+}
+
+/*
+ * Erasing a block of the wrong size wipes parts of its neighbours, which
+ * the XOR checksums used to verify miss once in a while. Until the size is
+ * known for the remote type or from probeEraseBlockSize(), the image uses
+ * JP2_DELTA_BLOCK_SIZE for reads only and writes erase their whole range.
+ * The probe writes to flash, so it never runs on its own.
+ */
+static void jp12_geometry(struct jp12_session *s)
+{
+	int rc;
+
+	rc = jp2_get_erase_block_size(s->r);
+	if (rc <= 0 || rc == s->block_size) {
+		return;
+	}
+
+	/* what was read is lost, the next write checks all blocks */
+	s->block_size = rc;
+	if (s->image) {
+		jp2_mirror_free(s->image);
+	}
+	s->image = jp12_new_image(s);
+}
+
+/* time a remote gets to answer during auto-detection */
+#define JP12_DETECT_TIMEOUT_MS 300
+
 JP12FUNC_2(openRemote, jstring, jobject obj, jstring jportname)
 {
 	int rc;
 	const char *portname;
+	const char *env_baudrate;
+	int baudrate;
+	int max_baudrate;
+	struct jp2_remote *r;
+	struct jp12_session *s;
+	struct jp2_port port;
 
 	jp2_initialize();
 
+	/* a second open replaces the session */
+	s = jp12_get_session(env, obj);
+	if (s) {
+		jp12_set_session(env, obj, NULL);
+		jp12_close_session(s);
+	}
+
+	/* no port given, take the first one a remote answers on */
 	if (jportname == NULL) {
-		/* XXX: auto-detect not supported yet */
-		return NULL;
+		rc = jp2_detect(&port, 1, JP12_DETECT_TIMEOUT_MS);
+		if (rc <= 0) {
+			return NULL;
+		}
+		jportname = (*env)->NewStringUTF(env, port.devname);
+		if (jportname == NULL) {
+			return NULL;
+		}
+	}
+
+	/* JP2_BAUDRATE is either a fixed line speed or "auto[:max]" */
+	baudrate = JP2_DEFAULT_BAUDRATE;
+	max_baudrate = 0;
+	env_baudrate = getenv("JP2_BAUDRATE");
+	if (env_baudrate && !strncmp(env_baudrate, "auto", 4)) {
+		max_baudrate = 115200;
+		if (env_baudrate[4] == ':') {
+			max_baudrate = strtoul(env_baudrate + 5, NULL, 0);
+		}
+	} else if (env_baudrate) {
+		baudrate = strtoul(env_baudrate, NULL, 0);
 	}
 
 	portname = (*env)->GetStringUTFChars(env, jportname, NULL);
-	r = jp2_open_remote(portname);
+	r = jp2_open_remote_baudrate(portname, baudrate);
 	(*env)->ReleaseStringUTFChars(env, jportname, portname);
+	if (!r) {
+		return NULL;
+	}
 
-	rc = jp2_enter_loader(r, false);
-	if (rc) {
+	s = malloc(sizeof(*s));
+	if (!s) {
 		jp2_close_remote(r);
 		return NULL;
 	}
+	s->r = r;
+	s->image = NULL;
 
-	rc = jp2_get_info(r, &info);
+	rc = jp2_connect(r, false, &s->info);
 	if (rc) {
+		free(s);
 		jp2_close_remote(r);
 		return NULL;
 	}
 
+	if (max_baudrate) {
+		rc = jp2_probe_host_baudrate(r, max_baudrate);
+		if (rc < 0) {
+			free(s);
+			jp2_close_remote(r);
+			return NULL;
+		}
+	}
+
+	/* on failure, we just keep the default chunk size */
+	jp2_probe_chunk_size(r);
+
+	rc = jp2_get_erase_block_size(r);
+	s->block_size = (rc > 0) ? rc : JP2_DELTA_BLOCK_SIZE;
+	s->image = jp12_new_image(s);
+
+	jp12_set_session(env, obj, s);
+
 	return jportname;
 }
 
+JP12FUNC_1(getBaudRate, jint, jobject obj)
+{
+	struct jp12_session *s;
+
+	jp2_initialize();
+
+	s = jp12_get_session(env, obj);
+	if (!s) {
+		return -1;
+	}
+	return jp2_get_baudrate(s->r);
+}
+
+/*
+ * Counters of one command type (JP2_STATS_*): count, bytes sent, bytes
+ * received, checksum errors, errors, retries, average, 99th percentile and
+ * maximum latency in us, timeouts.
+ */
+JP12FUNC_2(getStats, jlongArray, jobject obj, jint cmd)
+{
+	struct jp2_stats stats;
+	struct jp2_cmd_stats *c;
+	jlong values[10];
+	jlongArray array;
+	struct jp12_session *s;
+
+	jp2_initialize();
+
+	s = jp12_get_session(env, obj);
+	if (!s || cmd < 0 || cmd >= JP2_STATS_CMDS) {
+		return NULL;
+	}
+
+	jp2_get_stats(s->r, &stats);
+	c = &stats.cmd[cmd];
+	values[0] = c->count;
+	values[1] = c->tx_bytes;
+	values[2] = c->rx_bytes;
+	values[3] = c->checksum_errors;
+	values[4] = c->errors;
+	values[5] = c->retries;
+	values[6] = (c->count) ? c->latency_sum / c->count : 0;
+	values[7] = jp2_stats_percentile(c, 99);
+	values[8] = c->latency_max;
+	values[9] = c->timeouts;
+
+	array = (*env)->NewLongArray(env, 10);
+	if (array == NULL) {
+		return NULL;
+	}
+	(*env)->SetLongArrayRegion(env, array, 0, 10, values);
+
+	return array;
+}
+
+JP12FUNC_1(resetStats, void, jobject obj)
+{
+	struct jp12_session *s;
+
+	jp2_initialize();
+
+	s = jp12_get_session(env, obj);
+	if (s) {
+		jp2_reset_stats(s->r);
+	}
+}
+
 JP12FUNC_1(closeRemote, void, jobject obj)
 {
+	struct jp12_session *s;
+
 	jp2_initialize();
-	jp2_exit_loader(r);
-	jp2_close_remote(r);
+
+	s = jp12_get_session(env, obj);
+	if (s) {
+		jp12_set_session(env, obj, NULL);
+		jp12_close_session(s);
+	}
 }
 
 JP12FUNC_1(getRemoteSignature, jstring, jobject obj)
 {
 	int i;
 	char signature[9];
+	struct jp12_session *s;
 
 	jp2_initialize();
 
+	s = jp12_get_session(env, obj);
 	memset(signature, '_', 8);
-	for (i = 0; i < 8; i++) {
-		if (!isprint(info.signature[i])) {
+	for (i = 0; s && i < 8; i++) {
+		if (!isprint(s->info.signature[i])) {
 			break;
 		}
-		signature[i] = info.signature[i];
+		signature[i] = s->info.signature[i];
 	}
 	signature[8] = '\0';
 	return (*env)->NewStringUTF(env, signature);
@@ -152,29 +406,196 @@ JP12FUNC_1(getRemoteSignature, jstring, jobject obj)
 
 JP12FUNC_1(getRemoteEepromAddress, jint, jobject obj)
 {
+	struct jp12_session *s;
+
 	jp2_initialize();
-	return info.update_area_begin;
+
+	s = jp12_get_session(env, obj);
+	if (!s) {
+		return -1;
+	}
+	return s->info.update_area_begin;
 }
 
 JP12FUNC_1(getRemoteEepromSize, jint, jobject obj)
 {
+	struct jp12_session *s;
+
 	jp2_initialize();
-	return info.update_area_end - info.update_area_begin + 1;
+
+	s = jp12_get_session(env, obj);
+	if (!s) {
+		return -1;
+	}
+	return s->info.update_area_end - s->info.update_area_begin + 1;
+}
+
+/* Find the erase block size, which erases and restores a scratch area of
+ * the update area. Writes use it from then on. */
+JP12FUNC_1(probeEraseBlockSize, jint, jobject obj)
+{
+	int rc;
+	struct jp12_session *s;
+
+	jp2_initialize();
+
+	s = jp12_get_session(env, obj);
+	if (!s) {
+		return -1;
+	}
+
+	rc = jp2_probe_erase_block(s->r, &s->info);
+	if (rc > 0) {
+		jp12_geometry(s);
+	} else if (s->image) {
+		/* the scratch area might not have been restored */
+		jp2_mirror_discard(s->image);
+	}
+
+	return rc;
+}
+
+/*
+ * Transfers. The serial I/O takes far too long to hold a Java array pinned
+ * with GetPrimitiveArrayCritical(), so arrays are copied once, into or out
+ * of a native buffer. The memory of a direct ByteBuffer doesn't move, the
+ * *Direct() variants transfer right from and into it.
+ */
+static int jp12_result(int rc)
+{
+	if (rc >= 0) {
+		return rc;
+	}
+	/* the remote refused the address */
+	if (rc == -JP2_ERR_INVALID_ARGUMENT) {
+		return JP12_ERR_ARGUMENT;
+	}
+	return JP12_ERR_IO;
+}
+
+static int jp12_read(struct jp12_session *s, jint address, uint8_t *buf,
+		int len)
+{
+	if (address < 0 || len <= 0) {
+		return JP12_ERR_ARGUMENT;
+	}
+
+	/* the image covers all of the update area */
+	if (s->image && address >= s->info.update_area_begin
+			&& (uint32_t)address + len - 1
+			<= s->info.update_area_end) {
+		return jp12_result(jp2_mirror_read(s->image, address, len,
+					buf));
+	}
+	return jp12_result(jp2_read_block(s->r, address, len, buf));
+}
+
+static int jp12_write(struct jp12_session *s, jint address, uint8_t *buf,
+		int len)
+{
+	int rc;
+	uint32_t bad_address;
+
+	/* prevent user from accidentally brick his remote */
+	if (len <= 0 || (address < s->info.update_area_begin)
+			|| ((address + len - 1) > s->info.update_area_end)) {
+		return JP12_ERR_ARGUMENT;
+	}
+
+	jp12_geometry(s);
+
+	if (jp2_get_erase_block_size(s->r) <= 0) {
+		/* the erase may reach into the pages around the range */
+		if (s->image) {
+			jp2_mirror_discard(s->image);
+		}
+		rc = jp2_erase_block(s->r, address, address + len - 1);
+		if (rc >= 0) {
+			rc = jp2_write_block(s->r, address, len, buf);
+		}
+		if (rc < 0) {
+			return jp12_result(rc);
+		}
+		if (s->image) {
+			jp2_mirror_update(s->image, address, len, buf);
+		}
+		return len;
+	}
+
+	/* the blocks which differ from what was read or written before are
+	 * written and checked, that must match the remote then */
+	if (s->image && jp2_mirror_cached(s->image, address, len)) {
+		jp2_mirror_write(s->image, address, len, buf);
+		rc = jp2_mirror_commit(s->image);
+		if (rc >= 0) {
+			rc = jp2_verify(s->r, address, len, buf, &bad_address);
+		}
+		if (rc == 0) {
+			return len;
+		}
+		/* what the remote has now is unknown, the write is tried
+		 * once more below */
+		jp2_mirror_discard(s->image);
+	}
+
+	/* only the blocks whose checksum differs are erased and written */
+	rc = jp2_write_delta(s->r, address, len, buf, s->block_size);
+	if (rc < 0) {
+		if (s->image) {
+			jp2_mirror_discard(s->image);
+		}
+		return jp12_result(rc);
+	}
+	if (s->image) {
+		jp2_mirror_update(s->image, address, len, buf);
+	}
+
+	return len;
+}
+
+/* the memory of a direct ByteBuffer, NULL if it isn't one or too small */
+static uint8_t *jp12_direct_buffer(JNIEnv *env, jobject jbuffer, jint len)
+{
+	uint8_t *buf;
+
+	if (jbuffer == NULL || len <= 0) {
+		return NULL;
+	}
+
+	buf = (*env)->GetDirectBufferAddress(env, jbuffer);
+	if (buf == NULL || (*env)->GetDirectBufferCapacity(env, jbuffer) < len) {
+		return NULL;
+	}
+	return buf;
 }
 
 JP12FUNC_4(readRemote, jint, jobject obj, jint address, jbyteArray jbuffer,
 		jint _unused)
 {
 	int rc;
-	jbyte *buf;
+	uint8_t *buf;
 	int len;
+	struct jp12_session *s;
 
 	jp2_initialize();
 
+	s = jp12_get_session(env, obj);
+	if (!s) {
+		return JP12_ERR_IO;
+	}
+
 	len = (*env)->GetArrayLength(env, jbuffer);
-	buf = (*env)->GetByteArrayElements(env, jbuffer, NULL);
-	rc = jp2_read_block(r, address, len, (uint8_t*)buf);
-	(*env)->ReleaseByteArrayElements(env, jbuffer, buf, 0);
+	buf = malloc(len);
+	if (!buf) {
+		return JP12_ERR_IO;
+	}
+
+	/* the array isn't touched if the read fails */
+	rc = jp12_read(s, address, buf, len);
+	if (rc > 0) {
+		(*env)->SetByteArrayRegion(env, jbuffer, 0, rc, (jbyte*)buf);
+	}
+	free(buf);
 
 	return rc;
 }
@@ -183,32 +604,66 @@ JP12FUNC_4(writeRemote, jint, jobject obj, jint address, jbyteArray jbuffer,
 		jint _unused)
 {
 	int rc;
-	jbyte *buf;
+	uint8_t *buf;
 	int len;
+	struct jp12_session *s;
 
 	jp2_initialize();
 
-	len = (*env)->GetArrayLength(env, jbuffer);
+	s = jp12_get_session(env, obj);
+	if (!s) {
+		return JP12_ERR_IO;
+	}
 
-	/* prevent user from accidentally brick his remote */
-	if ((address < info.update_area_begin)
-			|| ((address + len - 1) > info.update_area_end)) {
-		return -1;
+	len = (*env)->GetArrayLength(env, jbuffer);
+	buf = malloc(len);
+	if (!buf) {
+		return JP12_ERR_IO;
 	}
 
-	rc = jp2_erase_block(r, address, address + len);
-	if (rc != JP2_ERR_NO_ERR) {
-		return -1;
+	(*env)->GetByteArrayRegion(env, jbuffer, 0, len, (jbyte*)buf);
+	rc = jp12_write(s, address, buf, len);
+	free(buf);
+
+	return rc;
+}
+
+JP12FUNC_4(readRemoteDirect, jint, jobject obj, jint address, jobject jbuffer,
+		jint length)
+{
+	uint8_t *buf;
+	struct jp12_session *s;
+
+	jp2_initialize();
+
+	s = jp12_get_session(env, obj);
+	buf = jp12_direct_buffer(env, jbuffer, length);
+	if (!s) {
+		return JP12_ERR_IO;
 	}
+	if (!buf) {
+		return JP12_ERR_ARGUMENT;
+	}
+
+	return jp12_read(s, address, buf, length);
+}
 
-	buf = malloc(len * sizeof(jbyte));
+JP12FUNC_4(writeRemoteDirect, jint, jobject obj, jint address, jobject jbuffer,
+		jint length)
+{
+	uint8_t *buf;
+	struct jp12_session *s;
 
-	/* XXX: convert to exception */
-	assert(buf);
+	jp2_initialize();
 
-	(*env)->GetByteArrayRegion(env, jbuffer, 0, len, buf);
-	rc = jp2_write_block(r, address, len, (uint8_t*)buf);
-	free(buf);
+	s = jp12_get_session(env, obj);
+	buf = jp12_direct_buffer(env, jbuffer, length);
+	if (!s) {
+		return JP12_ERR_IO;
+	}
+	if (!buf) {
+		return JP12_ERR_ARGUMENT;
+	}
 
-	return rc;
+	return jp12_write(s, address, buf, length);
 }
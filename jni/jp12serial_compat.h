@@ -37,6 +37,11 @@ typedef const struct JNINativeInterface_ *JNIEnv;
 	JNIEXPORT ret JNICALL Java_com_hifiremote_jp1_io_JP12Serial_ ## name( \
 		JNIEnv *env, arg1, arg2, arg3, arg4)
 
+/* Results of the transfers other than the number of bytes. The request is
+ * wrong, eg. the address is out of range, or the remote didn't answer. */
+#define JP12_ERR_ARGUMENT	-1
+#define JP12_ERR_IO		-2
+
 JP12FUNC_1(getInterfaceName, jstring, jobject);
 JP12FUNC_1(getInterfaceVersion, jstring, jobject);
 JP12FUNC_1(getJP12InterfaceType, jint, jobject);
@@ -44,10 +49,16 @@ JP12FUNC_3(getJP2info, jboolean, jobject, jbyteArray, jint);
 JP12FUNC_1(getPortNames, jobjectArray, jobject);
 JP12FUNC_2(openRemote, jstring, jobject, jstring);
 JP12FUNC_1(closeRemote, void, jobject);
+JP12FUNC_1(getBaudRate, jint, jobject);
+JP12FUNC_2(getStats, jlongArray, jobject, jint);
+JP12FUNC_1(resetStats, void, jobject);
 JP12FUNC_1(getRemoteSignature, jstring, jobject);
 JP12FUNC_1(getRemoteEepromAddress, jint, jobject);
 JP12FUNC_1(getRemoteEepromSize, jint, jobject);
+JP12FUNC_1(probeEraseBlockSize, jint, jobject);
 JP12FUNC_4(readRemote, jint, jobject, jint, jbyteArray, jint);
 JP12FUNC_4(writeRemote, jint, jobject, jint, jbyteArray, jint);
+JP12FUNC_4(readRemoteDirect, jint, jobject, jint, jobject, jint);
+JP12FUNC_4(writeRemoteDirect, jint, jobject, jint, jobject, jint);
 
 #endif /* __JP12SERIAL_COMPAT_H */
@@ -0,0 +1,229 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cache of the remote info, so a reconnect doesn't have to read the info
+ * area again.
+ *
+ * The cache is a text file with one line per port and remote type:
+ *   port response area
+ * where port is a stable name of the serial port (see osapi_port_id()) and
+ * response and area are the raw INFO response and info area in hex. An
+ * entry is keyed by the port and the signature at the start of the area, a
+ * lookup returns the one of the port stored last. The entries are only
+ * hints, the library checks them against the remote.
+ * The file is replaced as a whole on every update, with the permissions it
+ * had, updates from several threads are serialized. Concurrent updates from
+ * different processes may lose an entry, which only costs a read of the
+ * info area next time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "infocache.h"
+
+#define INFOCACHE_LINE_LEN (PATH_MAX + 2 * 64 + 4)
+
+static pthread_mutex_t infocache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int hex_decode(const char *hex, uint8_t *buf, int size)
+{
+	int len = 0;
+	unsigned int byte;
+
+	while (hex[0] && hex[1]) {
+		if (len == size || sscanf(hex, "%2x", &byte) != 1) {
+			return -1;
+		}
+		buf[len++] = byte;
+		hex += 2;
+	}
+
+	return (*hex) ? -1 : len;
+}
+
+static void hex_write(FILE *f, const uint8_t *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		fprintf(f, "%02x", buf[i]);
+	}
+}
+
+static int parse_line(char *line, struct infocache_entry *e)
+{
+	char *port;
+	char *response;
+	char *area;
+
+	port = strtok(line, " \n");
+	response = strtok(NULL, " \n");
+	area = strtok(NULL, " \n");
+	if (!port || !response || !area || strlen(port) >= sizeof(e->port)) {
+		return -1;
+	}
+
+	strcpy(e->port, port);
+	e->response_len = hex_decode(response, e->response,
+			sizeof(e->response));
+	e->area_len = hex_decode(area, e->area, sizeof(e->area));
+	if (e->response_len <= 0 || e->area_len < JP2_SIGNATURE_LEN) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* the entry of port, with the signature of e if given */
+static bool same_key(const struct infocache_entry *old, const char *port,
+		const struct infocache_entry *e)
+{
+	if (strcmp(old->port, port)) {
+		return false;
+	}
+	return !e || !memcmp(old->area, e->area, JP2_SIGNATURE_LEN);
+}
+
+int infocache_lookup(const char *path, const char *port,
+		struct infocache_entry *e)
+{
+	int rc = -1;
+	FILE *f;
+	char line[INFOCACHE_LINE_LEN];
+	struct infocache_entry entry;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+
+	/* the last one is the latest */
+	while (fgets(line, sizeof(line), f)) {
+		if (parse_line(line, &entry) == 0 && same_key(&entry, port, NULL)) {
+			*e = entry;
+			rc = 0;
+		}
+	}
+	fclose(f);
+
+	return rc;
+}
+
+/* copy all entries but the one with the key of e, or all of port if e isn't
+ * given, then add e */
+static int rewrite(const char *path, const char *port,
+		const struct infocache_entry *e)
+{
+	int fd;
+	FILE *in;
+	FILE *out;
+	struct stat st;
+	char tmp[PATH_MAX];
+	char line[INFOCACHE_LINE_LEN];
+	char copy[INFOCACHE_LINE_LEN];
+	struct infocache_entry old;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp)) {
+		return -1;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		return -1;
+	}
+	/* mkstemp() creates the file for the owner only */
+	if (stat(path, &st) == 0 && fchmod(fd, st.st_mode & 07777) < 0) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	out = fdopen(fd, "w");
+	if (out == NULL) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	in = fopen(path, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in)) {
+			strcpy(copy, line);
+			if (parse_line(copy, &old) < 0) {
+				continue;
+			}
+			if (same_key(&old, port, e)) {
+				continue;
+			}
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	if (e) {
+		fprintf(out, "%s ", e->port);
+		hex_write(out, e->response, e->response_len);
+		fputc(' ', out);
+		hex_write(out, e->area, e->area_len);
+		fputc('\n', out);
+	}
+
+	if (fclose(out) != 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int rewrite_locked(const char *path, const char *port,
+		const struct infocache_entry *e)
+{
+	int rc;
+
+	pthread_mutex_lock(&infocache_lock);
+	rc = rewrite(path, port, e);
+	pthread_mutex_unlock(&infocache_lock);
+
+	return rc;
+}
+
+int infocache_store(const char *path, const struct infocache_entry *e)
+{
+	return rewrite_locked(path, e->port, e);
+}
+
+/* drop the entry of port, or all entries if port is NULL */
+int infocache_forget(const char *path, const char *port)
+{
+	if (access(path, F_OK) < 0) {
+		return 0;
+	}
+	if (port == NULL) {
+		return unlink(path);
+	}
+
+	return rewrite_locked(path, port, NULL);
+}
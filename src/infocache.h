@@ -0,0 +1,45 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __INFOCACHE_H
+#define __INFOCACHE_H
+
+#include <stdint.h>
+#include <limits.h>
+
+#include "jp2library.h"
+
+/* INFO response and info area as sent by the remote */
+#define INFOCACHE_RESPONSE_LEN 6
+#define INFOCACHE_AREA_LEN (JP2_SIGNATURE_LEN + 6 * sizeof(uint32_t))
+
+struct infocache_entry {
+	char port[PATH_MAX];
+	uint8_t response[INFOCACHE_RESPONSE_LEN];
+	int response_len;
+	uint8_t area[INFOCACHE_AREA_LEN];
+	int area_len;
+};
+
+int infocache_lookup(const char *path, const char *port,
+		struct infocache_entry *e);
+int infocache_store(const char *path, const struct infocache_entry *e);
+int infocache_forget(const char *path, const char *port);
+
+#endif /* __INFOCACHE_H */
@@ -18,59 +18,155 @@
  */
 
 #include <assert.h>
-#include <stdarg.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "osapi.h"
 #include "jp2library.h"
+#include "trace.h"
+#include "stats.h"
+#include "rx.h"
+#include "infocache.h"
+
+/* a request in flight, the remote answers them in order */
+struct jp2_request {
+	uint8_t *dst;			/* where the payload goes, if it fits */
+	int dstlen;
+	int timeout;			/* in ms, negative waits forever */
+	jp2_complete_cb cb;		/* NULL for the synchronous calls */
+	void *priv;
+};
 
 struct jp2_remote {
+	struct osapi_ops *ops;
 	void *handle; /* opaque to this library */
 	uint8_t txbuf[2048];
 	uint8_t rxbuf[2048];
+	struct jp2_rx rx;
 	int addr_width;
+	int read_window;
+	int read_chunk;
+	int write_chunk;
+	int erase_block;		/* 0 if unknown */
+	uint32_t info_area_offset;
+	int baudrate;
+	int timeouts[JP2_STATS_CMDS];	/* per command class, in ms */
+	struct jp2_request req[JP2_MAX_INFLIGHT];
+	unsigned int req_head;		/* free running */
+	unsigned int req_tail;
+	unsigned int req_async;		/* requests in flight with a cb */
+	bool rx_started;		/* parsing the answer to req_tail */
+	uint32_t rx_since;		/* last progress of the answer, in ms */
+	int sync_rc;			/* outcome of the last synchronous */
+	uint8_t *sync_data;		/* request */
+	bool extended_mode;
+	int reset_pulse;		/* in us */
+	int poll_timeout;		/* in ms */
+	bool reset_pulse_fixed;
+	int wake_pulse;			/* pulse and boot time (in ms) of */
+	int wake_boot;			/* the last loader entry */
+	char signature[JP2_SIGNATURE_LEN + 1];	/* of the last jp2_get_info() */
+	char devname[JP2_DEVNAME_LEN];
+	char info_cache[PATH_MAX];	/* file, empty if not cached */
+	char port[PATH_MAX];		/* stable name of devname */
+	jp2_progress_cb progress;
+	void *progress_priv;
+	struct jp2_stats_state stats;
+#ifdef JP2_TRACE
+	struct jp2_trace trace;
+#endif
 };
 
+#ifdef JP2_TRACE
+#define trace(r, type, rc, a, b) \
+	trace_event(&(r)->trace, type, rc, a, b, NULL, 0)
+#define trace_data(r, type, rc, a, b, data, len) \
+	trace_event(&(r)->trace, type, rc, a, b, data, len)
+#else
+#define trace(r, type, rc, a, b) \
+	trace_event(NULL, type, rc, a, b, NULL, 0)
+#define trace_data(r, type, rc, a, b, data, len) \
+	trace_event(NULL, type, rc, a, b, data, len)
+#endif
+
+/* default and maximum payload size of a single READ or WRITE command. The
+ * maximum is bound by the size of our rx and tx buffers. */
 #define JP2_CHUNK_SIZE 128
+#define JP2_MAX_CHUNK_SIZE 1024
+#define JP2_MAX_WINDOW 16
+
+/* Checksum errors, framing errors and timeouts are caused by a noisy link.
+ * Commands which can be sent again are retried that often after
+ * resynchronising. */
+#define JP2_MAX_RETRIES 3
+#define JP2_RESYNC_QUIET_MS 20
+#define JP2_RESYNC_MAX_MS 2000
+
+/* Response timeouts, in ms. The time to transfer the response is added.
+ * Erasing takes the remote quite some time. */
+#define JP2_RX_MARGIN_MS 50
+static const int jp2_default_timeouts[JP2_STATS_CMDS] = {
+	[JP2_STATS_READ] = 200,
+	[JP2_STATS_WRITE] = 500,
+	[JP2_STATS_ERASE] = 5000,
+	[JP2_STATS_CHECKSUM] = 1000,
+	[JP2_STATS_INFO] = 200,
+	[JP2_STATS_LOADER] = 500,
+	[JP2_STATS_OTHER] = 1000,
+};
+
+/* Loader entry. The remote is held in reset for JP2_RESET_PULSE_US, then
+ * polled every JP2_POLL_INTERVAL_MS until it answers. */
+#define JP2_RESET_PULSE_US 100000
+#define JP2_MIN_RESET_PULSE_US 1000
+#define JP2_POLL_INTERVAL_MS 10
+#define JP2_POLL_TIMEOUT_MS 1000
+#define JP2_POLL_REPLY_LEN 4
+
+/* Reset pulse widths learned per remote type, see jp2_wake(). */
+#define JP2_LEARNED_PULSES 8
+struct jp2_learned_pulse {
+	char signature[JP2_SIGNATURE_LEN + 1];
+	char devname[JP2_DEVNAME_LEN];	/* where it was seen last */
+	int good;			/* known to work, in us */
+	int next;			/* tried next time, in us */
+	int boot;			/* from the reset until the answer, in ms */
+};
+static struct jp2_learned_pulse jp2_learned[JP2_LEARNED_PULSES];
+static pthread_mutex_t jp2_learned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Erase block sizes per remote type, set or probed by the user of the
+ * library, see jp2_probe_erase_block(). The probe tries the powers of two
+ * from JP2_MIN_ERASE_BLOCK to JP2_MAX_ERASE_BLOCK. */
+#define JP2_GEOMETRIES 8
+#define JP2_MIN_ERASE_BLOCK 64
+#define JP2_MAX_ERASE_BLOCK 4096
+#define JP2_PROBE_AREA (2 * JP2_MAX_ERASE_BLOCK)
+struct jp2_geometry {
+	char signature[JP2_SIGNATURE_LEN + 1];
+	int erase_block;
+};
+static struct jp2_geometry jp2_geometries[JP2_GEOMETRIES];
+static pthread_mutex_t jp2_geometry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* line speeds tried by jp2_probe_host_baudrate(), in ascending order */
+static const int jp2_baudrates[] = {
+	38400, 57600, 115200, 230400, 460800, 921600,
+};
 
 #ifndef GIT_VERSION
 #define GIT_VERSION ""
 #endif
 
 const char* jp2_version = "0.2" GIT_VERSION;
-static int debug_level = 0;
-
-static char *hexdump(uint8_t *data, int len)
-{
-	char *buf, *ptr;
-	ptr = buf = malloc(len * 3 + 1);
-
-	while (len--) {
-		ptr += sprintf(ptr, "%02x ", *data++);
-	}
-
-	return buf;
-}
-
-static int debug(int lvl, const char *fmt, ...)
-{
-	int rc;
-	va_list ap;
-
-	if (lvl <= debug_level) {
-		va_start(ap, fmt);
-		rc = vfprintf(stderr, fmt, ap);
-		va_end(ap);
-	}
-
-	return rc;
-}
-
 /*
  * Helper functions
  */
@@ -129,94 +225,455 @@ static uint8_t jp2_checksum(uint8_t *data, int len)
 	return csum;
 }
 
+static uint32_t jp2_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /* RTS# is connected to the RESET# input of the remote */
-static void jp2_reset(struct jp2_remote *r)
+static void jp2_reset(struct jp2_remote *r, int pulse_us)
 {
 	int rc;
 
-	debug(1, "%s: pulsing RTS#\n", __func__);
+	trace(r, JP2_TRACE_RESET, 0, pulse_us, 0);
 
-	rc = osapi->reset(r->handle, true);
+	rc = r->ops->reset(r->handle, true);
 	assert(!rc);
 
-	usleep(100000);
+	usleep(pulse_us);
 
-	rc = osapi->reset(r->handle, false);
+	rc = r->ops->reset(r->handle, false);
 	assert(!rc);
 }
 
-static int jp2_send(struct jp2_remote *r, const uint8_t *data, int len)
+/* the pulse width to use for the remote, known by its signature or by the
+ * device it was seen on last */
+static bool jp2_learned_lookup(struct jp2_remote *r,
+		struct jp2_learned_pulse *l)
+{
+	int i;
+	bool found = false;
+
+	pthread_mutex_lock(&jp2_learned_lock);
+	for (i = 0; i < JP2_LEARNED_PULSES; i++) {
+		if (!jp2_learned[i].signature[0]) {
+			continue;
+		}
+		if ((r->signature[0] &&
+				!strcmp(jp2_learned[i].signature, r->signature)) ||
+				(!r->signature[0] &&
+				!strcmp(jp2_learned[i].devname, r->devname))) {
+			*l = jp2_learned[i];
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&jp2_learned_lock);
+
+	return found;
+}
+
+static void jp2_learned_update(struct jp2_remote *r, const char *signature,
+		int pulse, int boot, bool ok)
+{
+	int i;
+	struct jp2_learned_pulse *l = NULL;
+
+	pthread_mutex_lock(&jp2_learned_lock);
+	for (i = 0; i < JP2_LEARNED_PULSES; i++) {
+		if (!strcmp(jp2_learned[i].signature, signature)) {
+			l = &jp2_learned[i];
+			break;
+		}
+	}
+
+	if (!l && ok) {
+		/* take a free slot, or replace the first one */
+		l = &jp2_learned[0];
+		for (i = 0; i < JP2_LEARNED_PULSES; i++) {
+			if (!jp2_learned[i].signature[0]) {
+				l = &jp2_learned[i];
+				break;
+			}
+		}
+		strcpy(l->signature, signature);
+		l->good = INT_MAX;
+	}
+
+	if (l && ok) {
+		strcpy(l->devname, r->devname);
+		l->boot = boot;
+		if (pulse < l->good) {
+			/* try an even shorter one next time */
+			l->good = pulse;
+			l->next = pulse / 2;
+			if (l->next < JP2_MIN_RESET_PULSE_US) {
+				l->next = JP2_MIN_RESET_PULSE_US;
+			}
+		}
+	} else if (l && pulse < l->good) {
+		/* too short, stay with the last working one */
+		l->next = l->good;
+	}
+	pthread_mutex_unlock(&jp2_learned_lock);
+}
+
+/* erase block size of a remote type, 0 if unknown */
+static int jp2_geometry_lookup(const char *signature)
+{
+	int i;
+	int size = 0;
+
+	pthread_mutex_lock(&jp2_geometry_lock);
+	for (i = 0; i < JP2_GEOMETRIES; i++) {
+		if (jp2_geometries[i].signature[0] &&
+				!strcmp(jp2_geometries[i].signature, signature)) {
+			size = jp2_geometries[i].erase_block;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&jp2_geometry_lock);
+
+	return size;
+}
+
+static void jp2_geometry_update(const char *signature, int size)
+{
+	int i;
+	struct jp2_geometry *g = &jp2_geometries[0];
+
+	pthread_mutex_lock(&jp2_geometry_lock);
+	for (i = 0; i < JP2_GEOMETRIES; i++) {
+		if (!strcmp(jp2_geometries[i].signature, signature) ||
+				!jp2_geometries[i].signature[0]) {
+			g = &jp2_geometries[i];
+			break;
+		}
+	}
+	strcpy(g->signature, signature);
+	g->erase_block = size;
+	pthread_mutex_unlock(&jp2_geometry_lock);
+}
+
+/* discard any pending input */
+static void jp2_flush(struct jp2_remote *r)
+{
+	r->ops->flush(r->handle);
+	rx_reset(&r->rx);
+	stats_flush(&r->stats);
+	r->req_tail = r->req_head;
+	r->req_async = 0;
+	r->rx_started = false;
+}
+
+/*
+ * Frames are built in place. The caller puts the command and its arguments
+ * at JP2_TXHDR(r), the payload (if any) is only referenced and sent from
+ * where it is, together with the length and checksum, in a single writev().
+ */
+#define JP2_TXHDR(r) ((r)->txbuf + 2)
+
+/* the request just sent, answered synchronously unless cb is set later */
+static void jp2_enqueue(struct jp2_remote *r, int timeout)
+{
+	struct jp2_request *q;
+
+	assert(r->req_head - r->req_tail < JP2_MAX_INFLIGHT);
+
+	if (r->req_head == r->req_tail) {
+		r->rx_since = jp2_now_ms();
+	}
+	q = &r->req[r->req_head++ & (JP2_MAX_INFLIGHT - 1)];
+	q->dst = NULL;
+	q->dstlen = 0;
+	q->timeout = timeout;
+	q->cb = NULL;
+	q->priv = NULL;
+}
+
+static int _jp2_send_frame(struct jp2_remote *r, int hdrlen,
+		const uint8_t *payload, int paylen, int timeout)
 {
 	int rc;
+	int len = hdrlen + paylen;
+	int iovcnt = 0;
+	struct iovec iov[3];
+	uint8_t *csum = r->txbuf + hdrlen + 2;
 
-	assert(len < (sizeof(r->txbuf) - 3));
+	assert(hdrlen < (sizeof(r->txbuf) - 3));
 
 	/* put in the length */
 	r->txbuf[0] = ((len + 1) >> 8) & 0xff;
 	r->txbuf[1] = (len + 1) & 0xff;
 
-	memcpy(r->txbuf + 2, data, len);
+	*csum = jp2_checksum(r->txbuf, hdrlen + 2)
+		^ jp2_checksum((uint8_t*)payload, paylen);
 
-	r->txbuf[len+2] = jp2_checksum(r->txbuf, len + 2);
+	trace_data(r, JP2_TRACE_TX, 0, len + 3, 0, r->txbuf, hdrlen + 2);
 
-	debug(1, "%s: %s\n", __func__, hexdump(r->txbuf, len + 3));
+	iov[iovcnt].iov_base = r->txbuf;
+	iov[iovcnt].iov_len = hdrlen + 2;
+	iovcnt++;
+	if (paylen) {
+		iov[iovcnt].iov_base = (void*)payload;
+		iov[iovcnt].iov_len = paylen;
+		iovcnt++;
+	}
+	iov[iovcnt].iov_base = csum;
+	iov[iovcnt].iov_len = 1;
+	iovcnt++;
 
-	rc = osapi->write(r->handle, r->txbuf, len + 3);
+	rc = r->ops->writev(r->handle, iov, iovcnt);
 	if (rc != len + 3) {
 		return -1;
 	}
+	stats_sent(&r->stats, r->txbuf[2], len + 3);
+	jp2_enqueue(r, timeout);
 
 	return 0;
 }
 
-static int jp2_receive(struct jp2_remote *r, uint8_t **data)
+/* how long the remote may take to answer the command at JP2_TXHDR(r) */
+static int jp2_cmd_timeout(struct jp2_remote *r)
 {
-	int rc;
-	int len;
-	uint8_t csum;
+	return r->timeouts[stats_cmd_class(JP2_TXHDR(r)[0])];
+}
 
-	/* first read the length */
-	rc = osapi->read(r->handle, r->rxbuf, 2);
-	if (rc < 0) {
-		debug(1, "%s: read() returned error %d\n", __func__, rc);
-		return -1;
+/* a synchronous request, which can't wait behind asynchronous ones */
+static int jp2_send_frame_timeout(struct jp2_remote *r, int hdrlen,
+		const uint8_t *payload, int paylen, int timeout)
+{
+	if (r->req_async) {
+		return -JP2_ERR_BUSY;
 	}
-	assert(rc == 2);
 
-	debug(1, "%s: len=%s\n", __func__, hexdump(r->rxbuf, 2));
-	len = (r->rxbuf[0] << 8) | r->rxbuf[1];
-	assert(len < (sizeof(r->rxbuf) - 2));
-	/* we expect at least an error code and a checksum byte */
-	assert(len >= 2);
+	return _jp2_send_frame(r, hdrlen, payload, paylen, timeout);
+}
+
+static int jp2_send_frame(struct jp2_remote *r, int hdrlen,
+		const uint8_t *payload, int paylen)
+{
+	return jp2_send_frame_timeout(r, hdrlen, payload, paylen,
+			jp2_cmd_timeout(r));
+}
 
-	/* read remaining bytes */
-	rc = osapi->read(r->handle, r->rxbuf + 2, len);
-	if (rc < 0) {
-		debug(1, "%s: read() returned error %d\n", __func__, rc);
-		return -1;
+static int jp2_send(struct jp2_remote *r, const uint8_t *data, int len)
+{
+	assert(len < (sizeof(r->txbuf) - 3));
+
+	memcpy(JP2_TXHDR(r), data, len);
+
+	return jp2_send_frame(r, len, NULL, 0);
+}
+
+/* time to transfer the given number of bytes, in ms */
+static int jp2_transfer_ms(struct jp2_remote *r, int bytes)
+{
+	/* 8N1, ten bits per byte */
+	return bytes * 10 * 1000 / r->baudrate + 1;
+}
+
+static int jp2_receive_failed(struct jp2_remote *r, int rc, int timeout,
+		int received)
+{
+	if (rc == OSAPI_ERR_TIMEOUT) {
+		trace(r, JP2_TRACE_TIMEOUT, 0, timeout, 0);
+		stats_received(&r->stats, received, -JP2_ERR_TIMEOUT);
+		return -JP2_ERR_TIMEOUT;
 	}
-	assert(rc == len);
 
-	debug(1, "%s: %s\n", __func__, hexdump(r->rxbuf, len + 2));
+	trace(r, JP2_TRACE_IO_ERROR, rc, 0, 0);
+	stats_received(&r->stats, received, -1);
+	return -1;
+}
+
+/* the response to the oldest request is complete, check it */
+static int jp2_rx_result(struct jp2_remote *r, uint8_t **data)
+{
+	int payload;
+	uint8_t *dst;
 
-	/* check checksum */
-	csum = jp2_checksum(r->rxbuf, len + 2);
-	if (csum != 0) {
-		debug(1, "%s: checksum error (%02x).\n", __func__, csum);
+	payload = rx_payload_len(&r->rx);
+	dst = r->rx.dst;
+
+	trace_data(r, JP2_TRACE_RX, 0, payload, r->rx.hdr[2], dst, payload);
+
+	if (r->rx.csum != 0) {
+		trace(r, JP2_TRACE_BAD_CHECKSUM, 0, r->rx.csum, 0);
+		stats_received(&r->stats, r->rx.received,
+				-JP2_ERR_WRONG_CHECKSUM);
 		return -JP2_ERR_WRONG_CHECKSUM;
 	}
 
 	/* check error code */
-	if (r->rxbuf[2] != JP2_ERR_NO_ERR) {
-		return -r->rxbuf[2];
+	if (r->rx.hdr[2] != JP2_ERR_NO_ERR) {
+		stats_received(&r->stats, r->rx.received, -r->rx.hdr[2]);
+		return -r->rx.hdr[2];
 	}
+	stats_received(&r->stats, r->rx.received, 0);
 
 	/* if we received actual data, return it */
-	if ((len > 2) && data) {
-		*data = r->rxbuf + 3;
+	if (payload) {
+		*data = dst;
+	}
+
+	return payload;
+}
+
+/* the oldest request is done, hand its outcome to whoever waits for it */
+static void jp2_complete(struct jp2_remote *r, int rc, uint8_t *data)
+{
+	struct jp2_request *q = &r->req[r->req_tail & (JP2_MAX_INFLIGHT - 1)];
+
+	r->req_tail++;
+	r->rx_started = false;
+	r->rx_since = jp2_now_ms();
+
+	if (q->cb) {
+		r->req_async--;
+		q->cb(q->priv, rc, data);
+	} else {
+		r->sync_rc = rc;
+		r->sync_data = data;
+	}
+}
+
+/*
+ * Parse the buffered input for the response to the oldest request. Returns
+ * 0 if more input is needed, otherwise the request is completed and 1 or
+ * -JP2_ERR_FRAMING is returned.
+ */
+static int jp2_rx_parse(struct jp2_remote *r)
+{
+	int rc;
+	uint8_t *data = NULL;
+	struct jp2_request *q = &r->req[r->req_tail & (JP2_MAX_INFLIGHT - 1)];
+
+	if (!r->rx_started) {
+		rx_begin(&r->rx, q->dst, q->dstlen, r->rxbuf,
+				sizeof(r->rxbuf));
+		r->rx_started = true;
+	}
+
+	rc = rx_parse(&r->rx);
+	if (rc == 0) {
+		return 0;
 	}
 
-	return len - 2;
+	if (rc < 0) {
+		trace(r, JP2_TRACE_FRAMING, 0, r->rx.len, 0);
+		stats_received(&r->stats, r->rx.received, rc);
+		jp2_complete(r, rc, NULL);
+		return rc;
+	}
+
+	rc = jp2_rx_result(r, &data);
+	jp2_complete(r, rc, data);
+	return 1;
+}
+
+/*
+ * How long the oldest request may still take, in ms. The remote needs some
+ * time to handle the command, once it started to answer only the transfer
+ * is left. Negative if it waits forever, the whole time in *limit.
+ */
+static int jp2_rx_remaining(struct jp2_remote *r, int *limit)
+{
+	int elapsed;
+	struct jp2_request *q = &r->req[r->req_tail & (JP2_MAX_INFLIGHT - 1)];
+
+	if (r->rx_started && r->rx.received) {
+		*limit = jp2_transfer_ms(r, rx_missing(&r->rx))
+			+ JP2_RX_MARGIN_MS;
+	} else {
+		*limit = q->timeout;
+	}
+	if (*limit < 0) {
+		return -1;
+	}
+
+	elapsed = jp2_now_ms() - r->rx_since;
+	return (elapsed < *limit) ? *limit - elapsed : 0;
+}
+
+/*
+ * Read what the serial port has to offer, which may already include the
+ * following responses, waiting at most timeout_ms. Returns 0 if there was
+ * no error. If the oldest request timed out or the read failed, the request
+ * is completed with that error, which is returned.
+ */
+static int jp2_rx_read(struct jp2_remote *r, int timeout_ms)
+{
+	int rc;
+	int wait;
+	int limit;
+	int remaining;
+	size_t space;
+	uint8_t *buf;
+
+	remaining = jp2_rx_remaining(r, &limit);
+	wait = remaining;
+	if (timeout_ms >= 0 && (wait < 0 || timeout_ms < wait)) {
+		wait = timeout_ms;
+	}
+
+	buf = rx_space(&r->rx, &space);
+	rc = r->ops->read_some(r->handle, buf, space, wait);
+	if (rc > 0) {
+		rx_commit(&r->rx, rc);
+		r->rx_since = jp2_now_ms();
+		return 0;
+	}
+	if (rc == OSAPI_ERR_TIMEOUT && wait != remaining) {
+		/* only the caller's time is up */
+		return 0;
+	}
+
+	rc = jp2_receive_failed(r, rc, limit, r->rx.received);
+	jp2_complete(r, rc, NULL);
+	return rc;
+}
+
+/*
+ * Receive the response to the oldest request in flight.
+ *
+ * If the caller supplied a destination which is large enough, the payload
+ * is stored there, otherwise in rxbuf.
+ */
+static int jp2_receive_into(struct jp2_remote *r, uint8_t *dst, int dstlen,
+		uint8_t **data)
+{
+	unsigned int tail = r->req_tail;
+	struct jp2_request *q = &r->req[tail & (JP2_MAX_INFLIGHT - 1)];
+
+	assert(r->req_head != tail);
+	assert(!q->cb);
+
+	if (!r->rx_started) {
+		q->dst = dst;
+		q->dstlen = dstlen;
+	}
+
+	while (jp2_rx_parse(r) == 0) {
+		if (jp2_rx_read(r, -1) < 0) {
+			break;
+		}
+	}
+	assert(r->req_tail == tail + 1);
+
+	if (r->sync_rc > 0 && data) {
+		*data = r->sync_data;
+	}
+
+	return r->sync_rc;
+}
+
+static int jp2_receive(struct jp2_remote *r, uint8_t **data)
+{
+	return jp2_receive_into(r, NULL, 0, data);
 }
 
 int jp2_command(struct jp2_remote *r, const uint8_t *txdata, int txlen,
@@ -237,64 +694,93 @@ int jp2_simple_command(struct jp2_remote *r, const uint8_t cmd)
 	return jp2_command(r, &cmd, 1, NULL);
 }
 
-static int _jp2_read_block(struct jp2_remote *r, uint32_t address,
-		uint16_t len, uint8_t **data)
+/* like jp2_command(), but the header is already in place */
+static int jp2_transact(struct jp2_remote *r, int hdrlen,
+		const uint8_t *payload, int paylen, uint8_t **rxdata)
 {
-	uint8_t buf[16], *ptr = buf;
-	int txlen;
-	assert(len <= JP2_CHUNK_SIZE);
+	int rc;
 
-	*ptr++ = JP2_CMD_READ;
-	txlen = 1;
-	if (r->addr_width == 2) {
-		txlen += write_u16_to_buf(&ptr, address);
-	} else {
-		txlen += write_u32_to_buf(&ptr, address);
+	rc = jp2_send_frame(r, hdrlen, payload, paylen);
+	if (rc < 0) {
+		return rc;
 	}
-	txlen += write_u16_to_buf(&ptr, len);
 
-	return jp2_command(r, buf, txlen, data);
+	return jp2_receive(r, rxdata);
 }
 
-int jp2_read_block(struct jp2_remote *r, uint32_t address, uint16_t len,
-		uint8_t *data)
+static bool jp2_retryable(int rc)
 {
-	int rc;
-	uint16_t rxlen;
-	uint8_t *_data;
-	uint32_t bytes_read = 0;
+	return rc == -JP2_ERR_WRONG_CHECKSUM || rc == -JP2_ERR_FRAMING
+		|| rc == -JP2_ERR_TIMEOUT;
+}
 
-	while (bytes_read < len)
-	{
-		rxlen = len - bytes_read;
-		if (rxlen > JP2_CHUNK_SIZE) {
-			rxlen = JP2_CHUNK_SIZE;
+/*
+ * Get back in sync after a corrupted frame. Wait until the remote stopped
+ * sending, which covers the rest of the frame and the responses to any
+ * other requests in flight, and discard everything received.
+ */
+static void jp2_resync(struct jp2_remote *r)
+{
+	int rc;
+	int wait;
+	uint32_t start = jp2_now_ms();
+	uint32_t discarded = 0;
+	uint8_t buf[64];
+
+	for (;;) {
+		wait = JP2_RESYNC_MAX_MS - (int)(jp2_now_ms() - start);
+		if (wait <= 0) {
+			break;
 		}
-		rc = _jp2_read_block(r, address, rxlen, &_data);
-		if (rc < 0) {
-			return rc;
+		if (wait > JP2_RESYNC_QUIET_MS) {
+			wait = JP2_RESYNC_QUIET_MS;
+		}
+		rc = r->ops->read_some(r->handle, buf, sizeof(buf), wait);
+		if (rc <= 0) {
+			break;
 		}
-		assert(rc == rxlen);
+		discarded += rc;
+	}
 
-		memcpy(data, _data, rxlen);
+	trace(r, JP2_TRACE_RESYNC, 0, discarded, 0);
+	jp2_flush(r);
+}
 
-		data += rxlen;
-		address += rxlen;
-		bytes_read += rxlen;
-	}
+/* the last request failed with rc, get ready to send it again */
+static void jp2_retry(struct jp2_remote *r, int rc, int attempt)
+{
+	uint8_t cmd = JP2_TXHDR(r)[0];
 
-	return bytes_read;
+	trace(r, JP2_TRACE_RETRY, rc, cmd, attempt);
+	stats_retry(&r->stats, cmd);
+	jp2_resync(r);
 }
 
-static int _jp2_write_block(struct jp2_remote *r, uint32_t address,
-		uint16_t len, uint8_t *data)
+/* like jp2_transact(), for commands without a payload which may be sent
+ * more than once */
+static int jp2_transact_idempotent(struct jp2_remote *r, int hdrlen,
+		uint8_t **rxdata)
 {
 	int rc;
-	uint8_t buf[16], *ptr = buf;
-	uint8_t *buf2;
+	int attempt = 0;
+
+	for (;;) {
+		rc = jp2_transact(r, hdrlen, NULL, 0, rxdata);
+		if (!jp2_retryable(rc) || attempt == JP2_MAX_RETRIES) {
+			return rc;
+		}
+		jp2_retry(r, rc, ++attempt);
+	}
+}
+
+/* the command and an address of the width the remote uses */
+static int jp2_build_address_command(struct jp2_remote *r, uint8_t cmd,
+		uint32_t address, uint8_t *buf)
+{
+	uint8_t *ptr = buf;
 	int txlen;
 
-	*ptr++ = JP2_CMD_WRITE;
+	*ptr++ = cmd;
 	txlen = 1;
 	if (r->addr_width == 2) {
 		txlen += write_u16_to_buf(&ptr, address);
@@ -302,50 +788,32 @@ static int _jp2_write_block(struct jp2_remote *r, uint32_t address,
 		txlen += write_u32_to_buf(&ptr, address);
 	}
 
-	/* XXX */
-	buf2 = malloc(len + txlen);
-	memcpy(buf2, buf, txlen);
-	memcpy(buf2 + txlen, data, len);
-	txlen += len;
-
-	rc = jp2_command(r, buf2, txlen, NULL);
-	free(buf2);
-
-	return rc;
+	return txlen;
 }
 
-int jp2_write_block(struct jp2_remote *r, uint32_t address, uint16_t len,
-		uint8_t *data)
+static int jp2_build_read_command(struct jp2_remote *r, uint32_t address,
+		uint16_t len, uint8_t *buf)
 {
-	int rc;
-	uint16_t txlen;
-	uint32_t bytes_written = 0;
+	uint8_t *ptr;
+	int txlen;
 
-	while (bytes_written < len)
-	{
-		txlen = len - bytes_written;
-		if (txlen > JP2_CHUNK_SIZE) {
-			txlen = JP2_CHUNK_SIZE;
-		}
-		rc = _jp2_write_block(r, address, txlen, data);
-		if (rc < 0) {
-			return rc;
-		}
+	assert(len <= JP2_MAX_CHUNK_SIZE);
 
-		address += txlen;
-		data += txlen;
-		bytes_written += txlen;
-	}
+	txlen = jp2_build_address_command(r, JP2_CMD_READ, address, buf);
+	ptr = buf + txlen;
+	txlen += write_u16_to_buf(&ptr, len);
 
-	return bytes_written;
+	return txlen;
 }
 
-int jp2_erase_block(struct jp2_remote *r, uint32_t start, uint32_t end)
+/* commands with a start and an end address, both inclusive */
+static int jp2_build_range_command(struct jp2_remote *r, uint8_t cmd,
+		uint32_t start, uint32_t end, uint8_t *buf)
 {
-	uint8_t buf[16], *ptr = buf;
+	uint8_t *ptr = buf;
 	int txlen;
 
-	*ptr++ = JP2_CMD_ERASE;
+	*ptr++ = cmd;
 	txlen = 1;
 	if (r->addr_width == 2) {
 		txlen += write_u16_to_buf(&ptr, start);
@@ -354,173 +822,1743 @@ int jp2_erase_block(struct jp2_remote *r, uint32_t start, uint32_t end)
 		txlen += write_u32_to_buf(&ptr, start);
 		txlen += write_u32_to_buf(&ptr, end);
 	}
-	return jp2_command(r, buf, txlen, NULL);
+
+	return txlen;
 }
 
-int jp2_checksum_block(struct jp2_remote *r, uint32_t start, uint32_t end)
+static int _jp2_read_block(struct jp2_remote *r, uint32_t address,
+		uint16_t len, uint8_t **data)
+{
+	int txlen;
+
+	txlen = jp2_build_read_command(r, address, len, JP2_TXHDR(r));
+	return jp2_transact_idempotent(r, txlen, data);
+}
+
+/*
+ * Pipelined transfers.
+ *
+ * The remote handles one command after another and answers them in the order
+ * they were received. Thus we can send up to read_window requests before
+ * waiting for the first response and match the responses to the requests by
+ * their position. If an error occurs, no further requests are sent but all
+ * outstanding responses are drained, so the stream stays in sync.
+ *
+ * The requests must be idempotent. On a checksum or framing error the
+ * responses still in flight can't be trusted, so they are discarded and
+ * all requests starting with the failed one are sent again.
+ */
+struct jp2_pipeline {
+	int count;
+	/* builds the request with the given index, returns its length */
+	int (*build)(struct jp2_remote *r, void *priv, int idx, uint8_t *buf);
+	/* consumes the response to the request with the given index, the
+	 * request is sent again if this fails with a retryable error */
+	int (*complete)(struct jp2_remote *r, void *priv, int idx,
+			uint8_t *data, int len);
+	/* optional, where to put the payload of the response */
+	uint8_t *(*dest)(struct jp2_remote *r, void *priv, int idx, int *len);
+	void *priv;
+};
+
+static int jp2_pipeline_run(struct jp2_remote *r, struct jp2_pipeline *p)
 {
 	int rc;
-	uint8_t buf[16], *ptr = buf;
+	int err = 0;
+	int sent = 0;
+	int done = 0;
+	int attempt = 0;
+	int attempt_idx = -1;
 	int txlen;
+	int dstlen;
 	uint8_t *data;
+	uint8_t *dst;
 
-	*ptr++ = JP2_CMD_CHECKSUM;
-	txlen = 1;
-	if (r->addr_width == 2) {
-		txlen += write_u16_to_buf(&ptr, start);
-		txlen += write_u16_to_buf(&ptr, end);
-	} else {
-		txlen += write_u32_to_buf(&ptr, start);
-		txlen += write_u32_to_buf(&ptr, end);
+	/* an error flushes, which would drop the asynchronous requests */
+	if (r->req_async) {
+		return -JP2_ERR_BUSY;
 	}
 
-	rc = jp2_command(r, buf, txlen, &data);
-	if (rc < 0) {
-		return rc;
+	while (done < p->count) {
+		while (!err && sent < p->count
+				&& (sent - done) < r->read_window) {
+			txlen = p->build(r, p->priv, sent, JP2_TXHDR(r));
+			rc = jp2_send_frame(r, txlen, NULL, 0);
+			if (rc < 0) {
+				err = rc;
+				break;
+			}
+			sent++;
+		}
+
+		if (done == sent) {
+			break;
+		}
+
+		data = NULL;
+		dst = NULL;
+		dstlen = 0;
+		if (p->dest) {
+			dst = p->dest(r, p->priv, done, &dstlen);
+		}
+		rc = jp2_receive_into(r, dst, dstlen, &data);
+		if (rc >= 0 && !err) {
+			rc = p->complete(r, p->priv, done, data, rc);
+		}
+		if (!err && jp2_retryable(rc)) {
+			if (attempt_idx != done) {
+				attempt_idx = done;
+				attempt = 0;
+			}
+			if (attempt < JP2_MAX_RETRIES) {
+				jp2_retry(r, rc, ++attempt);
+				sent = done;
+				continue;
+			}
+		}
+		if (rc < 0 && !err) {
+			trace(r, JP2_TRACE_REQUEST_FAILED, rc, done,
+					sent - done - 1);
+			err = rc;
+		}
+		done++;
+
+		if (r->progress && !err) {
+			r->progress(r->progress_priv, done, p->count);
+		}
+	}
+
+	if (err) {
+		jp2_flush(r);
+	}
+
+	return err;
+}
+
+struct jp2_read_ctx {
+	uint32_t address;
+	uint32_t len;
+	uint8_t *data;
+	int chunk;
+};
+
+static int jp2_read_chunk_len(struct jp2_read_ctx *ctx, int idx)
+{
+	uint32_t offset = idx * ctx->chunk;
+
+	if (ctx->len - offset > ctx->chunk) {
+		return ctx->chunk;
+	}
+	return ctx->len - offset;
+}
+
+static int jp2_read_build(struct jp2_remote *r, void *priv, int idx,
+		uint8_t *buf)
+{
+	struct jp2_read_ctx *ctx = priv;
+
+	return jp2_build_read_command(r, ctx->address + idx * ctx->chunk,
+			jp2_read_chunk_len(ctx, idx), buf);
+}
+
+/* the payload goes directly into the buffer of the caller */
+static uint8_t *jp2_read_dest(struct jp2_remote *r, void *priv, int idx,
+		int *len)
+{
+	struct jp2_read_ctx *ctx = priv;
+
+	*len = jp2_read_chunk_len(ctx, idx);
+	return ctx->data + idx * ctx->chunk;
+}
+
+static int jp2_read_complete(struct jp2_remote *r, void *priv, int idx,
+		uint8_t *data, int len)
+{
+	struct jp2_read_ctx *ctx = priv;
+
+	/* the checksum matched, but not the length */
+	if (len != jp2_read_chunk_len(ctx, idx)
+			|| data != ctx->data + idx * ctx->chunk) {
+		trace(r, JP2_TRACE_FRAMING, 0, len, 0);
+		return -JP2_ERR_FRAMING;
+	}
+
+	return 0;
+}
+
+int jp2_read_block(struct jp2_remote *r, uint32_t address, uint32_t len,
+		uint8_t *data)
+{
+	int rc;
+	struct jp2_read_ctx ctx = {
+		.address = address,
+		.len = len,
+		.data = data,
+		.chunk = r->read_chunk,
+	};
+	struct jp2_pipeline p = {
+		.count = (len + r->read_chunk - 1) / r->read_chunk,
+		.build = jp2_read_build,
+		.complete = jp2_read_complete,
+		.dest = jp2_read_dest,
+		.priv = &ctx,
+	};
+
+	rc = jp2_pipeline_run(r, &p);
+	if (rc < 0) {
+		return rc;
+	}
+
+	return len;
+}
+
+void jp2_set_progress_cb(struct jp2_remote *r, jp2_progress_cb cb,
+		void *priv)
+{
+	r->progress = cb;
+	r->progress_priv = priv;
+}
+
+void jp2_set_trace_sink(struct jp2_remote *r, jp2_trace_sink sink,
+		void *priv)
+{
+#ifdef JP2_TRACE
+	r->trace.sink_priv = priv;
+	r->trace.sink = sink;
+#endif
+}
+
+int jp2_trace_drain(struct jp2_remote *r, jp2_trace_sink sink, void *priv)
+{
+#ifdef JP2_TRACE
+	return trace_drain(&r->trace, sink, priv);
+#else
+	return 0;
+#endif
+}
+
+int jp2_set_read_window(struct jp2_remote *r, int window)
+{
+	if (window < 1 || window > JP2_MAX_WINDOW) {
+		return -1;
+	}
+
+	r->read_window = window;
+
+	return 0;
+}
+
+static int _jp2_write_block(struct jp2_remote *r, uint32_t address,
+		uint16_t len, uint8_t *data)
+{
+	int txlen;
+
+	txlen = jp2_build_address_command(r, JP2_CMD_WRITE, address,
+			JP2_TXHDR(r));
+	return jp2_transact(r, txlen, data, len, NULL);
+}
+
+/*
+ * A WRITE is not sent twice blindly, the remote might have programmed the
+ * data although its response got lost. Check the content first.
+ */
+static int jp2_write_chunk(struct jp2_remote *r, uint32_t address,
+		uint16_t len, uint8_t *data)
+{
+	int rc;
+	int attempt;
+
+	rc = _jp2_write_block(r, address, len, data);
+	for (attempt = 1; jp2_retryable(rc) && attempt <= JP2_MAX_RETRIES;
+			attempt++) {
+		jp2_retry(r, rc, attempt);
+
+		rc = jp2_checksum_block(r, address, address + len - 1);
+		if (rc == jp2_checksum(data, len)) {
+			return 0;
+		}
+		if (rc < 0) {
+			continue;
+		}
+
+		rc = _jp2_write_block(r, address, len, data);
+	}
+
+	return rc;
+}
+
+int jp2_write_block(struct jp2_remote *r, uint32_t address, uint32_t len,
+		uint8_t *data)
+{
+	int rc;
+	uint32_t txlen;
+	uint32_t bytes_written = 0;
+
+	while (bytes_written < len)
+	{
+		txlen = len - bytes_written;
+		if (txlen > (uint32_t)r->write_chunk) {
+			txlen = r->write_chunk;
+		}
+		rc = jp2_write_chunk(r, address, txlen, data);
+		if (rc == -JP2_ERR_INVALID_ARGUMENT
+				&& r->write_chunk > JP2_CHUNK_SIZE) {
+			/* the chunk size was only guessed from the READ probe
+			 * and the remote rejected it before programming
+			 * anything, retry with a smaller one */
+			r->write_chunk /= 2;
+			stats_retry(&r->stats, JP2_CMD_WRITE);
+			trace(r, JP2_TRACE_CHUNK_SIZE, 0, r->read_chunk,
+					r->write_chunk);
+			continue;
+		}
+		if (rc < 0) {
+			return rc;
+		}
+
+		address += txlen;
+		data += txlen;
+		bytes_written += txlen;
+	}
+
+	return bytes_written;
+}
+
+int jp2_erase_block(struct jp2_remote *r, uint32_t start, uint32_t end)
+{
+	int txlen;
+
+	txlen = jp2_build_range_command(r, JP2_CMD_ERASE, start, end,
+			JP2_TXHDR(r));
+	return jp2_transact_idempotent(r, txlen, NULL);
+}
+
+int jp2_checksum_block(struct jp2_remote *r, uint32_t start, uint32_t end)
+{
+	int rc;
+	int txlen;
+	uint8_t *data;
+
+	txlen = jp2_build_range_command(r, JP2_CMD_CHECKSUM, start, end,
+			JP2_TXHDR(r));
+
+	rc = jp2_transact_idempotent(r, txlen, &data);
+	if (rc < 0) {
+		return rc;
+	}
+	if (rc != 1) {
+		return JP2_ERR_UNSUPPORTED;
+	}
+	return *data;
+}
+
+/* the request just built at JP2_TXHDR(r) completes by calling cb */
+static int jp2_submit_frame(struct jp2_remote *r, int hdrlen,
+		const uint8_t *payload, int paylen, uint8_t *dst, int dstlen,
+		jp2_complete_cb cb, void *priv)
+{
+	int rc;
+	struct jp2_request *q;
+
+	assert(cb);
+
+	if (r->req_head - r->req_tail >= JP2_MAX_INFLIGHT) {
+		return -1;
+	}
+	/* a synchronous call is waiting for its response */
+	if (r->req_head - r->req_tail != r->req_async) {
+		return -JP2_ERR_BUSY;
+	}
+
+	rc = _jp2_send_frame(r, hdrlen, payload, paylen, jp2_cmd_timeout(r));
+	if (rc < 0) {
+		return rc;
+	}
+	r->req_async++;
+
+	q = &r->req[(r->req_head - 1) & (JP2_MAX_INFLIGHT - 1)];
+	q->dst = dst;
+	q->dstlen = dstlen;
+	q->cb = cb;
+	q->priv = priv;
+
+	return 0;
+}
+
+int jp2_submit(struct jp2_remote *r, const uint8_t *txdata, int txlen,
+		jp2_complete_cb cb, void *priv)
+{
+	assert(txlen < (sizeof(r->txbuf) - 3));
+
+	memcpy(JP2_TXHDR(r), txdata, txlen);
+
+	return jp2_submit_frame(r, txlen, NULL, 0, NULL, 0, cb, priv);
+}
+
+int jp2_submit_read(struct jp2_remote *r, uint32_t address, uint16_t len,
+		uint8_t *data, jp2_complete_cb cb, void *priv)
+{
+	int txlen;
+
+	if (len > r->read_chunk) {
+		return -JP2_ERR_INVALID_ARGUMENT;
+	}
+
+	txlen = jp2_build_read_command(r, address, len, JP2_TXHDR(r));
+	return jp2_submit_frame(r, txlen, NULL, 0, data, len, cb, priv);
+}
+
+int jp2_submit_write(struct jp2_remote *r, uint32_t address, uint16_t len,
+		uint8_t *data, jp2_complete_cb cb, void *priv)
+{
+	int txlen;
+
+	if (len > r->write_chunk) {
+		return -JP2_ERR_INVALID_ARGUMENT;
+	}
+
+	txlen = jp2_build_address_command(r, JP2_CMD_WRITE, address,
+			JP2_TXHDR(r));
+	return jp2_submit_frame(r, txlen, data, len, NULL, 0, cb, priv);
+}
+
+int jp2_submit_erase(struct jp2_remote *r, uint32_t start, uint32_t end,
+		jp2_complete_cb cb, void *priv)
+{
+	int txlen;
+
+	txlen = jp2_build_range_command(r, JP2_CMD_ERASE, start, end,
+			JP2_TXHDR(r));
+	return jp2_submit_frame(r, txlen, NULL, 0, NULL, 0, cb, priv);
+}
+
+int jp2_submit_checksum(struct jp2_remote *r, uint32_t start, uint32_t end,
+		jp2_complete_cb cb, void *priv)
+{
+	int txlen;
+
+	txlen = jp2_build_range_command(r, JP2_CMD_CHECKSUM, start, end,
+			JP2_TXHDR(r));
+	return jp2_submit_frame(r, txlen, NULL, 0, NULL, 0, cb, priv);
+}
+
+int jp2_pending(struct jp2_remote *r)
+{
+	return r->req_head - r->req_tail;
+}
+
+int jp2_get_fd(struct jp2_remote *r)
+{
+	if (!r->ops->get_fd) {
+		return -1;
+	}
+	return r->ops->get_fd(r->handle);
+}
+
+int jp2_next_timeout(struct jp2_remote *r)
+{
+	int limit;
+
+	if (r->req_head == r->req_tail) {
+		return -1;
+	}
+	return jp2_rx_remaining(r, &limit);
+}
+
+/*
+ * The stream is out of sync, fail all the requests in flight. Unlike
+ * jp2_resync() this doesn't wait for the line to become quiet. Returns the
+ * number of requests failed.
+ */
+static int jp2_fail_all(struct jp2_remote *r, int rc)
+{
+	unsigned int n = r->req_head - r->req_tail;
+	unsigned int i;
+
+	trace(r, JP2_TRACE_REQUEST_FAILED, rc, 0, n);
+	r->ops->flush(r->handle);
+	rx_reset(&r->rx);
+	stats_flush(&r->stats);
+
+	/* the callbacks may submit new requests */
+	for (i = 0; i < n; i++) {
+		jp2_complete(r, rc, NULL);
+	}
+
+	return n;
+}
+
+int jp2_process_events(struct jp2_remote *r, int timeout_ms)
+{
+	int rc;
+	int done = 0;
+	bool waited = false;
+
+	if (r->req_head - r->req_tail != r->req_async) {
+		return -JP2_ERR_BUSY;
+	}
+
+	while (r->req_head != r->req_tail) {
+		rc = jp2_rx_parse(r);
+		if (rc == 0) {
+			/* read at most once, the input may complete several
+			 * requests */
+			if (waited) {
+				break;
+			}
+			waited = true;
+			rc = jp2_rx_read(r, timeout_ms);
+			if (rc == 0) {
+				continue;
+			}
+		}
+		done++;
+
+		if (rc < 0) {
+			done += jp2_fail_all(r, rc);
+			break;
+		}
+	}
+
+	return done;
+}
+
+/*
+ * Checksum oracle dump.
+ *
+ * Some remotes refuse the READ command, but the checksum of a single byte is
+ * the byte itself. Sending one CHECKSUM request per byte in strict
+ * stop-and-wait would be dominated by the latency of the link, so the
+ * requests go through the pipeline engine and the results are stored
+ * directly into the output buffer.
+ */
+struct jp2_oracle_ctx {
+	uint32_t address;
+	uint8_t *data;
+};
+
+static int jp2_oracle_build(struct jp2_remote *r, void *priv, int idx,
+		uint8_t *buf)
+{
+	struct jp2_oracle_ctx *ctx = priv;
+
+	return jp2_build_range_command(r, JP2_CMD_CHECKSUM, ctx->address + idx,
+			ctx->address + idx, buf);
+}
+
+static int jp2_oracle_complete(struct jp2_remote *r, void *priv, int idx,
+		uint8_t *data, int len)
+{
+	struct jp2_oracle_ctx *ctx = priv;
+
+	if (len != 1) {
+		return -JP2_ERR_UNSUPPORTED;
+	}
+
+	ctx->data[idx] = *data;
+
+	return 0;
+}
+
+int jp2_checksum_dump(struct jp2_remote *r, uint32_t address, uint32_t len,
+		uint8_t *data)
+{
+	int rc;
+	struct jp2_oracle_ctx ctx = {
+		.address = address,
+		.data = data,
+	};
+	struct jp2_pipeline p = {
+		.count = len,
+		.build = jp2_oracle_build,
+		.complete = jp2_oracle_complete,
+		.priv = &ctx,
+	};
+
+	rc = jp2_pipeline_run(r, &p);
+	if (rc < 0) {
+		return rc;
+	}
+
+	return len;
+}
+
+/*
+ * Delta writes.
+ *
+ * The range is split into blocks aligned to block_size. The checksum of
+ * every block is compared with the one calculated by the remote and only
+ * the blocks which differ are erased and written again, adjacent ones in a
+ * single go.
+ *
+ * If block_size is smaller than the erase blocks of the remote, erasing a
+ * block also wipes its neighbours. Thus, the checksums are compared once
+ * more afterwards and wiped blocks are written again, this time without
+ * erasing them. A third scan verifies the result. Nevertheless, the range
+ * itself should start and end on an erase block boundary, because data
+ * outside of it can't be restored.
+ *
+ * A wiped block has the checksum of its erased bytes, 0x00 for an even
+ * length. Once something was erased, blocks whose data has that checksum
+ * too are read back instead.
+ */
+struct jp2_delta_ctx {
+	uint32_t address;
+	uint32_t len;
+	uint8_t *data;
+	uint32_t block_size;
+	uint8_t *dirty;
+	uint8_t *buf;		/* a block read back */
+	bool erased;
+};
+
+static void jp2_delta_block(struct jp2_delta_ctx *ctx, int idx,
+		uint32_t *start, uint32_t *end)
+{
+	uint32_t first = ctx->address - (ctx->address % ctx->block_size);
+
+	*start = first + idx * ctx->block_size;
+	if (*start < ctx->address) {
+		*start = ctx->address;
+	}
+	*end = first + (idx + 1) * ctx->block_size;
+	if (*end > ctx->address + ctx->len) {
+		*end = ctx->address + ctx->len;
+	}
+}
+
+static int jp2_delta_build(struct jp2_remote *r, void *priv, int idx,
+		uint8_t *buf)
+{
+	struct jp2_delta_ctx *ctx = priv;
+	uint32_t start, end;
+
+	jp2_delta_block(ctx, idx, &start, &end);
+	return jp2_build_range_command(r, JP2_CMD_CHECKSUM, start, end - 1, buf);
+}
+
+static int jp2_delta_complete(struct jp2_remote *r, void *priv, int idx,
+		uint8_t *data, int len)
+{
+	struct jp2_delta_ctx *ctx = priv;
+	uint32_t start, end;
+
+	if (len != 1) {
+		return -JP2_ERR_UNSUPPORTED;
+	}
+
+	jp2_delta_block(ctx, idx, &start, &end);
+	ctx->dirty[idx] = (*data != jp2_checksum(ctx->data + start - ctx->address,
+				end - start));
+
+	return 0;
+}
+
+/* data whose checksum matches erased flash without being erased itself */
+static bool jp2_erased_lookalike(uint8_t *data, uint32_t len)
+{
+	uint32_t i;
+
+	if (jp2_checksum(data, len) != ((len & 1) ? 0xff : 0x00)) {
+		return false;
+	}
+	for (i = 0; i < len; i++) {
+		if (data[i] != 0xff) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* returns the number of blocks which differ */
+static int jp2_delta_scan(struct jp2_remote *r, struct jp2_delta_ctx *ctx,
+		int count)
+{
+	int rc;
+	int i;
+	uint32_t start, end;
+	uint8_t *data;
+	struct jp2_pipeline p = {
+		.count = count,
+		.build = jp2_delta_build,
+		.complete = jp2_delta_complete,
+		.priv = ctx,
+	};
+
+	rc = jp2_pipeline_run(r, &p);
+	if (rc < 0) {
+		return rc;
+	}
+
+	for (i = 0; ctx->erased && i < count; i++) {
+		if (ctx->dirty[i]) {
+			continue;
+		}
+		jp2_delta_block(ctx, i, &start, &end);
+		data = ctx->data + start - ctx->address;
+		if (!jp2_erased_lookalike(data, end - start)) {
+			continue;
+		}
+		rc = jp2_read_block(r, start, end - start, ctx->buf);
+		if (rc < 0) {
+			return rc;
+		}
+		ctx->dirty[i] = !!memcmp(ctx->buf, data, end - start);
+	}
+
+	rc = 0;
+	for (i = 0; i < count; i++) {
+		rc += ctx->dirty[i];
+	}
+
+	return rc;
+}
+
+int jp2_write_delta(struct jp2_remote *r, uint32_t address, uint32_t len,
+		uint8_t *data, uint32_t block_size)
+{
+	int rc;
+	int i, j;
+	int pass;
+	int count;
+	int written = 0;
+	uint32_t start, end, dummy;
+	struct jp2_delta_ctx ctx = {
+		.address = address,
+		.len = len,
+		.data = data,
+		.block_size = block_size,
+	};
+
+	if (block_size == 0 || len == 0) {
+		return -1;
+	}
+
+	count = (address % block_size + len + block_size - 1) / block_size;
+	ctx.dirty = calloc(count, 1);
+	ctx.buf = malloc(block_size);
+	if (!ctx.dirty || !ctx.buf) {
+		free(ctx.dirty);
+		free(ctx.buf);
+		return -1;
+	}
+
+	rc = jp2_delta_scan(r, &ctx, count);
+
+	for (pass = 0; pass < 2 && rc > 0; pass++) {
+		trace(r, JP2_TRACE_DELTA, pass, rc, count);
+
+		for (i = 0; i < count; i = j) {
+			if (!ctx.dirty[i]) {
+				j = i + 1;
+				continue;
+			}
+			for (j = i; j < count && ctx.dirty[j]; j++);
+
+			jp2_delta_block(&ctx, i, &start, &dummy);
+			jp2_delta_block(&ctx, j - 1, &dummy, &end);
+
+			/* blocks which still differ after the first pass were
+			 * wiped by the erase of a neighbour */
+			if (pass == 0) {
+				ctx.erased = true;
+				rc = jp2_erase_block(r, start, end - 1);
+				if (rc < 0) {
+					goto out;
+				}
+			}
+
+			rc = jp2_write_block(r, start, end - start,
+					data + (start - address));
+			if (rc < 0) {
+				goto out;
+			}
+
+			written += j - i;
+		}
+
+		rc = jp2_delta_scan(r, &ctx, count);
+	}
+
+	if (rc > 0) {
+		trace(r, JP2_TRACE_DELTA, pass, rc, count);
+		rc = -JP2_ERR_VERIFY;
+	} else if (rc == 0) {
+		rc = written;
+	}
+
+out:
+	free(ctx.buf);
+	free(ctx.dirty);
+	return rc;
+}
+
+/*
+ * Verify.
+ *
+ * The range is split into parts of at most JP2_VERIFY_RANGE bytes and the
+ * checksums of all parts are compared at once. Parts which differ are split
+ * into four and compared again until they are small enough to be read back,
+ * so a clean verify only costs a few round trips. Like delta writes, this is
+ * only as strong as the XOR checksum of the protocol.
+ */
+#define JP2_VERIFY_RANGE 4096
+#define JP2_VERIFY_SPLIT 4
+
+struct jp2_range {
+	uint32_t start;
+	uint32_t len;
+};
+
+struct jp2_verify_ctx {
+	uint32_t address;
+	uint8_t *data;
+	struct jp2_range *ranges;
+	uint8_t *differs;
+};
+
+static int jp2_verify_build(struct jp2_remote *r, void *priv, int idx,
+		uint8_t *buf)
+{
+	struct jp2_verify_ctx *ctx = priv;
+	struct jp2_range *range = &ctx->ranges[idx];
+
+	return jp2_build_range_command(r, JP2_CMD_CHECKSUM, range->start,
+			range->start + range->len - 1, buf);
+}
+
+static int jp2_verify_complete(struct jp2_remote *r, void *priv, int idx,
+		uint8_t *data, int len)
+{
+	struct jp2_verify_ctx *ctx = priv;
+	struct jp2_range *range = &ctx->ranges[idx];
+
+	if (len != 1) {
+		return -JP2_ERR_UNSUPPORTED;
+	}
+
+	ctx->differs[idx] = (*data != jp2_checksum(
+				ctx->data + range->start - ctx->address,
+				range->len));
+
+	return 0;
+}
+
+/* compare a range byte by byte, returns the number of differing bytes */
+static int jp2_verify_bytes(struct jp2_remote *r, struct jp2_verify_ctx *ctx,
+		struct jp2_range *range, uint8_t *buf, uint32_t *bad_address)
+{
+	int rc;
+	int i;
+	int bad = 0;
+	uint8_t *expected = ctx->data + range->start - ctx->address;
+
+	rc = jp2_read_block(r, range->start, range->len, buf);
+	if (rc < 0) {
+		return rc;
+	}
+
+	for (i = 0; i < range->len; i++) {
+		if (buf[i] == expected[i]) {
+			continue;
+		}
+		if (bad_address && *bad_address > range->start + i) {
+			*bad_address = range->start + i;
+		}
+		bad++;
+	}
+
+	return bad;
+}
+
+int jp2_verify(struct jp2_remote *r, uint32_t address, uint32_t len,
+		uint8_t *data, uint32_t *bad_address)
+{
+	int rc;
+	int i, j;
+	int count;
+	int next;
+	int bad = 0;
+	uint32_t part;
+	uint8_t *buf = NULL;
+	struct jp2_range *ranges = NULL;
+	struct jp2_verify_ctx ctx = {
+		.address = address,
+		.data = data,
+	};
+	struct jp2_pipeline p = {
+		.build = jp2_verify_build,
+		.complete = jp2_verify_complete,
+		.priv = &ctx,
+	};
+
+	if (bad_address) {
+		*bad_address = UINT32_MAX;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	/* only disjoint ranges larger than a chunk are split, so there are
+	 * never more than JP2_VERIFY_SPLIT times the chunks */
+	count = (len + JP2_VERIFY_RANGE - 1) / JP2_VERIFY_RANGE;
+	next = JP2_VERIFY_SPLIT * ((len + r->read_chunk - 1) / r->read_chunk
+			+ count);
+	ctx.ranges = malloc(next * sizeof(*ctx.ranges));
+	ranges = malloc(next * sizeof(*ranges));
+	ctx.differs = malloc(next);
+	buf = malloc(r->read_chunk);
+	if (!ctx.ranges || !ranges || !ctx.differs || !buf) {
+		rc = -1;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		ctx.ranges[i].start = address + i * JP2_VERIFY_RANGE;
+		ctx.ranges[i].len = JP2_VERIFY_RANGE;
+	}
+	ctx.ranges[count - 1].len = len - (count - 1) * JP2_VERIFY_RANGE;
+
+	while (count) {
+		p.count = count;
+		rc = jp2_pipeline_run(r, &p);
+		if (rc < 0) {
+			goto out;
+		}
+
+		next = 0;
+		for (i = 0; i < count; i++) {
+			struct jp2_range *range = &ctx.ranges[i];
+
+			if (!ctx.differs[i]) {
+				continue;
+			}
+
+			if (range->len <= r->read_chunk) {
+				rc = jp2_verify_bytes(r, &ctx, range, buf,
+						bad_address);
+				if (rc < 0) {
+					goto out;
+				}
+				bad += rc;
+				continue;
+			}
+
+			part = (range->len + JP2_VERIFY_SPLIT - 1)
+				/ JP2_VERIFY_SPLIT;
+			for (j = 0; j < range->len; j += part) {
+				ranges[next].start = range->start + j;
+				ranges[next].len = (range->len - j > part)
+					? part : range->len - j;
+				next++;
+			}
+		}
+
+		trace(r, JP2_TRACE_VERIFY, 0, next, count);
+		memcpy(ctx.ranges, ranges, next * sizeof(*ranges));
+		count = next;
+	}
+
+	rc = bad;
+
+out:
+	free(buf);
+	free(ranges);
+	free(ctx.differs);
+	free(ctx.ranges);
+	return rc;
+}
+
+/* parse the INFO response, it tells where the info area is */
+static int jp2_info_response(struct jp2_remote *r, uint8_t *data, int rc,
+		struct jp2_info *info, uint32_t *size)
+{
+	uint32_t info_area_offset;
+
+	/* the info command either returns a 16bit or a 32bit offset for the
+	 * info block */
+	if (rc != 4 && rc != 6) {
+		trace(r, JP2_TRACE_UNKNOWN_RESPONSE, 0, rc, 0);
+		return -1;
+	}
+
+	r->addr_width = (rc == 4) ? 2 : 4;
+	info->id = read_u16_from_buf(&data);
+
+	trace(r, JP2_TRACE_INFO, 0, info->id, r->addr_width * 8);
+
+	if (r->addr_width == 2) {
+		info_area_offset = read_u16_from_buf(&data);
+		*size = JP2_SIGNATURE_LEN + 6 * sizeof(uint16_t);
+	} else {
+		info_area_offset = read_u32_from_buf(&data);
+		*size = JP2_SIGNATURE_LEN + 6 * sizeof(uint32_t);
+	}
+	trace(r, JP2_TRACE_INFO_AREA, 0, info_area_offset, 0);
+	r->info_area_offset = info_area_offset;
+
+	return 0;
+}
+
+static void jp2_info_area(struct jp2_remote *r, uint8_t *data,
+		struct jp2_info *info)
+{
+	int size;
+
+	assert(sizeof(info->signature) >= JP2_SIGNATURE_LEN + 1);
+	strncpy(info->signature, (char*)data, JP2_SIGNATURE_LEN);
+	info->signature[JP2_SIGNATURE_LEN] = '\0';
+
+	data += JP2_SIGNATURE_LEN;
+	if (r->addr_width == 2) {
+		info->program_area_begin = read_u16_from_buf(&data);
+		info->program_area_end = read_u16_from_buf(&data);
+		info->protocol_area_begin = read_u16_from_buf(&data);
+		info->protocol_area_end = read_u16_from_buf(&data);
+		info->update_area_begin = read_u16_from_buf(&data);
+		info->update_area_end = read_u16_from_buf(&data);
+	} else {
+		info->program_area_begin = read_u32_from_buf(&data);
+		info->program_area_end = read_u32_from_buf(&data);
+		info->protocol_area_begin = read_u32_from_buf(&data);
+		info->protocol_area_end = read_u32_from_buf(&data);
+		info->update_area_begin = read_u32_from_buf(&data);
+		info->update_area_end = read_u32_from_buf(&data);
+	}
+
+	trace(r, JP2_TRACE_PROGRAM_AREA, 0, info->program_area_begin,
+			info->program_area_end);
+	trace(r, JP2_TRACE_PROTOCOL_AREA, 0, info->protocol_area_begin,
+			info->protocol_area_end);
+	trace(r, JP2_TRACE_UPDATE_AREA, 0, info->update_area_begin,
+			info->update_area_end);
+
+	/* the erase block size is kept as long as it is the same type */
+	size = jp2_geometry_lookup(info->signature);
+	if (size || strcmp(r->signature, info->signature)) {
+		r->erase_block = size;
+	}
+
+	/* remember how the remote came up for the next time */
+	strcpy(r->signature, info->signature);
+	if (r->wake_pulse && !r->reset_pulse_fixed) {
+		jp2_learned_update(r, info->signature, r->wake_pulse,
+				r->wake_boot, true);
+	}
+	r->wake_pulse = 0;
+}
+
+/* send a READ command for the info area of a cache entry */
+static int jp2_info_cache_read(struct jp2_remote *r,
+		struct infocache_entry *e)
+{
+	int txlen;
+	uint32_t offset;
+	uint8_t *ptr = e->response + 2;
+
+	if (e->response_len == 4) {
+		r->addr_width = 2;
+		offset = read_u16_from_buf(&ptr);
+	} else {
+		r->addr_width = 4;
+		offset = read_u32_from_buf(&ptr);
+	}
+
+	txlen = jp2_build_read_command(r, offset, e->area_len, JP2_TXHDR(r));
+	return jp2_send_frame(r, txlen, NULL, 0);
+}
+
+/*
+ * Get the info. If the cache has an entry for the port, the info area is
+ * read from where it was right behind the INFO command. The read is used if
+ * the INFO response is the same, otherwise the area is read again. Another
+ * remote of the same type on the port then shows with its own signature, a
+ * checksum couldn't tell. A new or changed area is cached. If enter is set,
+ * the response to an ENTER_LOADER sent before comes first.
+ */
+static int jp2_info_fetch(struct jp2_remote *r, struct jp2_info *info,
+		bool enter)
+{
+	int rc;
+	bool cached = false;
+	uint32_t size;
+	uint8_t *data;
+	uint8_t response[INFOCACHE_RESPONSE_LEN];
+	int response_len;
+	struct infocache_entry e;
+
+	if (r->req_async) {
+		return -JP2_ERR_BUSY;
+	}
+
+	JP2_TXHDR(r)[0] = JP2_CMD_INFO;
+	rc = jp2_send_frame(r, 1, NULL, 0);
+	if (rc < 0) {
+		/* forget about the ENTER_LOADER */
+		jp2_flush(r);
+		return rc;
+	}
+
+	if (r->info_cache[0]) {
+		cached = (infocache_lookup(r->info_cache, r->port, &e) == 0);
+	}
+	if (cached) {
+		rc = jp2_info_cache_read(r, &e);
+		if (rc < 0) {
+			jp2_flush(r);
+			return rc;
+		}
+	}
+
+	if (enter) {
+		rc = jp2_receive(r, NULL);
+		if (rc < 0) {
+			/* get rid of the responses which may follow */
+			jp2_resync(r);
+			return -1;
+		}
+	}
+
+	rc = jp2_receive(r, &data);
+	if (rc >= 0) {
+		response_len = rc;
+		rc = jp2_info_response(r, data, rc, info, &size);
+	}
+	if (rc < 0) {
+		if (cached) {
+			jp2_resync(r);
+		}
+		return rc;
+	}
+	memcpy(response, data, response_len);
+
+	if (cached) {
+		rc = jp2_receive(r, &data);
+		if (rc == size && response_len == e.response_len &&
+				!memcmp(response, e.response, response_len)) {
+			jp2_info_area(r, data, info);
+			if (!memcmp(data, e.area, size)) {
+				return 0;
+			}
+			goto store;
+		}
+	}
+
+	rc = _jp2_read_block(r, r->info_area_offset, size, &data);
+	if (rc < 0) {
+		return rc;
+	}
+	jp2_info_area(r, data, info);
+
+store:
+	if (r->info_cache[0]) {
+		strcpy(e.port, r->port);
+		memcpy(e.response, response, response_len);
+		e.response_len = response_len;
+		memcpy(e.area, data, size);
+		e.area_len = size;
+		infocache_store(r->info_cache, &e);
+	}
+
+	return 0;
+}
+
+int jp2_get_info(struct jp2_remote *r, struct jp2_info *info)
+{
+	if (info == NULL) {
+		return -1;
+	}
+
+	return jp2_info_fetch(r, info, false);
+}
+
+int jp2_set_info_cache(struct jp2_remote *r, const char *path)
+{
+	if (path == NULL) {
+		r->info_cache[0] = '\0';
+		return 0;
+	}
+
+	if (strlen(path) >= sizeof(r->info_cache)) {
+		return -1;
+	}
+	strcpy(r->info_cache, path);
+	osapi_port_id(r->devname, r->port, sizeof(r->port));
+
+	return 0;
+}
+
+int jp2_forget_info(const char *path, const char *devname)
+{
+	char port[PATH_MAX];
+
+	if (devname == NULL) {
+		return infocache_forget(path, NULL);
+	}
+
+	osapi_port_id(devname, port, sizeof(port));
+	return infocache_forget(path, port);
+}
+
+/*
+ * Find the largest READ chunk the remote accepts by reading from the info
+ * area with decreasing sizes. Remotes which can't handle a size answer with
+ * JP2_ERR_INVALID_ARGUMENT. The WRITE chunk size starts with the same value
+ * and is lowered by jp2_write_block() if the remote rejects it.
+ */
+int jp2_probe_chunk_size(struct jp2_remote *r)
+{
+	int rc;
+	int size;
+
+	/* we need to know the address width and the info area */
+	if (r->addr_width == 0) {
+		return -1;
+	}
+
+	for (size = JP2_MAX_CHUNK_SIZE; size > JP2_CHUNK_SIZE; size /= 2) {
+		rc = _jp2_read_block(r, r->info_area_offset, size, NULL);
+		if (rc == size) {
+			break;
+		}
+		if (rc >= 0) {
+			trace(r, JP2_TRACE_SHORT_READ, 0, rc, size);
+		} else if (rc != -JP2_ERR_INVALID_ARGUMENT) {
+			return rc;
+		}
+	}
+
+	trace(r, JP2_TRACE_CHUNK_SIZE, 0, size, size);
+	r->read_chunk = size;
+	r->write_chunk = size;
+
+	return size;
+}
+
+int jp2_set_chunk_size(struct jp2_remote *r, int size)
+{
+	if (size < 2 || size > JP2_MAX_CHUNK_SIZE || (size & 1)) {
+		return -1;
+	}
+
+	r->read_chunk = size;
+	r->write_chunk = size;
+
+	return 0;
+}
+
+int jp2_get_read_chunk_size(struct jp2_remote *r)
+{
+	return r->read_chunk;
+}
+
+int jp2_get_write_chunk_size(struct jp2_remote *r)
+{
+	return r->write_chunk;
+}
+
+int jp2_get_address_width(struct jp2_remote *r)
+{
+	return r->addr_width;
+}
+
+int jp2_get_erase_block_size(struct jp2_remote *r)
+{
+	return r->erase_block;
+}
+
+int jp2_set_erase_block_size(struct jp2_remote *r, int size)
+{
+	if (size <= 0 || (size & (size - 1))) {
+		return -1;
 	}
-	if (rc != 1) {
-		return JP2_ERR_UNSUPPORTED;
+
+	r->erase_block = size;
+	if (r->signature[0]) {
+		jp2_geometry_update(r->signature, size);
 	}
-	return *data;
+
+	return 0;
 }
 
-int jp2_get_info(struct jp2_remote *r, struct jp2_info *info)
+/*
+ * Erase the scratch area and write a zero at every candidate block size and
+ * at half the smallest one. Erasing its first byte then wipes exactly one
+ * block, the first zero which is left marks its end. Returns the size, 0 if
+ * it isn't one of the candidates.
+ */
+static int jp2_probe_sizes(struct jp2_remote *r, uint32_t scratch)
 {
 	int rc;
-	uint8_t cmd = JP2_CMD_INFO;
-	uint8_t *data;
-	uint32_t info_area_offset;
-	uint32_t info_area_size;
+	int size;
+	uint8_t zero[2] = { 0, 0 };
 
-	if (info == NULL) {
-		return -1;
+	rc = jp2_erase_block(r, scratch, scratch + JP2_PROBE_AREA - 1);
+	if (rc < 0) {
+		return rc;
+	}
+	for (size = JP2_MIN_ERASE_BLOCK / 2; size <= JP2_MAX_ERASE_BLOCK;
+			size *= 2) {
+		rc = jp2_write_block(r, scratch + size, sizeof(zero), zero);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+	rc = jp2_erase_block(r, scratch, scratch);
+	if (rc < 0) {
+		return rc;
+	}
+	for (size = JP2_MIN_ERASE_BLOCK / 2; size <= JP2_MAX_ERASE_BLOCK;
+			size *= 2) {
+		rc = jp2_checksum_block(r, scratch + size, scratch + size);
+		if (rc != 0xff) {
+			break;
+		}
+	}
+	if (rc < 0) {
+		return rc;
+	}
+
+	/* smaller or larger than the candidates, or the remote doesn't
+	 * behave like flash */
+	if (rc != 0 || size < JP2_MIN_ERASE_BLOCK) {
+		return 0;
 	}
 
-	rc = jp2_command(r, &cmd, 1, &data);
+	return size;
+}
+
+/* put back the content of the scratch area */
+static int jp2_probe_restore(struct jp2_remote *r, uint32_t scratch,
+		uint8_t *saved)
+{
+	int i;
+	int rc;
+
+	rc = jp2_erase_block(r, scratch, scratch + JP2_PROBE_AREA - 1);
 	if (rc < 0) {
 		return rc;
 	}
+	for (i = 0; i < JP2_PROBE_AREA && saved[i] == 0xff; i++);
+	if (i == JP2_PROBE_AREA) {
+		return 0;
+	}
 
-	/* the info command either returns a 16bit or a 32bit offset for the
-	 * info block */
-	if (rc != 4 && rc != 6) {
-		debug(1, "%s: unknown response (%d)\n", __func__, rc);
+	rc = jp2_write_block(r, scratch, JP2_PROBE_AREA, saved);
+	return (rc < 0) ? rc : 0;
+}
+
+/*
+ * Find the erase block size, see jp2_probe_sizes(). The scratch area at the
+ * first aligned address of the update area is twice the largest candidate,
+ * so whatever a block of a candidate size wipes is within it. It is read
+ * before and restored afterwards, also if the probe failed.
+ */
+int jp2_probe_erase_block(struct jp2_remote *r, const struct jp2_info *info)
+{
+	int rc;
+	int restored;
+	uint32_t scratch;
+	uint8_t *saved;
+
+	if (info->update_area_end < info->update_area_begin) {
+		return -JP2_ERR_UNSUPPORTED;
+	}
+	scratch = (info->update_area_begin + JP2_MAX_ERASE_BLOCK - 1) &
+			~(JP2_MAX_ERASE_BLOCK - 1);
+	if (scratch < info->update_area_begin ||
+			scratch > info->update_area_end ||
+			info->update_area_end - scratch <
+			JP2_PROBE_AREA - 1) {
+		return -JP2_ERR_UNSUPPORTED;
+	}
+
+	saved = malloc(JP2_PROBE_AREA);
+	if (!saved) {
 		return -1;
 	}
 
-	r->addr_width = (rc == 4) ? 2 : 4;
-	info->id = read_u16_from_buf(&data);
+	rc = jp2_read_block(r, scratch, JP2_PROBE_AREA, saved);
+	if (rc < 0) {
+		goto out;
+	}
 
-	debug(1, "%s: remote id is %04Xh (%dbit device)\n",
-		__func__, info->id, r->addr_width * 8);
+	rc = jp2_probe_sizes(r, scratch);
+	restored = jp2_probe_restore(r, scratch, saved);
+	trace(r, JP2_TRACE_ERASE_BLOCK, (rc < 0) ? rc : restored,
+			(rc > 0) ? rc : 0, scratch);
+	if (restored < 0) {
+		/* the content of the scratch area is lost */
+		rc = restored;
+		goto out;
+	}
+	if (rc <= 0) {
+		if (rc == 0) {
+			rc = -JP2_ERR_UNSUPPORTED;
+		}
+		goto out;
+	}
 
-	if (r->addr_width == 2) {
-		info_area_offset = read_u16_from_buf(&data);
-		info_area_size = JP2_SIGNATURE_LEN + 6 * sizeof(uint16_t);
-	} else {
-		info_area_offset = read_u32_from_buf(&data);
-		info_area_size = JP2_SIGNATURE_LEN + 6 * sizeof(uint32_t);
+	if (jp2_set_erase_block_size(r, rc) < 0) {
+		rc = -1;
 	}
-	debug(1, "%s: info_area @%x\n", __func__, info_area_offset);
 
-	rc = _jp2_read_block(r, info_area_offset, info_area_size, &data);
+out:
+	free(saved);
+	return rc;
+}
+
+/*
+ * Send an INFO command, the remote gets timeout_ms to start answering. The
+ * rest only gets the time to transfer it and a length which doesn't fit
+ * rxbuf is a framing error, so it is safe to use while the line speed might
+ * be wrong.
+ */
+static int jp2_ping(struct jp2_remote *r, int timeout_ms)
+{
+	int rc;
+
+	JP2_TXHDR(r)[0] = JP2_CMD_INFO;
+	rc = jp2_send_frame_timeout(r, 1, NULL, 0, timeout_ms);
 	if (rc < 0) {
 		return rc;
 	}
 
-	assert(sizeof(info->signature) >= JP2_SIGNATURE_LEN + 1);
-	strncpy(info->signature, (char*)data, JP2_SIGNATURE_LEN);
-	info->signature[JP2_SIGNATURE_LEN] = '\0';
+	rc = jp2_receive(r, NULL);
+	return (rc < 0) ? rc : 0;
+}
 
-	data += JP2_SIGNATURE_LEN;
-	if (r->addr_width == 2) {
-		info->program_area_begin = read_u16_from_buf(&data);
-		info->program_area_end = read_u16_from_buf(&data);
-		info->protocol_area_begin = read_u16_from_buf(&data);
-		info->protocol_area_end = read_u16_from_buf(&data);
-		info->update_area_begin = read_u16_from_buf(&data);
-		info->update_area_end = read_u16_from_buf(&data);
-	} else {
-		info->program_area_begin = read_u32_from_buf(&data);
-		info->program_area_end = read_u32_from_buf(&data);
-		info->protocol_area_begin = read_u32_from_buf(&data);
-		info->protocol_area_end = read_u32_from_buf(&data);
-		info->update_area_begin = read_u32_from_buf(&data);
-		info->update_area_end = read_u32_from_buf(&data);
+int jp2_set_baudrate(struct jp2_remote *r, int baudrate)
+{
+	int rc;
+
+	if (baudrate <= 0) {
+		return -1;
 	}
 
-	debug(1, "%s program_area_begin=%x\n", __func__,
-			info->program_area_begin);
-	debug(1, "%s program_area_end=%x\n", __func__,
-			info->program_area_end);
-	debug(1, "%s protocol_area_begin=%x\n", __func__,
-			info->protocol_area_begin);
-	debug(1, "%s protocol_area_end=%x\n", __func__,
-			info->protocol_area_end);
-	debug(1, "%s update_area_begin=%x\n", __func__,
-			info->update_area_begin);
-	debug(1, "%s update_area_end=%x\n", __func__,
-			info->update_area_end);
+	rc = r->ops->set_baudrate(r->handle, baudrate);
+	if (rc < 0) {
+		return rc;
+	}
+	r->baudrate = baudrate;
 
 	return 0;
 }
 
+int jp2_set_timeout(struct jp2_remote *r, uint8_t cmd, int timeout_ms)
+{
+	r->timeouts[stats_cmd_class(cmd)] = timeout_ms;
+	return 0;
+}
+
+int jp2_get_baudrate(struct jp2_remote *r)
+{
+	return r->baudrate;
+}
+
 /*
- * Send a zero byte every 10ms. After some time the remote should respond
- * by sending an invalid command reply.
+ * The protocol can't change the line speed of the remote, so only the rate
+ * of the serial port is stepped up, as long as the remote answers an INFO
+ * command at the new rate. That is, the remote detects the rate itself or
+ * already runs at it. If it doesn't, go back to the last working rate. The
+ * remote might have seen garbage in the meantime, so make sure it is still
+ * in sync and enter the loader again otherwise. If that fails, the port is
+ * set back to the rate the probe started with.
  */
-static int jp2_poll(struct jp2_remote *r)
+int jp2_probe_host_baudrate(struct jp2_remote *r, int max_baudrate)
 {
 	int rc;
 	int i;
-	uint8_t buf;
+	int start = r->baudrate;
+	int good = r->baudrate;
+
+	if (r->req_async) {
+		return -JP2_ERR_BUSY;
+	}
+
+	for (i = 0; i < sizeof(jp2_baudrates) / sizeof(jp2_baudrates[0]); i++) {
+		if (jp2_baudrates[i] <= good) {
+			continue;
+		}
+		if (jp2_baudrates[i] > max_baudrate) {
+			break;
+		}
+
+		rc = jp2_set_baudrate(r, jp2_baudrates[i]);
+		if (rc < 0) {
+			break;
+		}
+		jp2_flush(r);
+
+		if (jp2_ping(r, 50) == 0) {
+			trace(r, JP2_TRACE_BAUDRATE, 0, r->baudrate, good);
+			good = r->baudrate;
+			continue;
+		}
+
+		trace(r, JP2_TRACE_BAUDRATE, -1, r->baudrate, good);
+		rc = jp2_set_baudrate(r, good);
+		if (rc == 0) {
+			usleep(10000);
+			jp2_flush(r);
+			if (jp2_ping(r, 50) < 0) {
+				rc = jp2_enter_loader(r, r->extended_mode);
+			}
+		}
+		if (rc < 0) {
+			goto fail;
+		}
+		break;
+	}
+
+	return good;
 
-	debug(1, "%s: start polling\n", __func__);
+fail:
+	jp2_set_baudrate(r, start);
+	jp2_flush(r);
+	return rc;
+}
+
+/*
+ * Send a zero byte every JP2_POLL_INTERVAL_MS until the remote responds
+ * by sending an invalid command reply. Returns the time it took in ms.
+ */
+static int jp2_poll(struct jp2_remote *r, int timeout_ms)
+{
+	int rc;
+	int i;
+	uint32_t start = jp2_now_ms();
+	int elapsed = 0;
+	uint8_t buf;
 
-	/* poll for max 1 second */
-	for (i = 0; i < 100; i++) {
-		osapi->flush(r->handle);
+	jp2_flush(r);
+	for (i = 0; elapsed < timeout_ms; i++) {
 		buf = 0;
-		rc = osapi->write(r->handle, &buf, 1);
+		rc = r->ops->write(r->handle, &buf, 1);
 		if (rc != 1) {
 			return -1;
 		}
-		usleep(5000);
-		rc = osapi->read_nonblock(r->handle, &buf, 1);
-		if (rc > 0) {
-			debug(1, "%s: polling succeeded\n", __func__);
-			return 0;
+		rc = r->ops->read_some(r->handle, &buf, 1,
+				JP2_POLL_INTERVAL_MS);
+		elapsed = jp2_now_ms() - start;
+		if (rc == 1) {
+			trace(r, JP2_TRACE_POLL, 0, i + 1, elapsed);
+			/* let the rest of the reply arrive and drop it */
+			usleep(jp2_transfer_ms(r, JP2_POLL_REPLY_LEN) * 1000);
+			jp2_flush(r);
+			return elapsed;
+		}
+		if (rc != OSAPI_ERR_TIMEOUT) {
+			return -1;
 		}
-		usleep(5000);
 	}
 
-	debug(1, "%s: polling failed\n", __func__);
+	trace(r, JP2_TRACE_POLL, -1, i, elapsed);
 	return -1;
 }
 
+/*
+ * Reset the remote and wait until its processor has started. A remote
+ * type which came up before gets half of the last working reset pulse
+ * width, down to JP2_MIN_RESET_PULSE_US. If it doesn't answer within twice
+ * its usual boot time, the pulse was too short and the last working width
+ * is used from then on.
+ */
+static int jp2_wake(struct jp2_remote *r)
+{
+	int rc;
+	int pulse = r->reset_pulse;
+	int timeout = r->poll_timeout;
+	bool learned = false;
+	struct jp2_learned_pulse l;
+
+	if (r->req_async) {
+		return -JP2_ERR_BUSY;
+	}
+
+	if (!r->reset_pulse_fixed) {
+		learned = jp2_learned_lookup(r, &l);
+	}
+	if (learned) {
+		pulse = l.next;
+		if (l.next < l.good) {
+			timeout = 2 * l.boot + JP2_POLL_INTERVAL_MS;
+		}
+	}
+
+	jp2_reset(r, pulse);
+	rc = jp2_poll(r, timeout);
+	if (rc < 0 && learned && pulse < l.good) {
+		jp2_learned_update(r, l.signature, pulse, 0, false);
+		pulse = l.good;
+		jp2_reset(r, pulse);
+		rc = jp2_poll(r, r->poll_timeout);
+	}
+	if (rc < 0) {
+		return rc;
+	}
+
+	r->wake_pulse = pulse;
+	r->wake_boot = rc;
+
+	return 0;
+}
+
+/* this is some kind of key, which you can find if you disassemble the
+ * bootloader of your remote */
+static const uint8_t jp2_enter_cmd[] = {
+	JP2_CMD_ENTER_LOADER, 0x55, 0xaa
+};
+
 int jp2_enter_loader(struct jp2_remote *r, bool extended_mode)
 {
 	int rc;
 
-	/* this is some kind of key, which you can find if you
-	 * disassemble the bootloader of your remote */
-	static const uint8_t cmd[] = {
-		JP2_CMD_ENTER_LOADER, 0x55, 0xaa
-	};
+	r->extended_mode = extended_mode;
+
+	rc = jp2_wake(r);
+	if (rc) {
+		return rc;
+	}
+
+	rc = jp2_command(r, jp2_enter_cmd, (extended_mode) ? 3 : 1, NULL);
+	return (rc < 0) ? -1 : 0;
+}
+
+/*
+ * Like jp2_enter_loader() followed by jp2_get_info(), but the INFO command
+ * is sent right behind ENTER_LOADER, which saves a round trip.
+ */
+int jp2_connect(struct jp2_remote *r, bool extended_mode,
+		struct jp2_info *info)
+{
+	int rc;
+
+	if (info == NULL) {
+		return -1;
+	}
 
-	jp2_reset(r);
+	r->extended_mode = extended_mode;
 
-	/* poll until the processor has started */
-	rc = jp2_poll(r);
+	rc = jp2_wake(r);
 	if (rc) {
 		return rc;
 	}
 
-	/* flush any spurious characters in the input buffer */
-	osapi->flush(r->handle);
+	rc = jp2_send(r, jp2_enter_cmd, (extended_mode) ? 3 : 1);
+	if (rc < 0) {
+		return rc;
+	}
 
-	rc = jp2_command(r, cmd, (extended_mode) ? 3 : 1, NULL);
-	return (rc < 0) ? -1 : 0;
+	return jp2_info_fetch(r, info, true);
+}
+
+/*
+ * Auto-detection. Each serial port is probed by its own thread, so the whole
+ * detection takes about as long as probing a single port.
+ */
+#define JP2_DETECT_MAX_PORTS 64
+
+struct jp2_probe {
+	pthread_t thread;
+	struct jp2_port port;
+	int timeout;
+	int rc;
+};
+
+static void jp2_detect_add(void *priv, const struct osapi_port *port)
+{
+	struct jp2_probe *probes = priv;
+	struct jp2_probe *p;
+	int i;
+
+	for (i = 0; i < JP2_DETECT_MAX_PORTS; i++) {
+		p = &probes[i];
+		if (!p->port.devname[0]) {
+			snprintf(p->port.devname, sizeof(p->port.devname),
+					"%s", port->devname);
+			p->port.usb_vendor = port->usb_vendor;
+			p->port.usb_product = port->usb_product;
+			return;
+		}
+	}
+}
+
+static void *jp2_detect_port(void *priv)
+{
+	struct jp2_probe *p = priv;
+	struct jp2_remote *r;
+	struct jp2_info info;
+
+	r = jp2_open_remote(p->port.devname);
+	if (!r) {
+		return NULL;
+	}
+
+	/* the reset pulse comes on top */
+	r->poll_timeout = p->timeout;
+	p->rc = jp2_connect(r, false, &info);
+	if (p->rc == 0) {
+		strcpy(p->port.signature, info.signature);
+		jp2_exit_loader(r);
+	}
+	jp2_close_remote(r);
+
+	return NULL;
+}
+
+int jp2_detect(struct jp2_port *ports, int max, int timeout_ms)
+{
+	int i;
+	int found = 0;
+	int started = 0;
+	struct jp2_probe *probes;
+
+	if (!osapi->enumerate) {
+		return -JP2_ERR_UNSUPPORTED;
+	}
+
+	probes = calloc(JP2_DETECT_MAX_PORTS, sizeof(*probes));
+	if (!probes) {
+		return -1;
+	}
+	osapi->enumerate(jp2_detect_add, probes);
+
+	for (i = 0; i < JP2_DETECT_MAX_PORTS && probes[i].port.devname[0];
+			i++) {
+		probes[i].timeout = timeout_ms;
+		probes[i].rc = -1;
+		if (pthread_create(&probes[i].thread, NULL, jp2_detect_port,
+					&probes[i]) != 0) {
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(probes[i].thread, NULL);
+		if (probes[i].rc == 0) {
+			if (found < max) {
+				ports[found] = probes[i].port;
+			}
+			found++;
+		}
+	}
+	free(probes);
+
+	return found;
+}
+
+int jp2_set_reset_pulse(struct jp2_remote *r, int pulse_us)
+{
+	if (pulse_us <= 0) {
+		return -1;
+	}
+
+	r->reset_pulse = pulse_us;
+	r->reset_pulse_fixed = true;
+
+	return 0;
 }
 
 int jp2_exit_loader(struct jp2_remote *r)
@@ -528,36 +2566,80 @@ int jp2_exit_loader(struct jp2_remote *r)
 	return jp2_simple_command(r, JP2_CMD_EXIT_LOADER);
 }
 
-struct jp2_remote *jp2_open_remote(const char *devname)
+struct jp2_remote *jp2_open_remote_ops(const char *devname, int baudrate,
+		struct osapi_ops *ops)
 {
+	int rc;
 	struct jp2_remote *r;
 
 	r = malloc(sizeof(*r));
 	assert(r);
 
 	memset(r, 0, sizeof(*r));
-
-	r->handle = osapi->open(devname, 0);
+	r->ops = ops;
+	memcpy(r->timeouts, jp2_default_timeouts, sizeof(r->timeouts));
+	r->read_window = 1;
+	r->read_chunk = JP2_CHUNK_SIZE;
+	r->write_chunk = JP2_CHUNK_SIZE;
+	r->reset_pulse = JP2_RESET_PULSE_US;
+	r->poll_timeout = JP2_POLL_TIMEOUT_MS;
+	snprintf(r->devname, sizeof(r->devname), "%s", devname);
+
+	r->handle = r->ops->open(r->ops, devname, 0);
 	if (r->handle == NULL) {
 		free(r);
 		return NULL;
 	}
 
+	if (getenv("JP2_DEBUG")) {
+		jp2_set_trace_sink(r, jp2_trace_stderr, NULL);
+	}
+	if (getenv("JP2_INFO_CACHE")) {
+		jp2_set_info_cache(r, getenv("JP2_INFO_CACHE"));
+	}
+
+	/* the device is opened with the default rate */
+	r->baudrate = JP2_DEFAULT_BAUDRATE;
+	if (baudrate != JP2_DEFAULT_BAUDRATE) {
+		rc = jp2_set_baudrate(r, baudrate);
+		if (rc < 0) {
+			jp2_close_remote(r);
+			return NULL;
+		}
+	}
+
 	return r;
 }
 
+struct jp2_remote *jp2_open_remote_baudrate(const char *devname,
+		int baudrate)
+{
+	return jp2_open_remote_ops(devname, baudrate, osapi);
+}
+
+struct jp2_remote *jp2_open_remote(const char *devname)
+{
+	return jp2_open_remote_baudrate(devname, JP2_DEFAULT_BAUDRATE);
+}
+
 void jp2_close_remote(struct jp2_remote *r)
 {
-	osapi->close(r->handle);
+	r->ops->close(r->handle);
 	free(r);
 }
 
-int jp2_init(void)
+void jp2_get_stats(struct jp2_remote *r, struct jp2_stats *stats)
 {
-	if (getenv("JP2_DEBUG")) {
-		debug_level = 1;
-	}
+	stats_get(&r->stats, stats);
+}
+
+void jp2_reset_stats(struct jp2_remote *r)
+{
+	stats_reset(&r->stats);
+}
 
+int jp2_init(void)
+{
 	return 0;
 }
 
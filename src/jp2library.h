@@ -22,10 +22,15 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 struct jp2_remote;
+struct osapi_ops;
 
 #define JP2_SIGNATURE_LEN 26
+#define JP2_DEVNAME_LEN 128
+#define JP2_DEFAULT_BAUDRATE 38400
+#define JP2_DELTA_BLOCK_SIZE 256
 
 enum {
 	JP2_CMD_READ = 0x01,		/* address, length */
@@ -45,6 +50,10 @@ enum {
 	JP2_ERR_DATA_UNALIGNED = 0x04,	/* returned by write command if data
 					   bytes are not a multiple of two */
 	JP2_ERR_UNSUPPORTED = 0x100,
+	JP2_ERR_VERIFY = 0x101,		/* remote content doesn't match */
+	JP2_ERR_FRAMING = 0x102,	/* malformed response frame */
+	JP2_ERR_TIMEOUT = 0x103,	/* no response in time */
+	JP2_ERR_BUSY = 0x104,		/* sync and async requests mixed */
 };
 
 struct jp2_info {
@@ -58,10 +67,111 @@ struct jp2_info {
 	uint32_t update_area_end;
 };
 
+/*
+ * Tracing. Every remote records binary events into a ring buffer. They are
+ * either passed to a sink attached with jp2_set_trace_sink() right away, or
+ * fetched by jp2_trace_drain() from one other thread. Formatting is up to
+ * the sink. If the library is built without JP2_TRACE, nothing is recorded.
+ */
+enum {
+	JP2_TRACE_RESET,		/* a: pulse width in us */
+	JP2_TRACE_TX,			/* a: frame length, data: frame */
+	JP2_TRACE_RX,			/* a: frame length, b: error code */
+	JP2_TRACE_IO_ERROR,		/* rc: error */
+	JP2_TRACE_BAD_CHECKSUM,		/* a: checksum */
+	JP2_TRACE_REQUEST_FAILED,	/* rc: error, a: index, b: drained */
+	JP2_TRACE_CHUNK_SIZE,		/* a: read chunk, b: write chunk */
+	JP2_TRACE_SHORT_READ,		/* a: received, b: requested */
+	JP2_TRACE_BAUDRATE,		/* rc: result, a: rate, b: fallback */
+	JP2_TRACE_POLL,			/* rc: result, a: iterations, b: ms */
+	JP2_TRACE_INFO,			/* a: remote id, b: address width */
+	JP2_TRACE_UNKNOWN_RESPONSE,	/* a: length */
+	JP2_TRACE_INFO_AREA,		/* a: offset */
+	JP2_TRACE_PROGRAM_AREA,		/* a: begin, b: end */
+	JP2_TRACE_PROTOCOL_AREA,	/* a: begin, b: end */
+	JP2_TRACE_UPDATE_AREA,		/* a: begin, b: end */
+	JP2_TRACE_DELTA,		/* rc: pass, a: differing, b: blocks */
+	JP2_TRACE_VERIFY,		/* a: differing, b: ranges */
+	JP2_TRACE_FRAMING,		/* a: length */
+	JP2_TRACE_RETRY,		/* rc: error, a: command, b: attempt */
+	JP2_TRACE_RESYNC,		/* a: discarded bytes */
+	JP2_TRACE_TIMEOUT,		/* a: timeout in ms */
+	JP2_TRACE_ERASE_BLOCK,		/* a: size or 0, b: scratch address */
+};
+
+#define JP2_TRACE_DATA_LEN 8
+
+struct jp2_trace_event {
+	uint64_t timestamp;		/* CLOCK_MONOTONIC, in ns */
+	uint16_t type;
+	uint8_t datalen;
+	uint8_t data[JP2_TRACE_DATA_LEN];	/* start of the frame */
+	int32_t rc;
+	uint32_t a;
+	uint32_t b;
+};
+
+typedef void (*jp2_trace_sink)(void *priv,
+		const struct jp2_trace_event *ev);
+
+/*
+ * Statistics. Every remote counts the commands it sends, grouped by command
+ * type. The latency is the time from sending a request to receiving its
+ * response, bucket i of the histogram counts latencies below 2^i us (and
+ * not below 2^(i-1) us). Counters are updated without locking and may be
+ * read from another thread.
+ */
+enum {
+	JP2_STATS_READ,
+	JP2_STATS_WRITE,
+	JP2_STATS_ERASE,
+	JP2_STATS_CHECKSUM,
+	JP2_STATS_INFO,
+	JP2_STATS_LOADER,		/* enter and exit loader */
+	JP2_STATS_OTHER,
+	JP2_STATS_CMDS,
+};
+
+#define JP2_STATS_BUCKETS 24
+
+struct jp2_cmd_stats {
+	uint64_t count;			/* requests sent */
+	uint64_t tx_bytes;		/* including the frame overhead */
+	uint64_t rx_bytes;
+	uint64_t checksum_errors;	/* responses with a bad checksum */
+	uint64_t errors;		/* error responses, I/O errors, timeouts */
+	uint64_t timeouts;
+	uint64_t retries;
+	uint64_t latency_sum;		/* in us */
+	uint64_t latency_max;		/* in us */
+	uint64_t latency[JP2_STATS_BUCKETS];
+};
+
+struct jp2_stats {
+	struct jp2_cmd_stats cmd[JP2_STATS_CMDS];
+};
+
+/* called after each completed step of a multi-command transfer */
+typedef void (*jp2_progress_cb)(void *priv, int done, int total);
+
 extern const char* jp2_version;
 
+/*
+ * Threads. A remote may only be used by one thread at a time, but different
+ * remotes may be used by different threads at once. jp2_get_stats() and
+ * jp2_trace_drain() may be called from any thread. The state shared by all
+ * remotes, the learned reset pulse widths, the erase block sizes and the
+ * info cache, is locked internally. The transport is taken from the osapi
+ * default when a remote is opened, so that must only be changed while no
+ * remote is being opened.
+ */
 int jp2_init(void);
 struct jp2_remote *jp2_open_remote(const char *devname);
+struct jp2_remote *jp2_open_remote_baudrate(const char *devname,
+		int baudrate);
+/* open a remote through the given transport instead of the default */
+struct jp2_remote *jp2_open_remote_ops(const char *devname, int baudrate,
+		struct osapi_ops *ops);
 void jp2_close_remote(struct jp2_remote *r);
 
 int jp2_simple_command(struct jp2_remote *r, const uint8_t cmd);
@@ -69,14 +179,233 @@ int jp2_command(struct jp2_remote *r, const uint8_t *txdata, int txlen,
 	uint8_t **rxdata);
 
 /* specific commands */
-int jp2_read_block(struct jp2_remote *r, uint32_t address, uint16_t len,
+int jp2_read_block(struct jp2_remote *r, uint32_t address, uint32_t len,
 		uint8_t *data);
 int jp2_erase_block(struct jp2_remote *r, uint32_t start, uint32_t end);
-int jp2_write_block(struct jp2_remote *r, uint32_t address, uint16_t len,
+int jp2_write_block(struct jp2_remote *r, uint32_t address, uint32_t len,
 		uint8_t *data);
 int jp2_checksum_block(struct jp2_remote *r, uint32_t start, uint32_t end);
+/* Erase and write only the blocks whose checksum differs. Returns the number
+ * of blocks written. The range should be aligned to erase blocks. */
+int jp2_write_delta(struct jp2_remote *r, uint32_t address, uint32_t len,
+		uint8_t *data, uint32_t block_size);
+/* Read memory by a single byte CHECKSUM command per byte. Works on remotes
+ * which refuse the READ command. */
+int jp2_checksum_dump(struct jp2_remote *r, uint32_t address, uint32_t len,
+		uint8_t *data);
+/* Compare the remote content with data by using checksums. Only ranges with
+ * a differing checksum are read back. Returns the number of differing bytes,
+ * the first one is stored in bad_address. */
+int jp2_verify(struct jp2_remote *r, uint32_t address, uint32_t len,
+		uint8_t *data, uint32_t *bad_address);
 int jp2_get_info(struct jp2_remote *r, struct jp2_info *info);
 int jp2_enter_loader(struct jp2_remote *r, bool extended_mode);
+/* Enter the loader and get the info with one round trip less. */
+int jp2_connect(struct jp2_remote *r, bool extended_mode,
+		struct jp2_info *info);
+
+/* A serial port with a remote in loader mode attached, see jp2_detect(). */
+struct jp2_port {
+	char devname[JP2_DEVNAME_LEN];
+	uint16_t usb_vendor;		/* 0 if it isn't a USB device */
+	uint16_t usb_product;
+	char signature[JP2_SIGNATURE_LEN + 1];
+};
+
+/* Look for remotes on all serial ports at once. Every port is reset and
+ * gets timeout_ms to answer, the remotes found are left running again.
+ * Returns the number of remotes found, up to max of them are stored in
+ * ports. */
+int jp2_detect(struct jp2_port *ports, int max, int timeout_ms);
+
+/* Cache the info of the remote in the given file, keyed by the serial port
+ * and the signature. The info area is then read right behind the INFO
+ * command, instead of after it. NULL disables the cache, which is the
+ * default unless the environment variable JP2_INFO_CACHE names a file. */
+int jp2_set_info_cache(struct jp2_remote *r, const char *path);
+/* Drop the cached info of the remote at devname, or of all remotes if
+ * devname is NULL. */
+int jp2_forget_info(const char *path, const char *devname);
 int jp2_exit_loader(struct jp2_remote *r);
 
+/*
+ * Asynchronous requests, to drive many remotes from one thread. A request
+ * is sent right away and its callback is called from jp2_process_events()
+ * once the response arrived, with rc and data as returned by jp2_command().
+ * data is only valid during the callback unless the response went into the
+ * caller's buffer. Up to JP2_MAX_INFLIGHT requests may be in flight, they
+ * complete in the order they were submitted.
+ *
+ * After a timeout, a framing or an I/O error all requests in flight fail
+ * with that error and the pending input is discarded. The synchronous calls
+ * fail with -JP2_ERR_BUSY while requests are in flight, as does a submit
+ * while a synchronous call waits for its response, eg. from the progress
+ * callback.
+ */
+#define JP2_MAX_INFLIGHT 32
+
+typedef void (*jp2_complete_cb)(void *priv, int rc, uint8_t *data);
+
+int jp2_submit(struct jp2_remote *r, const uint8_t *txdata, int txlen,
+		jp2_complete_cb cb, void *priv);
+/* the data read is stored in data, which must stay valid until the request
+ * completed, as must the data of a write */
+int jp2_submit_read(struct jp2_remote *r, uint32_t address, uint16_t len,
+		uint8_t *data, jp2_complete_cb cb, void *priv);
+int jp2_submit_write(struct jp2_remote *r, uint32_t address, uint16_t len,
+		uint8_t *data, jp2_complete_cb cb, void *priv);
+int jp2_submit_erase(struct jp2_remote *r, uint32_t start, uint32_t end,
+		jp2_complete_cb cb, void *priv);
+int jp2_submit_checksum(struct jp2_remote *r, uint32_t start, uint32_t end,
+		jp2_complete_cb cb, void *priv);
+/* Number of requests in flight. */
+int jp2_pending(struct jp2_remote *r);
+/* Descriptor to wait for input with poll() or epoll, -1 if there is none.
+ * It must not be read from. */
+int jp2_get_fd(struct jp2_remote *r);
+/* Time in ms until the oldest request in flight times out, -1 if there is
+ * none or it waits forever. */
+int jp2_next_timeout(struct jp2_remote *r);
+/* Handle the input, waiting up to timeout_ms for it (0 doesn't block, a
+ * negative value waits until there is input or a request timed out).
+ * Returns the number of requests completed. */
+int jp2_process_events(struct jp2_remote *r, int timeout_ms);
+
+/*
+ * Planning writes. Flash can only be written after the whole erase blocks
+ * have been erased. jp2_plan_writes() turns a list of writes, of which later
+ * ones win where they overlap, into runs of neighbouring blocks which are
+ * erased at once. The bytes of these blocks which aren't written are read
+ * before and written back. The steps and the estimated cost can be looked at
+ * before jp2_plan_execute() runs them. It returns the number of blocks
+ * erased. If it fails, it may be run again, what was read is kept.
+ */
+struct jp2_write {
+	uint32_t address;
+	uint32_t len;
+	const uint8_t *data;
+};
+
+struct jp2_plan_step {
+	uint8_t cmd;			/* JP2_CMD_READ, _ERASE or _WRITE */
+	uint32_t address;
+	uint32_t len;
+};
+
+struct jp2_plan_cost {
+	int commands;			/* including the chunks */
+	uint32_t tx_bytes;		/* including the frame overhead */
+	uint32_t rx_bytes;
+	int erase_blocks;
+	uint32_t time_ms;		/* from the measured latencies, if the
+					   commands have been seen before */
+};
+
+struct jp2_plan;
+
+struct jp2_plan *jp2_plan_writes(struct jp2_remote *r,
+		const struct jp2_write *writes, int count, uint32_t block_size);
+int jp2_plan_steps(const struct jp2_plan *p,
+		const struct jp2_plan_step **steps);
+void jp2_plan_cost(const struct jp2_plan *p, struct jp2_plan_cost *cost);
+int jp2_plan_execute(struct jp2_plan *p);
+void jp2_plan_free(struct jp2_plan *p);
+
+/*
+ * Mirror of a range of the remote memory in host memory. Pages of block_size
+ * bytes, the erase block size of the remote, are read on first access and
+ * kept. Writes only change the mirror until jp2_mirror_commit() erases and
+ * writes the pages which differ from the remote, runs of neighbouring pages
+ * at once, see jp2_plan_writes(). The range must be aligned to block_size.
+ */
+struct jp2_mirror;
+
+struct jp2_mirror *jp2_mirror_new(struct jp2_remote *r, uint32_t address,
+		uint32_t len, uint32_t block_size);
+void jp2_mirror_free(struct jp2_mirror *m);
+int jp2_mirror_read(struct jp2_mirror *m, uint32_t address, uint32_t len,
+		uint8_t *data);
+int jp2_mirror_write(struct jp2_mirror *m, uint32_t address, uint32_t len,
+		const uint8_t *data);
+/* Returns the number of pages written. If it fails, the changes are kept
+ * and may be committed again. */
+int jp2_mirror_commit(struct jp2_mirror *m);
+/* All pages of the range have been read. */
+bool jp2_mirror_cached(struct jp2_mirror *m, uint32_t address, uint32_t len);
+/* The remote was written to by other means. The pages fully covered take
+ * data, changes to them are dropped. The others are read again. */
+int jp2_mirror_update(struct jp2_mirror *m, uint32_t address, uint32_t len,
+		const uint8_t *data);
+/* Read the pages again on the next access, changes are kept. */
+void jp2_mirror_invalidate(struct jp2_mirror *m);
+/* Like jp2_mirror_invalidate(), but the changes which weren't committed are
+ * dropped, eg. after the remote failed to take them. */
+void jp2_mirror_discard(struct jp2_mirror *m);
+
+/* Number of READ requests kept in flight by jp2_read_block(). The default
+ * of 1 is the plain stop-and-wait behaviour. */
+int jp2_set_read_window(struct jp2_remote *r, int window);
+
+/* Progress of jp2_read_block(), jp2_checksum_dump() and friends. The steps
+ * are the commands of the transfer. */
+void jp2_set_progress_cb(struct jp2_remote *r, jp2_progress_cb cb,
+		void *priv);
+
+void jp2_set_trace_sink(struct jp2_remote *r, jp2_trace_sink sink,
+		void *priv);
+int jp2_trace_drain(struct jp2_remote *r, jp2_trace_sink sink, void *priv);
+int jp2_trace_format(const struct jp2_trace_event *ev, char *buf,
+		size_t size);
+/* sink which prints the events to stderr, used if JP2_DEBUG is set */
+void jp2_trace_stderr(void *priv, const struct jp2_trace_event *ev);
+
+void jp2_get_stats(struct jp2_remote *r, struct jp2_stats *stats);
+void jp2_reset_stats(struct jp2_remote *r);
+const char *jp2_stats_name(int cmd);
+/* upper bound of the bucket the given percentile of the latencies falls
+ * into, in us */
+uint64_t jp2_stats_percentile(const struct jp2_cmd_stats *s, int percent);
+
+/* Time to wait for the response to a command (JP2_CMD_*), on top of the
+ * time needed to transfer it. ENTER_LOADER and EXIT_LOADER share one
+ * timeout, as do all unknown commands. A negative value waits forever. */
+int jp2_set_timeout(struct jp2_remote *r, uint8_t cmd, int timeout_ms);
+
+/* Payload size of a single READ/WRITE command. The default is 128 bytes,
+ * jp2_probe_chunk_size() negotiates a larger one after jp2_get_info(). */
+int jp2_probe_chunk_size(struct jp2_remote *r);
+int jp2_set_chunk_size(struct jp2_remote *r, int size);
+int jp2_get_read_chunk_size(struct jp2_remote *r);
+int jp2_get_write_chunk_size(struct jp2_remote *r);
+/* 2 or 4 bytes, 0 until the remote info has been read */
+int jp2_get_address_width(struct jp2_remote *r);
+
+/* Size of the erase blocks, a power of two. It is kept per remote type and
+ * taken again when jp2_get_info() sees that type. jp2_get_erase_block_size()
+ * returns 0 if it isn't known.
+ *
+ * jp2_probe_erase_block() finds sizes from 64 bytes to 4k by erasing an 8k
+ * scratch area in the update area, which is read before and restored
+ * afterwards. It writes to flash, so it is only done when asked for. Other
+ * sizes fail with -JP2_ERR_UNSUPPORTED, on remotes with larger blocks the
+ * probe wipes data beyond the scratch area. If the scratch area couldn't be
+ * restored, that error is returned. */
+int jp2_probe_erase_block(struct jp2_remote *r, const struct jp2_info *info);
+int jp2_set_erase_block_size(struct jp2_remote *r, int size);
+int jp2_get_erase_block_size(struct jp2_remote *r);
+
+/* Width of the reset pulse which starts the loader. By default it starts
+ * at 100ms and is shortened for remote types which are known to come up
+ * with less. Setting it disables that. */
+int jp2_set_reset_pulse(struct jp2_remote *r, int pulse_us);
+
+/* Line speed of the serial port. Non-standard rates are supported.
+ * jp2_probe_host_baudrate() steps up the rate of the port, not the one of
+ * the remote, up to max_baudrate as long as the remote keeps answering. It
+ * only helps with remotes which follow the rate of the host. Returns the
+ * highest working rate, on failure the port is back at the rate it had. */
+int jp2_set_baudrate(struct jp2_remote *r, int baudrate);
+int jp2_get_baudrate(struct jp2_remote *r);
+int jp2_probe_host_baudrate(struct jp2_remote *r, int max_baudrate);
+
 #endif /* __JP2LIBRARY_H */
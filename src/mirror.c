@@ -0,0 +1,357 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Mirror of a range of the remote memory.
+ *
+ * The range is split into pages of the erase block size. A page is read
+ * when it is accessed first, runs of pages at once. Writes only change the
+ * copy in data and mark the bytes written, so they survive the page being
+ * read later. A commit compares the pages written to with what the remote
+ * has (orig) and hands the pages which changed to the write planner.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "jp2library.h"
+
+struct jp2_mirror {
+	struct jp2_remote *r;
+	uint32_t address;
+	uint32_t len;
+	uint32_t block_size;
+	int pages;
+	uint8_t *data;		/* content as seen by the user */
+	uint8_t *orig;		/* content of the remote, of the valid pages */
+	uint8_t *valid;		/* per page, orig is known */
+	uint8_t *touched;	/* per page, written to since the last commit */
+	uint8_t *written;	/* bitmap of the bytes written to */
+};
+
+static bool mirror_written(struct jp2_mirror *m, uint32_t offset)
+{
+	return m->written[offset / 8] & (1 << (offset % 8));
+}
+
+static void mirror_mark(struct jp2_mirror *m, uint32_t offset, uint32_t len)
+{
+	for (; len; offset++, len--) {
+		m->written[offset / 8] |= 1 << (offset % 8);
+	}
+}
+
+static void mirror_unmark(struct jp2_mirror *m, uint32_t offset,
+		uint32_t len)
+{
+	for (; len; offset++, len--) {
+		m->written[offset / 8] &= ~(1 << (offset % 8));
+	}
+}
+
+static bool mirror_range(struct jp2_mirror *m, uint32_t address,
+		uint32_t len)
+{
+	return len && address >= m->address
+		&& address - m->address <= m->len
+		&& len <= m->len - (address - m->address);
+}
+
+struct jp2_mirror *jp2_mirror_new(struct jp2_remote *r, uint32_t address,
+		uint32_t len, uint32_t block_size)
+{
+	struct jp2_mirror *m;
+
+	if (block_size < 2 || (block_size & 1) || len == 0
+			|| address % block_size || len % block_size) {
+		return NULL;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		return NULL;
+	}
+
+	m->r = r;
+	m->address = address;
+	m->len = len;
+	m->block_size = block_size;
+	m->pages = len / block_size;
+	m->data = malloc(len);
+	m->orig = malloc(len);
+	m->valid = calloc(m->pages, 1);
+	m->touched = calloc(m->pages, 1);
+	m->written = calloc((len + 7) / 8, 1);
+	if (!m->data || !m->orig || !m->valid || !m->touched
+			|| !m->written) {
+		jp2_mirror_free(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+void jp2_mirror_free(struct jp2_mirror *m)
+{
+	free(m->data);
+	free(m->orig);
+	free(m->valid);
+	free(m->touched);
+	free(m->written);
+	free(m);
+}
+
+/* read the pages first to last which aren't valid yet, which are touched if
+ * only_touched is set */
+static int mirror_fetch(struct jp2_mirror *m, int first, int last,
+		bool only_touched)
+{
+	int i, j;
+	int rc;
+	uint32_t offset;
+	uint32_t len;
+	uint32_t k;
+
+	for (i = first; i <= last; i = j) {
+		if (m->valid[i] || (only_touched && !m->touched[i])) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i; j <= last && !m->valid[j]
+				&& (!only_touched || m->touched[j]); j++);
+
+		offset = i * m->block_size;
+		len = (j - i) * m->block_size;
+		rc = jp2_read_block(m->r, m->address + offset, len,
+				m->orig + offset);
+		if (rc < 0) {
+			return rc;
+		}
+
+		/* the bytes written before are kept */
+		for (k = offset; k < offset + len; k++) {
+			if (!mirror_written(m, k)) {
+				m->data[k] = m->orig[k];
+			}
+		}
+		memset(m->valid + i, 1, j - i);
+	}
+
+	return 0;
+}
+
+int jp2_mirror_read(struct jp2_mirror *m, uint32_t address, uint32_t len,
+		uint8_t *data)
+{
+	int rc;
+	uint32_t offset = address - m->address;
+
+	if (!mirror_range(m, address, len)) {
+		return -1;
+	}
+
+	rc = mirror_fetch(m, offset / m->block_size,
+			(offset + len - 1) / m->block_size, false);
+	if (rc < 0) {
+		return rc;
+	}
+
+	memcpy(data, m->data + offset, len);
+	return len;
+}
+
+int jp2_mirror_write(struct jp2_mirror *m, uint32_t address, uint32_t len,
+		const uint8_t *data)
+{
+	uint32_t offset = address - m->address;
+	int first;
+	int last;
+
+	if (!mirror_range(m, address, len)) {
+		return -1;
+	}
+
+	first = offset / m->block_size;
+	last = (offset + len - 1) / m->block_size;
+
+	memcpy(m->data + offset, data, len);
+	mirror_mark(m, offset, len);
+	memset(m->touched + first, 1, last - first + 1);
+
+	return len;
+}
+
+/* a touched page is only written if it differs from the remote */
+static bool mirror_changed(struct jp2_mirror *m, int page)
+{
+	uint32_t offset = page * m->block_size;
+
+	if (!m->touched[page]) {
+		return false;
+	}
+	if (memcmp(m->data + offset, m->orig + offset, m->block_size)) {
+		return true;
+	}
+
+	m->touched[page] = 0;
+	mirror_unmark(m, offset, m->block_size);
+	return false;
+}
+
+int jp2_mirror_commit(struct jp2_mirror *m)
+{
+	int i, j;
+	int n = 0;
+	int rc;
+	int written = 0;
+	uint32_t offset;
+	struct jp2_write *writes;
+	struct jp2_plan *plan;
+
+	/* the remote content of the pages written to is needed to compare
+	 * and to fill up the blocks */
+	rc = mirror_fetch(m, 0, m->pages - 1, true);
+	if (rc < 0) {
+		return rc;
+	}
+
+	writes = malloc(m->pages * sizeof(*writes));
+	if (!writes) {
+		return -1;
+	}
+
+	/* whole pages are written, so the plan doesn't need to read */
+	for (i = 0; i < m->pages; i = j) {
+		if (!mirror_changed(m, i)) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < m->pages && mirror_changed(m, j); j++);
+
+		offset = i * m->block_size;
+		writes[n].address = m->address + offset;
+		writes[n].len = (j - i) * m->block_size;
+		writes[n].data = m->data + offset;
+		n++;
+		written += j - i;
+	}
+
+	if (n == 0) {
+		free(writes);
+		return 0;
+	}
+
+	plan = jp2_plan_writes(m->r, writes, n, m->block_size);
+	if (!plan) {
+		free(writes);
+		return -1;
+	}
+
+	/* whatever the remote has now is unknown until it is read again, the
+	 * data written is kept */
+	for (i = 0; i < n; i++) {
+		offset = writes[i].address - m->address;
+		memset(m->valid + offset / m->block_size, 0,
+				writes[i].len / m->block_size);
+		mirror_mark(m, offset, writes[i].len);
+	}
+
+	rc = jp2_plan_execute(plan);
+	if (rc >= 0) {
+		for (i = 0; i < n; i++) {
+			offset = writes[i].address - m->address;
+			memcpy(m->orig + offset, m->data + offset,
+					writes[i].len);
+			memset(m->valid + offset / m->block_size, 1,
+					writes[i].len / m->block_size);
+			memset(m->touched + offset / m->block_size, 0,
+					writes[i].len / m->block_size);
+			mirror_unmark(m, offset, writes[i].len);
+		}
+		rc = written;
+	}
+
+	jp2_plan_free(plan);
+	free(writes);
+	return rc;
+}
+
+bool jp2_mirror_cached(struct jp2_mirror *m, uint32_t address, uint32_t len)
+{
+	int i;
+	uint32_t offset = address - m->address;
+
+	if (!mirror_range(m, address, len)) {
+		return false;
+	}
+
+	for (i = offset / m->block_size;
+			i <= (offset + len - 1) / m->block_size; i++) {
+		if (!m->valid[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int jp2_mirror_update(struct jp2_mirror *m, uint32_t address, uint32_t len,
+		const uint8_t *data)
+{
+	int i;
+	uint32_t offset = address - m->address;
+	uint32_t start;
+
+	if (!mirror_range(m, address, len)) {
+		return -1;
+	}
+
+	for (i = offset / m->block_size;
+			i <= (offset + len - 1) / m->block_size; i++) {
+		start = i * m->block_size;
+		if (start < offset ||
+				start + m->block_size > offset + len) {
+			/* the rest of the page is read again */
+			m->valid[i] = 0;
+			continue;
+		}
+		memcpy(m->orig + start, data + (start - offset),
+				m->block_size);
+		memcpy(m->data + start, m->orig + start, m->block_size);
+		mirror_unmark(m, start, m->block_size);
+		m->valid[i] = 1;
+		m->touched[i] = 0;
+	}
+
+	return len;
+}
+
+void jp2_mirror_invalidate(struct jp2_mirror *m)
+{
+	memset(m->valid, 0, m->pages);
+}
+
+void jp2_mirror_discard(struct jp2_mirror *m)
+{
+	memset(m->valid, 0, m->pages);
+	memset(m->touched, 0, m->pages);
+	memset(m->written, 0, (m->len + 7) / 8);
+}
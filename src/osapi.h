@@ -21,18 +21,52 @@
 #define __OSAPI_H
 
 #include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+/* returned by read_some() if the deadline passed */
+#define OSAPI_ERR_TIMEOUT (-2)
+
+struct osapi_port {
+	const char *devname;
+	uint16_t usb_vendor;		/* 0 if it isn't a USB device */
+	uint16_t usb_product;
+};
 
 struct osapi_ops {
-	const char *(*enumerate)(void);
-	void *(*open)(const char *devname, int flags);
+	/* calls cb for each serial port a remote might be attached to,
+	 * returns their number */
+	int (*enumerate)(void (*cb)(void *priv,
+				const struct osapi_port *port), void *priv);
+	/* ops are the ones open() was called through */
+	void *(*open)(struct osapi_ops *ops, const char *devname, int flags);
 	void (*close)(void *handle);
 	int (*reset)(void *handle, bool assert_pin);
 	int (*flush)(void *handle);
-	ssize_t (*read)(void *handle, void *buf, size_t count);
-	ssize_t (*read_nonblock)(void *handle, void *buf, size_t count);
+	int (*set_baudrate)(void *handle, int baudrate);
+	/* read whatever is available, up to count bytes. Blocks until there
+	 * is at least one byte or timeout_ms passed, a negative timeout waits
+	 * forever. */
+	ssize_t (*read_some)(void *handle, void *buf, size_t count,
+			int timeout_ms);
 	ssize_t (*write)(void *handle, void *buf, size_t count);
+	ssize_t (*writev)(void *handle, const struct iovec *iov, int iovcnt);
+	/* optional, a descriptor which becomes readable when there is input,
+	 * for poll() */
+	int (*get_fd)(void *handle);
 };
 
 extern struct osapi_ops *osapi;
 
+/* A name of the serial port which stays the same when it is plugged in
+ * again, e.g. its link in /dev/serial/by-id. */
+void osapi_port_id(const char *devname, char *buf, size_t size);
+
+/* osapi_capture.c */
+struct osapi_ops *osapi_capture(struct osapi_ops *ops, const char *filename);
+void osapi_capture_free(struct osapi_ops *ops);
+extern struct osapi_ops osapi_replay_ops;
+void osapi_replay_timing(bool enable);
+
 #endif /* __OSAPI_H */
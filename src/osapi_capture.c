@@ -0,0 +1,522 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Session capture and replay.
+ *
+ * The capture ops wrap another backend and record every call into a file.
+ * Every osapi_capture() has its own file, which takes one device at a time.
+ * The replay ops serve the recorded input back to the library, so a session
+ * can be rerun without the remote.
+ *
+ * File format, all numbers little endian:
+ *   header: "JP2CAP" version(u8) reserved(u8)
+ *   record: type(u8) time(u32, us since open) rc(i32) len(u32) data[len]
+ *
+ * Reads are recorded with the bytes actually returned, writes with the
+ * bytes passed in. Replay only follows the input stream, thus the request
+ * sequence of the replaying library doesn't have to match the captured
+ * one, as long as it asks for the same data.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "osapi.h"
+
+#define CAP_MAGIC "JP2CAP"
+#define CAP_VERSION 1
+#define CAP_HDR_LEN 8
+#define CAP_REC_LEN 13
+
+enum {
+	CAP_WRITE = 1,
+	CAP_READ,
+	CAP_RESET = 4,		/* 3 was a non-blocking read */
+	CAP_FLUSH,
+	CAP_BAUDRATE,
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void put_u32(uint8_t *buf, uint32_t val)
+{
+	buf[0] = val & 0xff;
+	buf[1] = (val >> 8) & 0xff;
+	buf[2] = (val >> 16) & 0xff;
+	buf[3] = (val >> 24) & 0xff;
+}
+
+static uint32_t get_u32(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/*
+ * Capture
+ */
+
+struct capture {
+	struct osapi_ops ops;		/* first, open() gets a pointer to it */
+	struct osapi_ops *inner;
+	FILE *f;
+	pthread_mutex_t lock;
+	bool busy;			/* a device is being recorded */
+};
+
+struct capture_data {
+	struct capture *c;
+	void *handle;
+	uint64_t start;
+};
+
+static void cap_record(struct capture_data *d, int type, int rc,
+		const struct iovec *iov, int iovcnt)
+{
+	uint8_t hdr[CAP_REC_LEN];
+	size_t len = 0;
+	size_t left;
+	int i;
+
+	/* only the bytes which were actually transferred are recorded */
+	left = (rc > 0) ? rc : 0;
+	for (i = 0; i < iovcnt; i++) {
+		len += (iov[i].iov_len < left - len) ? iov[i].iov_len : left - len;
+	}
+
+	hdr[0] = type;
+	put_u32(hdr + 1, now_us() - d->start);
+	put_u32(hdr + 5, rc);
+	put_u32(hdr + 9, len);
+	fwrite(hdr, sizeof(hdr), 1, d->c->f);
+
+	for (i = 0; i < iovcnt && len; i++) {
+		size_t n = (iov[i].iov_len < len) ? iov[i].iov_len : len;
+		fwrite(iov[i].iov_base, n, 1, d->c->f);
+		len -= n;
+	}
+}
+
+static void cap_record_buf(struct capture_data *d, int type, int rc,
+		const void *buf, size_t count)
+{
+	struct iovec iov = { (void *)buf, count };
+	cap_record(d, type, rc, &iov, 1);
+}
+
+/* the records of two devices can't be told apart, so only one device may be
+ * open at a time */
+static bool cap_claim(struct capture *c, bool claim)
+{
+	bool ok;
+
+	pthread_mutex_lock(&c->lock);
+	ok = (c->busy != claim);
+	if (ok) {
+		c->busy = claim;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return ok;
+}
+
+static void *_cap_open(struct osapi_ops *ops, const char *devname, int flags)
+{
+	struct capture *c = (struct capture *)ops;
+	struct capture_data *d;
+
+	if (!cap_claim(c, true)) {
+		fprintf(stderr, "capture: %s: another device is recorded\n",
+				devname);
+		return NULL;
+	}
+
+	d = malloc(sizeof(*d));
+	assert(d);
+
+	d->c = c;
+	d->handle = c->inner->open(c->inner, devname, flags);
+	if (d->handle == NULL) {
+		cap_claim(c, false);
+		free(d);
+		return NULL;
+	}
+
+	d->start = now_us();
+
+	return d;
+}
+
+static void _cap_close(void *handle)
+{
+	struct capture_data *d = handle;
+
+	d->c->inner->close(d->handle);
+	fflush(d->c->f);
+	cap_claim(d->c, false);
+	free(d);
+}
+
+static int _cap_reset(void *handle, bool assert_pin)
+{
+	struct capture_data *d = handle;
+	uint8_t pin = assert_pin;
+	int rc;
+
+	rc = d->c->inner->reset(d->handle, assert_pin);
+	cap_record_buf(d, CAP_RESET, rc, &pin, 1);
+	return rc;
+}
+
+static int _cap_flush(void *handle)
+{
+	struct capture_data *d = handle;
+	int rc;
+
+	rc = d->c->inner->flush(d->handle);
+	cap_record(d, CAP_FLUSH, rc, NULL, 0);
+	return rc;
+}
+
+static int _cap_set_baudrate(void *handle, int baudrate)
+{
+	struct capture_data *d = handle;
+	uint8_t buf[4];
+	int rc;
+
+	rc = d->c->inner->set_baudrate(d->handle, baudrate);
+	put_u32(buf, baudrate);
+	cap_record_buf(d, CAP_BAUDRATE, rc, buf, sizeof(buf));
+	return rc;
+}
+
+static ssize_t _cap_read_some(void *handle, void *buf, size_t count,
+		int timeout_ms)
+{
+	struct capture_data *d = handle;
+	ssize_t rc;
+
+	rc = d->c->inner->read_some(d->handle, buf, count, timeout_ms);
+	cap_record_buf(d, CAP_READ, rc, buf, count);
+	return rc;
+}
+
+static ssize_t _cap_write(void *handle, void *buf, size_t count)
+{
+	struct capture_data *d = handle;
+	ssize_t rc;
+
+	rc = d->c->inner->write(d->handle, buf, count);
+	cap_record_buf(d, CAP_WRITE, rc, buf, count);
+	return rc;
+}
+
+static ssize_t _cap_writev(void *handle, const struct iovec *iov, int iovcnt)
+{
+	struct capture_data *d = handle;
+	ssize_t rc;
+
+	rc = d->c->inner->writev(d->handle, iov, iovcnt);
+	cap_record(d, CAP_WRITE, rc, iov, iovcnt);
+	return rc;
+}
+
+static int _cap_get_fd(void *handle)
+{
+	struct capture_data *d = handle;
+
+	if (!d->c->inner->get_fd) {
+		return -1;
+	}
+	return d->c->inner->get_fd(d->handle);
+}
+
+/* The remotes opened through the returned ops are recorded into filename,
+ * one after the other. Returns NULL if the file can't be created. */
+struct osapi_ops *osapi_capture(struct osapi_ops *ops, const char *filename)
+{
+	struct capture *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		return NULL;
+	}
+
+	c->f = fopen(filename, "wb");
+	if (c->f == NULL) {
+		perror("fopen()");
+		free(c);
+		return NULL;
+	}
+	fwrite(CAP_MAGIC "\x01\x00", CAP_HDR_LEN, 1, c->f);
+
+	c->inner = ops;
+	pthread_mutex_init(&c->lock, NULL);
+	c->ops.enumerate = ops->enumerate;
+	c->ops.open = _cap_open;
+	c->ops.close = _cap_close;
+	c->ops.reset = _cap_reset;
+	c->ops.flush = _cap_flush;
+	c->ops.set_baudrate = _cap_set_baudrate;
+	c->ops.read_some = _cap_read_some;
+	c->ops.write = _cap_write;
+	c->ops.writev = _cap_writev;
+	c->ops.get_fd = _cap_get_fd;
+
+	return &c->ops;
+}
+
+/* No device must be open through ops anymore. */
+void osapi_capture_free(struct osapi_ops *ops)
+{
+	struct capture *c = (struct capture *)ops;
+
+	fclose(c->f);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+/*
+ * Replay
+ */
+
+static bool replay_timing;
+
+struct replay_data {
+	uint8_t *buf;
+	size_t size;
+	size_t pos;		/* current record */
+	size_t consumed;	/* bytes already served from this record */
+	uint32_t cap_write;	/* time of the last write in the capture */
+	uint64_t write;		/* time of the last write during replay */
+};
+
+static void *_replay_open(struct osapi_ops *ops, const char *filename,
+		int flags)
+{
+	struct replay_data *d;
+	FILE *f;
+	long size;
+
+	f = fopen(filename, "rb");
+	if (f == NULL) {
+		perror("fopen()");
+		return NULL;
+	}
+
+	d = malloc(sizeof(*d));
+	assert(d);
+	memset(d, 0, sizeof(*d));
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	if (size < CAP_HDR_LEN) {
+		goto err;
+	}
+
+	d->buf = malloc(size);
+	assert(d->buf);
+	d->size = size;
+
+	if (fread(d->buf, size, 1, f) != 1) {
+		goto err;
+	}
+	if (memcmp(d->buf, CAP_MAGIC, 6) || d->buf[6] != CAP_VERSION) {
+		fprintf(stderr, "%s is not a capture file\n", filename);
+		goto err;
+	}
+
+	fclose(f);
+	d->pos = CAP_HDR_LEN;
+	d->write = now_us();
+
+	return d;
+
+err:
+	fclose(f);
+	free(d->buf);
+	free(d);
+	return NULL;
+}
+
+static void _replay_close(void *handle)
+{
+	struct replay_data *d = handle;
+
+	free(d->buf);
+	free(d);
+}
+
+/*
+ * Find the next record carrying input, skipping all other records. Returns
+ * NULL at the end of the capture.
+ */
+static uint8_t *replay_next(struct replay_data *d)
+{
+	uint8_t *rec;
+	uint32_t len;
+
+	while (d->pos + CAP_REC_LEN <= d->size) {
+		rec = d->buf + d->pos;
+		len = get_u32(rec + 9);
+		if (d->pos + CAP_REC_LEN + len > d->size) {
+			break;
+		}
+
+		if (rec[0] == CAP_READ && d->consumed < len) {
+			return rec;
+		}
+
+		if (rec[0] == CAP_WRITE) {
+			d->cap_write = get_u32(rec + 1);
+		}
+		d->pos += CAP_REC_LEN + len;
+		d->consumed = 0;
+	}
+
+	return NULL;
+}
+
+/*
+ * The remote answered in the capture some time after the last write. Keep
+ * that delay, relative to the last write of the replay.
+ */
+static uint64_t replay_due(struct replay_data *d, uint8_t *rec)
+{
+	if (!replay_timing || d->consumed) {
+		return 0;
+	}
+
+	return d->write + (get_u32(rec + 1) - d->cap_write);
+}
+
+/*
+ * Return as soon as some input was served, like a read() would. Input which
+ * isn't due within timeout_ms times out, as it would live.
+ */
+static ssize_t replay_input(struct replay_data *d, uint8_t *buf, size_t count,
+		int timeout_ms)
+{
+	uint8_t *rec;
+	uint64_t due;
+	uint64_t now;
+	size_t n;
+
+	rec = replay_next(d);
+	if (rec == NULL) {
+		/* the remote fell silent */
+		return OSAPI_ERR_TIMEOUT;
+	}
+
+	due = replay_due(d, rec);
+	now = now_us();
+	if (due > now) {
+		if (timeout_ms >= 0 && due - now > timeout_ms * 1000ULL) {
+			usleep(timeout_ms * 1000);
+			return OSAPI_ERR_TIMEOUT;
+		}
+		usleep(due - now);
+	}
+
+	n = get_u32(rec + 9) - d->consumed;
+	if (n > count) {
+		n = count;
+	}
+	memcpy(buf, rec + CAP_REC_LEN + d->consumed, n);
+	d->consumed += n;
+
+	return n;
+}
+
+static int _replay_reset(void *handle, bool assert_pin)
+{
+	return 0;
+}
+
+static int _replay_flush(void *handle)
+{
+	return 0;
+}
+
+static int _replay_set_baudrate(void *handle, int baudrate)
+{
+	return 0;
+}
+
+static ssize_t _replay_read_some(void *handle, void *buf, size_t count,
+		int timeout_ms)
+{
+	return replay_input(handle, buf, count, timeout_ms);
+}
+
+static ssize_t _replay_write(void *handle, void *buf, size_t count)
+{
+	struct replay_data *d = handle;
+
+	d->write = now_us();
+	return count;
+}
+
+static ssize_t _replay_writev(void *handle, const struct iovec *iov,
+		int iovcnt)
+{
+	struct replay_data *d = handle;
+	ssize_t count = 0;
+
+	while (iovcnt--) {
+		count += iov->iov_len;
+		iov++;
+	}
+	d->write = now_us();
+
+	return count;
+}
+
+/* The device name passed to open() is the capture file. */
+struct osapi_ops osapi_replay_ops = {
+	.open = _replay_open,
+	.close = _replay_close,
+	.reset = _replay_reset,
+	.flush = _replay_flush,
+	.set_baudrate = _replay_set_baudrate,
+	.read_some = _replay_read_some,
+	.write = _replay_write,
+	.writev = _replay_writev,
+};
+
+/* Serve the input with the delays of the original session. */
+void osapi_replay_timing(bool enable)
+{
+	replay_timing = enable;
+}
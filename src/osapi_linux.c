@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -29,71 +30,172 @@
 #include <termios.h>
 #include <dirent.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
 
 #include "osapi.h"
 
-typedef enum {
-	STATE_BLOCKING,
-	STATE_NON_BLOCKING,
-} state_t;
-
+/* The fd is non-blocking for its whole lifetime, waiting for data is done
+ * by poll(). */
 struct osapi_linux_data {
 	int fd;
 	struct termios oldtio;
-	int flags;
-	state_t state;
 };
 
-/* non-reentrant! */
-static const char *_enumerate_remote(void)
+/* implemented in termios2_linux.c */
+int termios2_set_baudrate(int fd, int baudrate);
+
+/* a hex number from a sysfs attribute */
+static int sysfs_read_hex(const char *dir, const char *attr,
+		unsigned int *val)
 {
-	static DIR *dir = NULL;
-	struct dirent *dirent;
-	static char buf[NAME_MAX + 1];
+	FILE *f;
+	char path[PATH_MAX];
+	int rc;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+	rc = fscanf(f, "%x", val);
+	fclose(f);
 
+	return (rc == 1) ? 0 : -1;
+}
+
+/* the ids of the USB device the given sysfs device belongs to */
+static void sysfs_usb_ids(char *dir, struct osapi_port *port)
+{
+	char *slash;
+	unsigned int vendor;
+	unsigned int product;
+
+	while ((slash = strrchr(dir, '/')) && slash != dir) {
+		if (sysfs_read_hex(dir, "idVendor", &vendor) == 0 &&
+				sysfs_read_hex(dir, "idProduct", &product) == 0) {
+			port->usb_vendor = vendor;
+			port->usb_product = product;
+			return;
+		}
+		*slash = '\0';
+	}
+}
+
+/*
+ * Serial ports with hardware behind them, as listed in sysfs. Legacy ttyS
+ * ports without an UART (type 0) and ports we may not open are skipped.
+ */
+static int _enumerate_remote(void (*cb)(void *priv,
+			const struct osapi_port *port), void *priv)
+{
+	DIR *dir;
+	struct dirent *dirent;
+	struct osapi_port port;
+	char devname[PATH_MAX];
+	char path[PATH_MAX];
+	char link[PATH_MAX];
+	char device[PATH_MAX];
+	unsigned int type;
+	int count = 0;
+
+	dir = opendir("/sys/class/tty");
 	if (dir == NULL) {
-		dir = opendir("/dev");
-		assert(dir);
+		return -1;
 	}
 
-	while ((dirent = readdir(dir)))
-	{
-		if (!strncmp(dirent->d_name, "ttyS", 4)) {
-			break;
+	while ((dirent = readdir(dir))) {
+		if (strncmp(dirent->d_name, "ttyS", 4)
+				&& strncmp(dirent->d_name, "ttyUSB", 6)
+				&& strncmp(dirent->d_name, "ttyACM", 6)) {
+			continue;
 		}
-		if (!strncmp(dirent->d_name, "ttyUSB", 6)) {
-			break;
+
+		/* virtual terminals have no device */
+		snprintf(path, sizeof(path), "/sys/class/tty/%s",
+				dirent->d_name);
+		snprintf(link, sizeof(link), "/sys/class/tty/%s/device",
+				dirent->d_name);
+		if (realpath(link, device) == NULL) {
+			continue;
+		}
+		if (!strncmp(dirent->d_name, "ttyS", 4) &&
+				(sysfs_read_hex(path, "type", &type) < 0
+				 || type == 0)) {
+			continue;
+		}
+
+		snprintf(devname, sizeof(devname), "/dev/%s", dirent->d_name);
+		if (access(devname, R_OK | W_OK) < 0) {
+			continue;
 		}
+
+		memset(&port, 0, sizeof(port));
+		port.devname = devname;
+		sysfs_usb_ids(device, &port);
+		cb(priv, &port);
+		count++;
 	}
+	closedir(dir);
 
-	if (dirent == NULL) {
-		closedir(dir);
-		dir = NULL;
-		return NULL;
+	return count;
+}
+
+void osapi_port_id(const char *devname, char *buf, size_t size)
+{
+	DIR *dir;
+	struct dirent *dirent;
+	char real[PATH_MAX];
+	char link[PATH_MAX];
+	char target[PATH_MAX];
+
+	if (realpath(devname, real) == NULL) {
+		snprintf(buf, size, "%s", devname);
+		return;
 	}
+	snprintf(buf, size, "%s", real);
 
-	strcpy(buf, "/dev/");
-	strcpy(buf + 5, dirent->d_name);
+	dir = opendir("/dev/serial/by-id");
+	if (dir == NULL) {
+		return;
+	}
 
-	return buf;
+	while ((dirent = readdir(dir))) {
+		if (dirent->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(link, sizeof(link), "/dev/serial/by-id/%s",
+				dirent->d_name);
+		if (realpath(link, target) && !strcmp(target, real)) {
+			snprintf(buf, size, "%s", link);
+			break;
+		}
+	}
+	closedir(dir);
 }
 
-static void *_open_remote(const char *devname, int flags)
+static void *_open_remote(struct osapi_ops *ops, const char *devname,
+		int flags)
 {
 	int rc;
 	struct osapi_linux_data *d;
 	struct termios tio;
 
 	d = malloc(sizeof(*d));
-	d->fd = open(devname, O_RDWR);
+	d->fd = open(devname, O_RDWR | O_NONBLOCK);
 	if (d->fd < 0) {
 		perror("open()");
+		free(d);
 		return NULL;
 	}
 
 	rc = tcgetattr(d->fd, &d->oldtio);
 	if (rc < 0) {
 		perror("tcgetattr()");
+		close(d->fd);
 		free(d);
 		return NULL;
 	}
@@ -109,19 +211,57 @@ static void *_open_remote(const char *devname, int flags)
 	rc = tcsetattr(d->fd, TCSANOW, &tio);
 	if (rc < 0) {
 		perror("tcgetattr()");
+		close(d->fd);
 		free(d);
 		return NULL;
 	}
 
-	d->state = STATE_BLOCKING;
-	d->flags = fcntl(d->fd, F_GETFL, 0);
-	if (d->flags < 0) {
-		perror("fcntl()");
-		free(d);
-		return NULL;
+	return d;
+}
+
+static speed_t baudrate_to_speed(int baudrate)
+{
+	switch (baudrate) {
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	case 460800: return B460800;
+	case 500000: return B500000;
+	case 576000: return B576000;
+	case 921600: return B921600;
+	case 1000000: return B1000000;
+	case 1152000: return B1152000;
+	case 1500000: return B1500000;
+	case 2000000: return B2000000;
+	default: return B0;
 	}
+}
 
-	return d;
+static int _set_baudrate_remote(void *handle, int baudrate)
+{
+	int rc;
+	struct osapi_linux_data *d = handle;
+	struct termios tio;
+	speed_t speed;
+
+	speed = baudrate_to_speed(baudrate);
+	if (speed == B0) {
+		/* non-standard rate */
+		return termios2_set_baudrate(d->fd, baudrate);
+	}
+
+	rc = tcgetattr(d->fd, &tio);
+	if (rc < 0) {
+		return rc;
+	}
+
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+
+	return tcsetattr(d->fd, TCSADRAIN, &tio);
 }
 
 static int _flush_remote(void *handle)
@@ -163,70 +303,149 @@ static int _reset_remote(void *handle, bool assert_pin)
 	return 0;
 }
 
-/* Either we read exactly the requested bytes or return with an error. Eg.
- * we don't allow short reads. */
-static ssize_t _read_remote(void *handle, void *buf, size_t count)
+static void deadline_set(struct timespec *deadline, int timeout_ms)
 {
-	int rc;
-	struct osapi_linux_data *d = handle;
-	size_t bytes_read = 0;
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout_ms / 1000;
+	deadline->tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
 
-	if (d->state == STATE_NON_BLOCKING) {
-		rc = fcntl(d->fd, F_SETFL, d->flags);
-		if (rc < 0) {
-			return rc;
+/*
+ * Wait for the given poll events. Returns OSAPI_ERR_TIMEOUT if the deadline
+ * passed before, deadline NULL waits forever.
+ */
+static int wait_fd(struct osapi_linux_data *d, short events,
+		const struct timespec *deadline)
+{
+	int rc;
+	int timeout = -1;
+	struct timespec now;
+	struct pollfd pfd = {
+		.fd = d->fd,
+		.events = events,
+	};
+
+	if (deadline) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = (deadline->tv_sec - now.tv_sec) * 1000
+			+ (deadline->tv_nsec - now.tv_nsec) / 1000000;
+		if (timeout < 0) {
+			timeout = 0;
 		}
-		d->state = STATE_BLOCKING;
 	}
 
-	while (bytes_read < count) {
-		rc = read(d->fd, buf + bytes_read, count - bytes_read);
-		if (rc < 0) {
-			return rc;
-		}
-		bytes_read += rc;
+	do {
+		rc = poll(&pfd, 1, timeout);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc < 0) {
+		return rc;
+	}
+	if (rc == 0) {
+		return OSAPI_ERR_TIMEOUT;
+	}
+
+	return 0;
+}
+
+/* skip the buffers which are already done */
+static int iov_advance(struct iovec **vp, int iovcnt, size_t done)
+{
+	while (iovcnt && done >= (*vp)->iov_len) {
+		done -= (*vp)->iov_len;
+		(*vp)++;
+		iovcnt--;
+	}
+	if (iovcnt) {
+		(*vp)->iov_base = (uint8_t *)(*vp)->iov_base + done;
+		(*vp)->iov_len -= done;
 	}
-	return bytes_read;
+	return iovcnt;
 }
 
-static ssize_t _read_nonblock_remote(void *handle, void *buf, size_t count)
+static ssize_t _read_some_remote(void *handle, void *buf, size_t count,
+		int timeout_ms)
 {
 	int rc;
 	struct osapi_linux_data *d = handle;
-	size_t bytes_read = 0;
+	struct timespec deadline;
 
-	if (d->state == STATE_BLOCKING) {
-		rc = fcntl(d->fd, F_SETFL, d->flags | O_NONBLOCK);
-		if (rc < 0) {
-			return rc;
-		}
-		d->state = STATE_NON_BLOCKING;
+	if (timeout_ms >= 0) {
+		deadline_set(&deadline, timeout_ms);
 	}
 
-	while (bytes_read < count) {
-		rc = read(d->fd, buf + bytes_read, count - bytes_read);
+	for (;;) {
+		rc = wait_fd(d, POLLIN, (timeout_ms >= 0) ? &deadline : NULL);
 		if (rc < 0) {
 			return rc;
 		}
-		bytes_read += rc;
+
+		rc = read(d->fd, buf, count);
+		if (rc < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		if (rc == 0) {
+			return -1;
+		}
+		return rc;
 	}
-	return bytes_read;
 }
 
-static ssize_t _write_remote(void *handle, void *buf, size_t count)
+/* Writes all buffers, short writes are continued once there is room in the
+ * output queue again. */
+static ssize_t _writev_remote(void *handle, const struct iovec *iov,
+		int iovcnt)
 {
 	int rc;
+	int i;
 	struct osapi_linux_data *d = handle;
+	struct iovec v[iovcnt];
+	struct iovec *vp = v;
+	size_t count = 0;
+	size_t bytes_written = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		v[i] = iov[i];
+		count += iov[i].iov_len;
+	}
 
-	if (d->state == STATE_NON_BLOCKING) {
-		rc = fcntl(d->fd, F_SETFL, d->flags);
+	while (bytes_written < count) {
+		rc = writev(d->fd, vp, iovcnt);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc < 0 && errno == EAGAIN) {
+			rc = wait_fd(d, POLLOUT, NULL);
+			if (rc < 0) {
+				return rc;
+			}
+			continue;
+		}
 		if (rc < 0) {
 			return rc;
 		}
-		d->state = STATE_BLOCKING;
+
+		bytes_written += rc;
+		iovcnt = iov_advance(&vp, iovcnt, rc);
 	}
+	return bytes_written;
+}
+
+static ssize_t _write_remote(void *handle, void *buf, size_t count)
+{
+	struct iovec iov = { buf, count };
+	return _writev_remote(handle, &iov, 1);
+}
+
+static int _get_fd_remote(void *handle)
+{
+	struct osapi_linux_data *d = handle;
 
-	return write(d->fd, buf, count);
+	return d->fd;
 }
 
 static struct osapi_ops linux_ops = {
@@ -234,10 +453,12 @@ static struct osapi_ops linux_ops = {
 	.open = _open_remote,
 	.close = _close_remote,
 	.flush = _flush_remote,
+	.set_baudrate = _set_baudrate_remote,
 	.reset = _reset_remote,
-	.read = _read_remote,
-	.read_nonblock = _read_nonblock_remote,
+	.read_some = _read_some_remote,
 	.write = _write_remote,
+	.writev = _writev_remote,
+	.get_fd = _get_fd_remote,
 };
 
 struct osapi_ops *osapi = &linux_ops;
@@ -0,0 +1,442 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Planning writes to flash.
+ *
+ * Every erase block touched by a write is erased, neighbouring blocks at
+ * once, so each run of them costs one ERASE. Erasing a block between two
+ * runs would only add the need to preserve it. The bytes of a run which
+ * aren't written are read before and written back. A READ is cheaper than
+ * two when the gap between them is small, so these are merged. Bytes which
+ * are known to be 0xff are left erased if there are enough of them in a
+ * row to save a WRITE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "jp2library.h"
+#include "stats.h"
+
+/* unknown ranges closer than this are read at once */
+#define PLAN_READ_MERGE 16
+/* erased bytes in a row which are worth splitting a write */
+#define PLAN_SKIP_MIN 32
+
+/* Response latency of a command, in us, used until the remote has been
+ * measured. Rough values for a remote answering at once and erasing a
+ * single block. */
+static const int plan_nominal_us[JP2_STATS_CMDS] = {
+	[JP2_STATS_READ] = 5000,
+	[JP2_STATS_WRITE] = 10000,
+	[JP2_STATS_ERASE] = 50000,
+};
+
+/* neighbouring erase blocks touched by the writes */
+struct plan_run {
+	uint32_t address;
+	uint32_t len;
+	uint8_t *data;		/* content after the plan was executed */
+	uint8_t *known;		/* per byte, data is set */
+};
+
+struct jp2_plan {
+	struct jp2_remote *r;
+	uint32_t block_size;
+	int nruns;
+	struct plan_run *runs;
+	int nsteps;
+	int max_steps;
+	struct jp2_plan_step *steps;
+	struct jp2_plan_cost cost;
+};
+
+struct plan_blocks {
+	uint32_t first;
+	uint32_t last;
+};
+
+static int plan_blocks_cmp(const void *a, const void *b)
+{
+	const struct plan_blocks *x = a;
+	const struct plan_blocks *y = b;
+
+	return (x->first > y->first) - (x->first < y->first);
+}
+
+static int plan_add_step(struct jp2_plan *p, uint8_t cmd, uint32_t address,
+		uint32_t len)
+{
+	struct jp2_plan_step *steps;
+
+	if (p->nsteps == p->max_steps) {
+		p->max_steps = p->max_steps ? p->max_steps * 2 : 16;
+		steps = realloc(p->steps, p->max_steps * sizeof(*steps));
+		if (!steps) {
+			return -1;
+		}
+		p->steps = steps;
+	}
+
+	p->steps[p->nsteps].cmd = cmd;
+	p->steps[p->nsteps].address = address;
+	p->steps[p->nsteps].len = len;
+	p->nsteps++;
+
+	return 0;
+}
+
+/* the bytes which aren't written are read first */
+static int plan_reads(struct jp2_plan *p, struct plan_run *run)
+{
+	uint32_t i, j, k;
+
+	for (i = 0; i < run->len; i = j) {
+		if (run->known[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i; j < run->len; j = k) {
+			for (; j < run->len && !run->known[j]; j++);
+			for (k = j; k < run->len && run->known[k]; k++);
+			if (k == run->len || k - j >= PLAN_READ_MERGE) {
+				break;
+			}
+		}
+		if (plan_add_step(p, JP2_CMD_READ, run->address + i, j - i)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static bool plan_erased(struct plan_run *run, uint32_t i)
+{
+	return run->known[i] && run->data[i] == 0xff;
+}
+
+/* the writes are kept to an even address and length */
+static int plan_writes(struct jp2_plan *p, struct plan_run *run)
+{
+	uint32_t i, j, k;
+
+	for (i = 0; i < run->len; i = j) {
+		if (plan_erased(run, i)) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i; j < run->len; j = k) {
+			for (; j < run->len && !plan_erased(run, j); j++);
+			for (k = j; k < run->len && plan_erased(run, k); k++);
+			if (k == run->len || k - j >= PLAN_SKIP_MIN) {
+				break;
+			}
+		}
+		i &= ~1;
+		j = (j + 1 < run->len) ? (j + 1) & ~1 : run->len;
+		if (plan_add_step(p, JP2_CMD_WRITE, run->address + i, j - i)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static uint32_t plan_div(uint32_t a, uint32_t b)
+{
+	return (a + b - 1) / b;
+}
+
+static void plan_estimate(struct jp2_plan *p)
+{
+	int i;
+	int cls;
+	uint32_t n;
+	uint32_t tx, rx;
+	uint64_t us = 0;
+	uint64_t latency;
+	int aw = jp2_get_address_width(p->r);
+	int baudrate = jp2_get_baudrate(p->r);
+	struct jp2_stats stats;
+	struct jp2_plan_step *s;
+
+	if (aw == 0) {
+		aw = 4;
+	}
+	if (baudrate <= 0) {
+		baudrate = JP2_DEFAULT_BAUDRATE;
+	}
+	jp2_get_stats(p->r, &stats);
+	memset(&p->cost, 0, sizeof(p->cost));
+
+	for (i = 0; i < p->nsteps; i++) {
+		s = &p->steps[i];
+		switch (s->cmd) {
+		case JP2_CMD_READ:
+			n = plan_div(s->len, jp2_get_read_chunk_size(p->r));
+			tx = n * (4 + aw + 2);
+			rx = n * 4 + s->len;
+			break;
+		case JP2_CMD_WRITE:
+			n = plan_div(s->len, jp2_get_write_chunk_size(p->r));
+			tx = n * (4 + aw) + s->len;
+			rx = n * 4;
+			break;
+		default:
+			n = 1;
+			tx = 4 + 2 * aw;
+			rx = 4;
+			p->cost.erase_blocks += s->len / p->block_size;
+			break;
+		}
+		p->cost.commands += n;
+		p->cost.tx_bytes += tx;
+		p->cost.rx_bytes += rx;
+
+		/* the measured latency includes the transfer of the
+		 * response */
+		cls = stats_cmd_class(s->cmd);
+		if (stats.cmd[cls].count) {
+			latency = stats.cmd[cls].latency_sum /
+				stats.cmd[cls].count;
+		} else {
+			latency = plan_nominal_us[cls] +
+				(uint64_t)rx / n * 10000000 / baudrate;
+		}
+		us += n * latency + (uint64_t)tx * 10000000 / baudrate;
+	}
+
+	p->cost.time_ms = us / 1000;
+}
+
+struct jp2_plan *jp2_plan_writes(struct jp2_remote *r,
+		const struct jp2_write *writes, int count, uint32_t block_size)
+{
+	int i, j;
+	uint32_t start, end;
+	struct jp2_plan *p;
+	struct plan_blocks *blocks;
+	struct plan_run *run;
+
+	if (block_size < 2 || (block_size & 1) || count <= 0) {
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		if (writes[i].len == 0 ||
+				writes[i].address > UINT32_MAX - (writes[i].len - 1)) {
+			return NULL;
+		}
+	}
+
+	p = calloc(1, sizeof(*p));
+	blocks = malloc(count * sizeof(*blocks));
+	if (!p || !blocks) {
+		goto err;
+	}
+	p->r = r;
+	p->block_size = block_size;
+
+	for (i = 0; i < count; i++) {
+		blocks[i].first = writes[i].address / block_size;
+		blocks[i].last = (writes[i].address + writes[i].len - 1) /
+			block_size;
+	}
+	qsort(blocks, count, sizeof(*blocks), plan_blocks_cmp);
+
+	/* merge overlapping and neighbouring blocks */
+	for (i = 0, j = 0; i < count; i++) {
+		if (j && blocks[i].first <= blocks[j - 1].last + 1) {
+			if (blocks[i].last > blocks[j - 1].last) {
+				blocks[j - 1].last = blocks[i].last;
+			}
+		} else {
+			blocks[j++] = blocks[i];
+		}
+	}
+
+	p->runs = calloc(j, sizeof(*p->runs));
+	if (!p->runs) {
+		goto err;
+	}
+	p->nruns = j;
+	for (i = 0; i < p->nruns; i++) {
+		run = &p->runs[i];
+		run->address = blocks[i].first * block_size;
+		run->len = (blocks[i].last - blocks[i].first + 1) * block_size;
+		run->data = malloc(run->len);
+		run->known = calloc(run->len, 1);
+		if (!run->data || !run->known) {
+			goto err;
+		}
+	}
+
+	/* later writes win */
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < p->nruns; j++) {
+			run = &p->runs[j];
+			if (writes[i].address + writes[i].len - 1 <
+					run->address ||
+					writes[i].address >
+					run->address + run->len - 1) {
+				continue;
+			}
+			start = (writes[i].address > run->address) ?
+				writes[i].address : run->address;
+			end = writes[i].address + writes[i].len - 1;
+			if (end > run->address + run->len - 1) {
+				end = run->address + run->len - 1;
+			}
+			memcpy(run->data + (start - run->address),
+					writes[i].data + (start - writes[i].address),
+					end - start + 1);
+			memset(run->known + (start - run->address), 1,
+					end - start + 1);
+		}
+	}
+
+	for (i = 0; i < p->nruns; i++) {
+		run = &p->runs[i];
+		if (plan_reads(p, run) ||
+				plan_add_step(p, JP2_CMD_ERASE, run->address,
+					run->len) ||
+				plan_writes(p, run)) {
+			goto err;
+		}
+	}
+
+	plan_estimate(p);
+	free(blocks);
+	return p;
+
+err:
+	free(blocks);
+	if (p) {
+		jp2_plan_free(p);
+	}
+	return NULL;
+}
+
+int jp2_plan_steps(const struct jp2_plan *p, const struct jp2_plan_step **steps)
+{
+	*steps = p->steps;
+	return p->nsteps;
+}
+
+void jp2_plan_cost(const struct jp2_plan *p, struct jp2_plan_cost *cost)
+{
+	*cost = p->cost;
+}
+
+static struct plan_run *plan_find_run(struct jp2_plan *p, uint32_t address)
+{
+	int i;
+
+	for (i = 0; i < p->nruns; i++) {
+		if (address >= p->runs[i].address &&
+				address - p->runs[i].address < p->runs[i].len) {
+			return &p->runs[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* the content read is kept, so a failed plan can be executed again */
+static int plan_read(struct jp2_plan *p, struct plan_run *run,
+		struct jp2_plan_step *s)
+{
+	int rc;
+	uint32_t i;
+	uint32_t offset = s->address - run->address;
+	uint8_t *buf;
+
+	for (i = 0; i < s->len && run->known[offset + i]; i++);
+	if (i == s->len) {
+		return 0;
+	}
+
+	buf = malloc(s->len);
+	if (!buf) {
+		return -1;
+	}
+
+	rc = jp2_read_block(p->r, s->address, s->len, buf);
+	if (rc >= 0) {
+		for (i = 0; i < s->len; i++) {
+			if (!run->known[offset + i]) {
+				run->data[offset + i] = buf[i];
+			}
+		}
+		memset(run->known + offset, 1, s->len);
+	}
+
+	free(buf);
+	return rc;
+}
+
+int jp2_plan_execute(struct jp2_plan *p)
+{
+	int i;
+	int rc;
+	int erased = 0;
+	struct jp2_plan_step *s;
+	struct plan_run *run;
+
+	for (i = 0; i < p->nsteps; i++) {
+		s = &p->steps[i];
+		run = plan_find_run(p, s->address);
+
+		switch (s->cmd) {
+		case JP2_CMD_READ:
+			rc = plan_read(p, run, s);
+			break;
+		case JP2_CMD_ERASE:
+			rc = jp2_erase_block(p->r, s->address,
+					s->address + s->len - 1);
+			erased += s->len / p->block_size;
+			break;
+		default:
+			rc = jp2_write_block(p->r, s->address, s->len,
+					run->data + (s->address - run->address));
+			break;
+		}
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	return erased;
+}
+
+void jp2_plan_free(struct jp2_plan *p)
+{
+	int i;
+
+	for (i = 0; i < p->nruns; i++) {
+		free(p->runs[i].data);
+		free(p->runs[i].known);
+	}
+	free(p->runs);
+	free(p->steps);
+	free(p);
+}
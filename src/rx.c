@@ -0,0 +1,153 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "jp2library.h"
+#include "rx.h"
+
+enum {
+	RX_LEN_HI,
+	RX_LEN_LO,
+	RX_STATUS,
+	RX_PAYLOAD,
+	RX_CSUM,
+	RX_DONE,
+};
+
+/* drop everything buffered */
+void rx_reset(struct jp2_rx *rx)
+{
+	rx->tail = rx->head;
+	rx->state = RX_DONE;
+}
+
+/*
+ * Start parsing the next frame. The payload is stored in dst if it fits,
+ * otherwise in buf. Frames larger than buf are considered garbage.
+ */
+void rx_begin(struct jp2_rx *rx, uint8_t *dst, int dstlen, uint8_t *buf,
+		int buflen)
+{
+	rx->state = RX_LEN_HI;
+	rx->len = 0;
+	rx->received = 0;
+	rx->csum = 0;
+	rx->dst = dst;
+	rx->dstlen = dstlen;
+	rx->buf = buf;
+	rx->buflen = buflen;
+}
+
+static uint8_t rx_byte(struct jp2_rx *rx)
+{
+	uint8_t b = rx->ring[rx->tail++ & (RX_RING_SIZE - 1)];
+
+	rx->csum ^= b;
+	rx->received++;
+	return b;
+}
+
+/*
+ * Consume the buffered bytes. Returns 1 once the frame is complete, 0 if
+ * more data is needed and -JP2_ERR_FRAMING if the length field makes no
+ * sense. The payload is in rx->dst afterwards and rx->csum is zero for an
+ * intact frame.
+ */
+int rx_parse(struct jp2_rx *rx)
+{
+	int payload;
+	int n;
+	int i;
+	uint8_t *src;
+
+	while (rx->tail != rx->head) {
+		switch (rx->state) {
+		case RX_LEN_HI:
+			rx->hdr[0] = rx_byte(rx);
+			rx->state = RX_LEN_LO;
+			break;
+		case RX_LEN_LO:
+			rx->hdr[1] = rx_byte(rx);
+			rx->len = (rx->hdr[0] << 8) | rx->hdr[1];
+			/* we expect at least an error code and a checksum
+			 * byte */
+			if (rx->len < 2 || rx->len - 2 > rx->buflen) {
+				return -JP2_ERR_FRAMING;
+			}
+			rx->state = RX_STATUS;
+			break;
+		case RX_STATUS:
+			rx->hdr[2] = rx_byte(rx);
+			payload = rx_payload_len(rx);
+			if (!rx->dst || payload > rx->dstlen) {
+				rx->dst = rx->buf;
+			}
+			rx->state = (payload) ? RX_PAYLOAD : RX_CSUM;
+			break;
+		case RX_PAYLOAD:
+			/* copy the contiguous part of the ring at once */
+			payload = rx_payload_len(rx);
+			n = payload - (rx->received - 3);
+			if (n > rx->head - rx->tail) {
+				n = rx->head - rx->tail;
+			}
+			if (n > RX_RING_SIZE - (rx->tail & (RX_RING_SIZE - 1))) {
+				n = RX_RING_SIZE - (rx->tail & (RX_RING_SIZE - 1));
+			}
+			src = &rx->ring[rx->tail & (RX_RING_SIZE - 1)];
+			memcpy(rx->dst + rx->received - 3, src, n);
+			for (i = 0; i < n; i++) {
+				rx->csum ^= src[i];
+			}
+			rx->tail += n;
+			rx->received += n;
+			if (rx->received - 3 == payload) {
+				rx->state = RX_CSUM;
+			}
+			break;
+		case RX_CSUM:
+			rx_byte(rx);
+			rx->state = RX_DONE;
+			return 1;
+		default:
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* contiguous free space at the head of the ring */
+uint8_t *rx_space(struct jp2_rx *rx, size_t *len)
+{
+	unsigned int offset = rx->head & (RX_RING_SIZE - 1);
+
+	*len = RX_RING_SIZE - (rx->head - rx->tail);
+	if (*len > RX_RING_SIZE - offset) {
+		*len = RX_RING_SIZE - offset;
+	}
+	return &rx->ring[offset];
+}
+
+/* len bytes were stored at rx_space() */
+void rx_commit(struct jp2_rx *rx, size_t len)
+{
+	rx->head += len;
+}
@@ -0,0 +1,71 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RX_H
+#define __RX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* must be a power of two */
+#define RX_RING_SIZE 4096
+
+/*
+ * Receive path. Whatever the serial port has available is read into a ring
+ * buffer in one go, response frames are then parsed out of it by a state
+ * machine which can stop and resume at any byte. A read may contain parts
+ * of several frames.
+ */
+struct jp2_rx {
+	uint8_t ring[RX_RING_SIZE];
+	unsigned int head;	/* free running */
+	unsigned int tail;
+
+	/* frame being parsed */
+	int state;
+	uint8_t hdr[3];		/* length and error code */
+	int len;		/* length field */
+	int received;		/* bytes of this frame so far */
+	uint8_t csum;
+	uint8_t *dst;		/* where the payload goes */
+	int dstlen;
+	uint8_t *buf;		/* ... if it doesn't fit into dst */
+	int buflen;
+};
+
+void rx_reset(struct jp2_rx *rx);
+void rx_begin(struct jp2_rx *rx, uint8_t *dst, int dstlen, uint8_t *buf,
+		int buflen);
+int rx_parse(struct jp2_rx *rx);
+uint8_t *rx_space(struct jp2_rx *rx, size_t *len);
+void rx_commit(struct jp2_rx *rx, size_t len);
+
+/* bytes missing to complete the frame, a guess as long as the length is
+ * unknown */
+static inline int rx_missing(struct jp2_rx *rx)
+{
+	return (rx->len ? rx->len + 2 : 3) - rx->received;
+}
+
+static inline int rx_payload_len(struct jp2_rx *rx)
+{
+	return rx->len - 2;
+}
+
+#endif /* __RX_H */
@@ -0,0 +1,215 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define inc(v, n) atomic_fetch_add_explicit(&(v), n, memory_order_relaxed)
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* JP2_STATS_* of a command */
+int stats_cmd_class(uint8_t cmd)
+{
+	switch (cmd) {
+	case JP2_CMD_READ: return JP2_STATS_READ;
+	case JP2_CMD_WRITE: return JP2_STATS_WRITE;
+	case JP2_CMD_ERASE: return JP2_STATS_ERASE;
+	case JP2_CMD_CHECKSUM: return JP2_STATS_CHECKSUM;
+	case JP2_CMD_INFO: return JP2_STATS_INFO;
+	case JP2_CMD_ENTER_LOADER: return JP2_STATS_LOADER;
+	case JP2_CMD_EXIT_LOADER: return JP2_STATS_LOADER;
+	default: return JP2_STATS_OTHER;
+	}
+}
+
+static int stats_bucket(uint64_t us)
+{
+	int i = 0;
+
+	while (us && i < JP2_STATS_BUCKETS - 1) {
+		us >>= 1;
+		i++;
+	}
+	return i;
+}
+
+void stats_sent(struct jp2_stats_state *s, uint8_t cmd, int len)
+{
+	struct stats_cmd *c = &s->cmd[stats_cmd_class(cmd)];
+
+	inc(c->count, 1);
+	inc(c->tx_bytes, len);
+
+	/* a response was lost without a flush, forget the oldest request */
+	if (s->head - s->tail >= STATS_INFLIGHT) {
+		s->tail++;
+	}
+	s->inflight[s->head & (STATS_INFLIGHT - 1)].cmd = cmd;
+	s->inflight[s->head & (STATS_INFLIGHT - 1)].sent = now_us();
+	s->head++;
+}
+
+/* the response to the oldest request in flight arrived, rc < 0 on errors */
+void stats_received(struct jp2_stats_state *s, int len, int rc)
+{
+	struct stats_cmd *c;
+	uint64_t latency;
+
+	if (s->head == s->tail) {
+		c = &s->cmd[JP2_STATS_OTHER];
+		inc(c->rx_bytes, len);
+		return;
+	}
+
+	c = &s->cmd[stats_cmd_class(s->inflight[s->tail & (STATS_INFLIGHT - 1)].cmd)];
+	latency = now_us() - s->inflight[s->tail & (STATS_INFLIGHT - 1)].sent;
+	s->tail++;
+
+	inc(c->rx_bytes, len);
+	if (rc == -JP2_ERR_WRONG_CHECKSUM) {
+		inc(c->checksum_errors, 1);
+	} else if (rc < 0) {
+		inc(c->errors, 1);
+	}
+	if (rc == -JP2_ERR_TIMEOUT) {
+		inc(c->timeouts, 1);
+	}
+
+	inc(c->latency[stats_bucket(latency)], 1);
+	inc(c->latency_sum, latency);
+	if (latency > atomic_load_explicit(&c->latency_max,
+				memory_order_relaxed)) {
+		atomic_store_explicit(&c->latency_max, latency,
+				memory_order_relaxed);
+	}
+}
+
+void stats_retry(struct jp2_stats_state *s, uint8_t cmd)
+{
+	inc(s->cmd[stats_cmd_class(cmd)].retries, 1);
+}
+
+/* the input was discarded, no responses are expected anymore */
+void stats_flush(struct jp2_stats_state *s)
+{
+	s->tail = s->head;
+}
+
+#define load(v) atomic_load_explicit(&(v), memory_order_relaxed)
+
+void stats_get(struct jp2_stats_state *s, struct jp2_stats *stats)
+{
+	struct stats_cmd *c;
+	struct jp2_cmd_stats *d;
+	int i;
+	int j;
+
+	for (i = 0; i < JP2_STATS_CMDS; i++) {
+		c = &s->cmd[i];
+		d = &stats->cmd[i];
+		d->count = load(c->count);
+		d->tx_bytes = load(c->tx_bytes);
+		d->rx_bytes = load(c->rx_bytes);
+		d->checksum_errors = load(c->checksum_errors);
+		d->errors = load(c->errors);
+		d->timeouts = load(c->timeouts);
+		d->retries = load(c->retries);
+		d->latency_sum = load(c->latency_sum);
+		d->latency_max = load(c->latency_max);
+		for (j = 0; j < JP2_STATS_BUCKETS; j++) {
+			d->latency[j] = load(c->latency[j]);
+		}
+	}
+}
+
+void stats_reset(struct jp2_stats_state *s)
+{
+	struct stats_cmd *c;
+	int i;
+	int j;
+
+	for (i = 0; i < JP2_STATS_CMDS; i++) {
+		c = &s->cmd[i];
+		atomic_store(&c->count, 0);
+		atomic_store(&c->tx_bytes, 0);
+		atomic_store(&c->rx_bytes, 0);
+		atomic_store(&c->checksum_errors, 0);
+		atomic_store(&c->errors, 0);
+		atomic_store(&c->timeouts, 0);
+		atomic_store(&c->retries, 0);
+		atomic_store(&c->latency_sum, 0);
+		atomic_store(&c->latency_max, 0);
+		for (j = 0; j < JP2_STATS_BUCKETS; j++) {
+			atomic_store(&c->latency[j], 0);
+		}
+	}
+}
+
+static const char *stats_names[] = {
+	[JP2_STATS_READ] = "read",
+	[JP2_STATS_WRITE] = "write",
+	[JP2_STATS_ERASE] = "erase",
+	[JP2_STATS_CHECKSUM] = "checksum",
+	[JP2_STATS_INFO] = "info",
+	[JP2_STATS_LOADER] = "loader",
+	[JP2_STATS_OTHER] = "other",
+};
+
+const char *jp2_stats_name(int cmd)
+{
+	if (cmd < 0 || cmd >= JP2_STATS_CMDS) {
+		return "?";
+	}
+	return stats_names[cmd];
+}
+
+uint64_t jp2_stats_percentile(const struct jp2_cmd_stats *s, int percent)
+{
+	uint64_t total = 0;
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < JP2_STATS_BUCKETS; i++) {
+		total += s->latency[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < JP2_STATS_BUCKETS; i++) {
+		seen += s->latency[i];
+		if (seen * 100 >= total * percent) {
+			break;
+		}
+	}
+	if (i == JP2_STATS_BUCKETS) {
+		i--;
+	}
+
+	return 1ULL << i;
+}
@@ -0,0 +1,67 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "jp2library.h"
+
+/* must be a power of two and larger than the maximum read window */
+#define STATS_INFLIGHT 32
+
+struct stats_cmd {
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t tx_bytes;
+	atomic_uint_fast64_t rx_bytes;
+	atomic_uint_fast64_t checksum_errors;
+	atomic_uint_fast64_t errors;
+	atomic_uint_fast64_t timeouts;
+	atomic_uint_fast64_t retries;
+	atomic_uint_fast64_t latency_sum;
+	atomic_uint_fast64_t latency_max;
+	atomic_uint_fast64_t latency[JP2_STATS_BUCKETS];
+};
+
+/*
+ * Per-remote counters. They are only written by the thread using the
+ * remote, any thread may take a snapshot. The send times of the requests in
+ * flight are kept in a FIFO, as the remote answers in order.
+ */
+struct jp2_stats_state {
+	struct stats_cmd cmd[JP2_STATS_CMDS];
+	struct {
+		uint8_t cmd;
+		uint64_t sent;
+	} inflight[STATS_INFLIGHT];
+	unsigned int head;
+	unsigned int tail;
+};
+
+int stats_cmd_class(uint8_t cmd);
+void stats_sent(struct jp2_stats_state *s, uint8_t cmd, int len);
+void stats_received(struct jp2_stats_state *s, int len, int rc);
+void stats_retry(struct jp2_stats_state *s, uint8_t cmd);
+void stats_flush(struct jp2_stats_state *s);
+void stats_get(struct jp2_stats_state *s, struct jp2_stats *stats);
+void stats_reset(struct jp2_stats_state *s);
+
+#endif /* __STATS_H */
@@ -0,0 +1,45 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Setting arbitrary line speeds needs the termios2 interface of the linux
+ * kernel. Its header clashes with the one from the C library, therefore
+ * this lives in its own compilation unit.
+ */
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+int termios2_set_baudrate(int fd, int baudrate)
+{
+	int rc;
+	struct termios2 tio;
+
+	rc = ioctl(fd, TCGETS2, &tio);
+	if (rc < 0) {
+		return rc;
+	}
+
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_ispeed = baudrate;
+	tio.c_ospeed = baudrate;
+
+	return ioctl(fd, TCSETS2, &tio);
+}
@@ -0,0 +1,145 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#ifdef JP2_TRACE
+void trace_event(struct jp2_trace *t, int type, int rc, uint32_t a,
+		uint32_t b, const uint8_t *data, int len)
+{
+	unsigned int head;
+	unsigned int tail;
+	struct jp2_trace_event *ev;
+	struct timespec ts;
+
+	head = atomic_load_explicit(&t->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+
+	if (head - tail >= TRACE_RING_SIZE) {
+		atomic_fetch_add_explicit(&t->dropped, 1, memory_order_relaxed);
+	} else {
+		ev = &t->ring[head & (TRACE_RING_SIZE - 1)];
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ev->timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		ev->type = type;
+		ev->rc = rc;
+		ev->a = a;
+		ev->b = b;
+		if (len > JP2_TRACE_DATA_LEN) {
+			len = JP2_TRACE_DATA_LEN;
+		}
+		ev->datalen = len;
+		if (len) {
+			memcpy(ev->data, data, len);
+		}
+
+		atomic_store_explicit(&t->head, head + 1, memory_order_release);
+	}
+
+	if (t->sink) {
+		trace_drain(t, t->sink, t->sink_priv);
+	}
+}
+
+int trace_drain(struct jp2_trace *t, jp2_trace_sink sink, void *priv)
+{
+	unsigned int head;
+	unsigned int tail;
+	int count = 0;
+
+	tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&t->head, memory_order_acquire);
+
+	while (tail != head) {
+		sink(priv, &t->ring[tail & (TRACE_RING_SIZE - 1)]);
+		tail++;
+		count++;
+		atomic_store_explicit(&t->tail, tail, memory_order_release);
+	}
+
+	return count;
+}
+#endif
+
+static const char *trace_names[] = {
+	[JP2_TRACE_RESET] = "reset",
+	[JP2_TRACE_TX] = "tx",
+	[JP2_TRACE_RX] = "rx",
+	[JP2_TRACE_IO_ERROR] = "io error",
+	[JP2_TRACE_BAD_CHECKSUM] = "bad checksum",
+	[JP2_TRACE_REQUEST_FAILED] = "request failed",
+	[JP2_TRACE_CHUNK_SIZE] = "chunk size",
+	[JP2_TRACE_SHORT_READ] = "short read",
+	[JP2_TRACE_BAUDRATE] = "baudrate",
+	[JP2_TRACE_POLL] = "poll",
+	[JP2_TRACE_INFO] = "info",
+	[JP2_TRACE_UNKNOWN_RESPONSE] = "unknown response",
+	[JP2_TRACE_INFO_AREA] = "info area",
+	[JP2_TRACE_PROGRAM_AREA] = "program area",
+	[JP2_TRACE_PROTOCOL_AREA] = "protocol area",
+	[JP2_TRACE_UPDATE_AREA] = "update area",
+	[JP2_TRACE_DELTA] = "delta",
+	[JP2_TRACE_VERIFY] = "verify",
+	[JP2_TRACE_FRAMING] = "framing",
+	[JP2_TRACE_RETRY] = "retry",
+	[JP2_TRACE_RESYNC] = "resync",
+	[JP2_TRACE_TIMEOUT] = "timeout",
+	[JP2_TRACE_ERASE_BLOCK] = "erase block",
+};
+
+int jp2_trace_format(const struct jp2_trace_event *ev, char *buf, size_t size)
+{
+	int i;
+	int n;
+	const char *name = "?";
+
+	if (ev->type < sizeof(trace_names) / sizeof(trace_names[0])
+			&& trace_names[ev->type]) {
+		name = trace_names[ev->type];
+	}
+
+	n = snprintf(buf, size, "%llu.%06llu %s: rc=%d a=%x b=%x",
+			(unsigned long long)ev->timestamp / 1000000000ULL,
+			(unsigned long long)(ev->timestamp / 1000) % 1000000ULL,
+			name, ev->rc, ev->a, ev->b);
+
+	for (i = 0; i < ev->datalen && n < size; i++) {
+		n += snprintf(buf + n, size - n, "%s%02x", (i) ? " " : " [",
+				ev->data[i]);
+	}
+	if (ev->datalen && n < size) {
+		n += snprintf(buf + n, size - n, "%s]",
+				(ev->a > ev->datalen) ? " .." : "");
+	}
+
+	return n;
+}
+
+void jp2_trace_stderr(void *priv, const struct jp2_trace_event *ev)
+{
+	char buf[128];
+
+	jp2_trace_format(ev, buf, sizeof(buf));
+	fprintf(stderr, "%s\n", buf);
+}
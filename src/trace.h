@@ -0,0 +1,63 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "jp2library.h"
+
+/* must be a power of two */
+#define TRACE_RING_SIZE 256
+
+/*
+ * Per-remote trace buffer. The thread using the remote is the only producer,
+ * events are consumed either by the producer itself if a sink is attached or
+ * by a single other thread calling trace_drain(). If the ring is full, new
+ * events are dropped and counted.
+ */
+struct jp2_trace {
+	struct jp2_trace_event ring[TRACE_RING_SIZE];
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_uint dropped;
+	jp2_trace_sink sink;
+	void *sink_priv;
+};
+
+#ifdef JP2_TRACE
+void trace_event(struct jp2_trace *t, int type, int rc, uint32_t a,
+		uint32_t b, const uint8_t *data, int len);
+int trace_drain(struct jp2_trace *t, jp2_trace_sink sink, void *priv);
+#else
+static inline void trace_event(struct jp2_trace *t, int type, int rc,
+		uint32_t a, uint32_t b, const uint8_t *data, int len)
+{
+}
+
+static inline int trace_drain(struct jp2_trace *t, jp2_trace_sink sink,
+		void *priv)
+{
+	return 0;
+}
+#endif
+
+#endif /* __TRACE_H */
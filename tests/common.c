@@ -29,6 +29,9 @@
 
 #include "osapi.h"
 
+/* room for a transfer of more than 64 KiB */
+#define UT_BUFSIZE 0x20000
+
 static int dummy_handle;
 static uint8_t *_ut_rxbuf;
 static uint8_t *_ut_rxptr_p;
@@ -36,8 +39,22 @@ static uint8_t *_ut_rxptr_c;
 static uint8_t *_ut_txbuf;
 static uint8_t *_ut_txptr_p;
 static uint8_t *_ut_txptr_c;
+static struct {
+	uint8_t *pos;
+	int writes;
+} _ut_rx_barrier[16];
+static int _ut_rx_barriers;
+static int _ut_writes;
+static size_t _ut_read_size;
+static bool _ut_poll_reply;
+static int _ut_baudrate;
+static int _ut_min_baudrate;
+static int _ut_max_baudrate;
+static int _ut_read_calls;
+static int _ut_allocations;
 
-static void *_open_remote(const char *devname, int flags)
+static void *_open_remote(struct osapi_ops *ops, const char *devname,
+		int flags)
 {
 	return &dummy_handle;
 }
@@ -59,17 +76,69 @@ static int _flush_remote(void *handle)
 	return 0;
 }
 
-static ssize_t _read_remote(void *handle, void *buf, size_t count)
+static void _ut_consume(void *buf, size_t count)
+{
+	memcpy(buf, _ut_rxptr_c, count);
+	_ut_rxptr_c += count;
+}
+
+/* number of bytes which have arrived, see test_rx_barrier() */
+static size_t _ut_available(void)
+{
+	int i;
+	uint8_t *end = _ut_rxptr_p;
+
+	for (i = 0; i < _ut_rx_barriers; i++) {
+		if (_ut_writes < _ut_rx_barrier[i].writes
+				&& _ut_rx_barrier[i].pos < end) {
+			end = _ut_rx_barrier[i].pos;
+		}
+	}
+
+	return (end > _ut_rxptr_c) ? end - _ut_rxptr_c : 0;
+}
+
+/* The remote answers the polling in jp2_enter_loader() right away. Apart
+ * from that, the preloaded data is returned, but only if the line speed is
+ * one the remote understands. */
+static ssize_t _read_some_remote(void *handle, void *buf, size_t count,
+		int timeout_ms)
 {
+	size_t available = _ut_available();
+
 	assert(handle == &dummy_handle);
 	assert(_ut_txptr_p);
 
-	memcpy(buf, _ut_rxptr_c, count);
-	_ut_rxptr_c += count;
+	_ut_read_calls++;
+	if (_ut_poll_reply) {
+		_ut_poll_reply = false;
+		memset(buf, 0, 1);
+		return 1;
+	}
+	if (_ut_baudrate < _ut_min_baudrate || _ut_baudrate > _ut_max_baudrate) {
+		return OSAPI_ERR_TIMEOUT;
+	}
+	if (available == 0) {
+		return OSAPI_ERR_TIMEOUT;
+	}
+	if (count > available) {
+		count = available;
+	}
+	if (_ut_read_size && count > _ut_read_size) {
+		count = _ut_read_size;
+	}
+	_ut_consume(buf, count);
 
 	return count;
 }
 
+static int _set_baudrate_remote(void *handle, int baudrate)
+{
+	assert(handle == &dummy_handle);
+	_ut_baudrate = baudrate;
+	return 0;
+}
+
 static ssize_t _write_remote(void *handle, void *buf, size_t count)
 {
 	assert(handle == &dummy_handle);
@@ -77,17 +146,58 @@ static ssize_t _write_remote(void *handle, void *buf, size_t count)
 
 	memcpy(_ut_txptr_p, buf, count);
 	_ut_txptr_p += count;
+	_ut_writes++;
+
+	if (count == 1 && *(uint8_t*)buf == 0) {
+		_ut_poll_reply = true;
+	}
+
+	return count;
+}
+
+static ssize_t _writev_remote(void *handle, const struct iovec *iov,
+		int iovcnt)
+{
+	ssize_t count = 0;
+
+	assert(handle == &dummy_handle);
+
+	while (iovcnt--) {
+		memcpy(_ut_txptr_p, iov->iov_base, iov->iov_len);
+		_ut_txptr_p += iov->iov_len;
+		count += iov->iov_len;
+		iov++;
+	}
+	_ut_writes++;
 
 	return count;
 }
 
+/* count the heap allocations, the tests are linked with --wrap=malloc */
+void *__real_malloc(size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	_ut_allocations++;
+	return __real_malloc(size);
+}
+
+int test_allocations(void)
+{
+	int allocations = _ut_allocations;
+	_ut_allocations = 0;
+	return allocations;
+}
+
 struct osapi_ops test_ops = {
 	.open = _open_remote,
 	.close = _close_remote,
 	.reset = _reset_remote,
 	.flush = _flush_remote,
-	.read = _read_remote,
+	.set_baudrate = _set_baudrate_remote,
+	.read_some = _read_some_remote,
 	.write = _write_remote,
+	.writev = _writev_remote,
 };
 
 void test_clear_buffers()
@@ -96,15 +206,57 @@ void test_clear_buffers()
 	_ut_rxptr_c = _ut_rxbuf;
 	_ut_txptr_p = _ut_txbuf;
 	_ut_txptr_c = _ut_txbuf;
+	_ut_poll_reply = false;
+	_ut_rx_barriers = 0;
+	_ut_writes = 0;
+}
+
+/* The data preloaded after this call is available to non-blocking reads
+ * only after the library sent the given number of frames. */
+void test_rx_barrier(int writes)
+{
+	assert(_ut_rx_barriers < 16);
+	_ut_rx_barrier[_ut_rx_barriers].pos = _ut_rxptr_p;
+	_ut_rx_barrier[_ut_rx_barriers].writes = writes;
+	_ut_rx_barriers++;
+}
+
+/* line speeds at which the remote answers */
+void test_set_baudrates(int min, int max)
+{
+	_ut_min_baudrate = min;
+	_ut_max_baudrate = max;
+}
+
+/* the remote sends at most size bytes at once, 0 for no limit */
+void test_set_read_size(size_t size)
+{
+	_ut_read_size = size;
+}
+
+/* number of blocking read calls since the last call */
+int test_read_calls(void)
+{
+	int calls = _ut_read_calls;
+	_ut_read_calls = 0;
+	return calls;
+}
+
+int test_get_baudrate(void)
+{
+	return _ut_baudrate;
 }
 
 void test_init()
 {
 	osapi = &test_ops;
 
-	_ut_rxbuf = malloc(2048);
-	_ut_txbuf = malloc(2048);
+	_ut_rxbuf = malloc(UT_BUFSIZE);
+	_ut_txbuf = malloc(UT_BUFSIZE);
 	test_clear_buffers();
+	test_set_baudrates(38400, 38400);
+	/* the port is opened at the default line speed */
+	_ut_baudrate = 38400;
 }
 
 uint8_t *test_rx(int len)
@@ -120,6 +272,37 @@ void test_tx(uint8_t *data, int len)
 	_ut_rxptr_p += len;
 }
 
+/* preload a complete response frame with the given payload */
+void test_tx_frame(uint8_t err, const uint8_t *data, int len)
+{
+	uint8_t csum;
+	int i;
+
+	*_ut_rxptr_p++ = ((len + 2) >> 8) & 0xff;
+	*_ut_rxptr_p++ = (len + 2) & 0xff;
+	*_ut_rxptr_p++ = err;
+	memcpy(_ut_rxptr_p, data, len);
+	_ut_rxptr_p += len;
+
+	csum = 0;
+	for (i = len + 3; i > 0; i--) {
+		csum ^= *(_ut_rxptr_p - i);
+	}
+	*_ut_rxptr_p++ = csum;
+}
+
+/* number of preloaded bytes not yet consumed by the library */
+int test_rx_pending(void)
+{
+	return _ut_rxptr_p - _ut_rxptr_c;
+}
+
+/* number of bytes sent by the library not yet checked by test_rx() */
+int test_tx_pending(void)
+{
+	return _ut_txptr_p - _ut_txptr_c;
+}
+
 void test_tx_s(const char *data, int len)
 {
 	test_tx((uint8_t*)data, len);
@@ -38,21 +38,33 @@
 			fprintf(stderr, "ok\n");                 \
 		} else {                                     \
 			fprintf(stderr, "failed\n");             \
+			t_tests_failed++;                        \
 		}                                            \
 		t_tests_run++;                                 \
 	} while (0)
 
 #define T_DEFS           \
 	jmp_buf t_env;       \
-	int t_tests_run = 0;
+	int t_tests_run = 0; \
+	int t_tests_failed = 0;
 
 extern jmp_buf t_env;
 extern int t_tests_run;
+extern int t_tests_failed;
 
 void test_init(void);
 void test_clear_buffers();
 void test_tx(uint8_t *data, int len);
 void test_tx_s(const char *data, int len);
+void test_tx_frame(uint8_t err, const uint8_t *data, int len);
 uint8_t *test_rx(int len);
+int test_rx_pending(void);
+void test_rx_barrier(int writes);
+int test_tx_pending(void);
+void test_set_baudrates(int min, int max);
+int test_get_baudrate(void);
+int test_read_calls(void);
+void test_set_read_size(size_t size);
+int test_allocations(void);
 
 #endif /* __TEST_H */
@@ -21,8 +21,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
 #include "jp2library.h"
+#include "osapi.h"
 #include "test.h"
 
 T_DEFS;
@@ -126,6 +129,8 @@ void test_connect_16bit(void)
 
 	rc = jp2_enter_loader(r, false);
 	t_assert(rc == -JP2_ERR_NO_ERR);
+	rx = test_rx(1);
+	t_assert(rx[0] == 0x00);
 	rx = test_rx(4);
 	t_assert(!memcmp(rx, "\x00\x02\x51\x53", 4));
 
@@ -178,6 +183,8 @@ void test_connect_32bit(void)
 
 	rc = jp2_enter_loader(r, false);
 	t_assert(rc == -JP2_ERR_NO_ERR);
+	rx = test_rx(1);
+	t_assert(rx[0] == 0x00);
 	rx = test_rx(4);
 	t_assert(!memcmp(rx, "\x00\x02\x51\x53", 4));
 
@@ -203,6 +210,1518 @@ void test_connect_32bit(void)
 	t_assert(!memcmp(rx, "\x00\x02\x52\x50", 4));
 }
 
+void test_connect_pipelined(void)
+{
+	int rc;
+	struct jp2_info info;
+	uint8_t *rx;
+
+	test_clear_buffers();
+
+	/* nothing is answered until both commands are sent */
+	test_rx_barrier(3);
+	test_tx_s("\x00\x02\x00\x02", 4);
+	test_tx_s("\x00\x06\x00\x03\x15\xc4\x4e\x9a", 8);
+	test_tx_s("\x00\x28\x00\x33\x32\x32\x34\x30\x33\x42", 10);
+	test_tx_s("\x56\x20\x4f\x46\x41\x20\x49\x6e\x66\x20", 10);
+	test_tx_s("\x20\x20\x20\x20\x20\x20\x20\x20\x20\x05", 10);
+	test_tx_s("\x00\x4b\x7f\x4b\x80\xdf\xff\xe0\x00\xef", 10);
+	test_tx_s("\xff\x1b", 2);
+
+	rc = jp2_connect(r, false, &info);
+	t_assert(rc == 0);
+	rx = test_rx(1);
+	t_assert(rx[0] == 0x00);
+	rx = test_rx(4);
+	t_assert(!memcmp(rx, "\x00\x02\x51\x53", 4));
+	rx = test_rx(4);
+	t_assert(!memcmp(rx, "\x00\x02\x50\x52", 4));
+	rx = test_rx(8);
+	t_assert(!memcmp(rx, "\x00\x06\x01\xc4\x4e\x00\x26\xab", 8));
+	t_assert(test_tx_pending() == 0);
+	t_assert(test_rx_pending() == 0);
+
+	t_assert(info.id == 0x0315);
+	t_assert(!strcmp(info.signature, "322403BV OFA Inf          "));
+	t_assert(info.update_area_end == 0xefff);
+}
+
+/* responses to ENTER_LOADER, INFO and READ of the info area. If the read
+ * is pipelined, nothing is answered before it is sent. */
+static void preload_info(const char *signature, uint16_t program_area_begin,
+		bool pipelined)
+{
+	uint8_t area[JP2_SIGNATURE_LEN + 12];
+
+	if (pipelined) {
+		test_rx_barrier(4);
+	}
+	test_tx_frame(0, NULL, 0);
+	test_tx_frame(0, (uint8_t*)"\x03\x15\x10\x00", 4);
+	memset(area, 0, sizeof(area));
+	memcpy(area, signature, strlen(signature));
+	area[JP2_SIGNATURE_LEN] = program_area_begin >> 8;
+	area[JP2_SIGNATURE_LEN + 1] = program_area_begin & 0xff;
+	test_tx_frame(0, area, sizeof(area));
+}
+
+void test_info_cache(void)
+{
+	int rc;
+	struct jp2_info info;
+	struct stat st;
+	uint8_t *rx;
+	char filename[] = "/tmp/jp2infoXXXXXX";
+
+	rc = mkstemp(filename);
+	t_assert(rc >= 0);
+	close(rc);
+	chmod(filename, 0640);
+	jp2_set_info_cache(r, filename);
+
+	/* not cached yet, the area is read after the INFO response */
+	test_clear_buffers();
+	preload_info("CACHED", 0x42, false);
+	rc = jp2_connect(r, false, &info);
+	t_assert(rc == 0);
+	t_assert(!strcmp(info.signature, "CACHED"));
+	t_assert(info.program_area_begin == 0x42);
+	test_rx(1 + 4 + 4);
+	rx = test_rx(8);
+	t_assert(!memcmp(rx, "\x00\x06\x01\x10\x00\x00\x26\x31", 8));
+
+	/* cached, the area is read right behind INFO */
+	test_clear_buffers();
+	preload_info("CACHED", 0x42, true);
+	memset(&info, 0, sizeof(info));
+	rc = jp2_connect(r, false, &info);
+	t_assert(rc == 0);
+	t_assert(!strcmp(info.signature, "CACHED"));
+	t_assert(info.program_area_begin == 0x42);
+	test_rx(1 + 4 + 4);
+	rx = test_rx(8);
+	t_assert(!memcmp(rx, "\x00\x06\x01\x10\x00\x00\x26\x31", 8));
+	t_assert(test_tx_pending() == 0);
+	t_assert(test_rx_pending() == 0);
+
+	/* the area changed, the read is taken and cached */
+	test_clear_buffers();
+	preload_info("CACHED", 0x43, true);
+	rc = jp2_connect(r, false, &info);
+	t_assert(rc == 0);
+	t_assert(info.program_area_begin == 0x43);
+	t_assert(test_rx_pending() == 0);
+
+	/* another remote of the same type on the port */
+	test_clear_buffers();
+	preload_info("OTHER", 0x44, true);
+	rc = jp2_connect(r, false, &info);
+	t_assert(rc == 0);
+	t_assert(!strcmp(info.signature, "OTHER"));
+	t_assert(info.program_area_begin == 0x44);
+	t_assert(test_rx_pending() == 0);
+
+	test_clear_buffers();
+	preload_info("OTHER", 0x44, true);
+	rc = jp2_connect(r, false, &info);
+	t_assert(rc == 0);
+	t_assert(info.program_area_begin == 0x44);
+
+	/* the rewrites kept the permissions */
+	t_assert(stat(filename, &st) == 0);
+	t_assert((st.st_mode & 0777) == 0640);
+
+	/* forgotten, not cached anymore */
+	rc = jp2_forget_info(filename, "/dev/null");
+	t_assert(rc == 0);
+	test_clear_buffers();
+	preload_info("CACHED", 0x42, false);
+	rc = jp2_connect(r, false, &info);
+	t_assert(rc == 0);
+	test_rx(1 + 4 + 4);
+	rx = test_rx(8);
+	t_assert(!memcmp(rx, "\x00\x06\x01\x10\x00\x00\x26\x31", 8));
+
+	jp2_set_info_cache(r, NULL);
+	unlink(filename);
+}
+
+static void preload_read_responses(uint8_t *data, int len)
+{
+	while (len > 0) {
+		int n = (len > 128) ? 128 : len;
+		test_tx_frame(JP2_ERR_NO_ERR, data, n);
+		data += n;
+		len -= n;
+	}
+}
+
+void test_read_block_pipelined(void)
+{
+	int rc;
+	int i;
+	uint8_t *rx;
+	uint8_t expected[300];
+	uint8_t data[300];
+
+	test_clear_buffers();
+
+	for (i = 0; i < sizeof(expected); i++) {
+		expected[i] = i * 7;
+	}
+	preload_read_responses(expected, sizeof(expected));
+
+	rc = jp2_set_read_window(r, 4);
+	t_assert(rc == 0);
+
+	memset(data, 0, sizeof(data));
+	test_read_calls();
+	rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	t_assert(!memcmp(data, expected, sizeof(data)));
+	t_assert(test_rx_pending() == 0);
+
+	/* all responses which have arrived are taken at once */
+	t_assert(test_read_calls() <= 2);
+
+	rx = test_rx(10);
+	t_assert(!memcmp(rx, "\x00\x08\x01\x00\x00\x10\x00\x00\x80\x99", 10));
+	rx = test_rx(10);
+	t_assert(!memcmp(rx, "\x00\x08\x01\x00\x00\x10\x80\x00\x80\x19", 10));
+	rx = test_rx(10);
+	t_assert(!memcmp(rx, "\x00\x08\x01\x00\x00\x11\x00\x00\x2c\x34", 10));
+	t_assert(test_tx_pending() == 0);
+
+	jp2_set_read_window(r, 1);
+}
+
+/* the frames arrive in pieces which don't match the frame boundaries */
+void test_read_block_split(void)
+{
+	int rc;
+	int i;
+	int size;
+	int calls;
+	uint8_t expected[300];
+	uint8_t data[300];
+
+	for (i = 0; i < sizeof(expected); i++) {
+		expected[i] = i * 11;
+	}
+
+	jp2_set_read_window(r, 4);
+	for (size = 1; size < 12; size += 5) {
+		test_clear_buffers();
+		preload_read_responses(expected, sizeof(expected));
+		test_set_read_size(size);
+
+		memset(data, 0, sizeof(data));
+		test_read_calls();
+		rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+		t_assert(rc == sizeof(data));
+		t_assert(!memcmp(data, expected, sizeof(data)));
+		t_assert(test_rx_pending() == 0);
+		/* one more if a read hits the end of the ring buffer */
+		calls = test_read_calls();
+		t_assert(calls >= (sizeof(data) + 3 * 4 + size - 1) / size);
+		t_assert(calls <= (sizeof(data) + 3 * 4 + size - 1) / size + 1);
+	}
+
+	test_set_read_size(0);
+	jp2_set_read_window(r, 1);
+}
+
+void test_read_block_pipelined_error(void)
+{
+	int rc;
+	uint8_t data[512];
+
+	test_clear_buffers();
+
+	memset(data, 0xaa, sizeof(data));
+	test_tx_frame(JP2_ERR_NO_ERR, data, 128);
+	test_tx_frame(JP2_ERR_INVALID_ARGUMENT, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, data, 128);
+	test_tx_frame(JP2_ERR_NO_ERR, data, 128);
+
+	/* the error is reported and the outstanding response is drained */
+	jp2_set_read_window(r, 3);
+	rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == -JP2_ERR_INVALID_ARGUMENT);
+	t_assert(test_rx_pending() == 0);
+
+	/* the window was refilled once before the error was seen, but no
+	 * further requests are sent afterwards */
+	t_assert(test_tx_pending() == 4 * 10);
+
+	jp2_set_read_window(r, 1);
+}
+
+void test_read_window_range(void)
+{
+	t_assert(jp2_set_read_window(r, 0) < 0);
+	t_assert(jp2_set_read_window(r, 1000) < 0);
+	t_assert(jp2_set_read_window(r, 1) == 0);
+}
+
+/* takes the next frame sent and checks its command and address */
+static uint8_t *expect_frame(uint8_t cmd, uint32_t address)
+{
+	uint8_t *rx;
+	int len;
+
+	rx = test_rx(2);
+	len = (rx[0] << 8) | rx[1];
+	rx = test_rx(len);
+	t_assert(rx[0] == cmd);
+	t_assert(((rx[1] << 24) | (rx[2] << 16) | (rx[3] << 8) | rx[4])
+			== address);
+	return rx;
+}
+
+void test_mirror(void)
+{
+	int rc;
+	int i;
+	struct jp2_mirror *m;
+	uint8_t remote[0x200];
+	uint8_t data[0x90];
+
+	test_clear_buffers();
+
+	for (i = 0; i < sizeof(remote); i++) {
+		remote[i] = i * 3;
+	}
+
+	m = jp2_mirror_new(r, 0x1000, 0x200, 0x80);
+	t_assert(m);
+	t_assert(jp2_mirror_new(r, 0x1010, 0x200, 0x80) == NULL);
+	t_assert(jp2_mirror_read(m, 0x1200, 1, data) == -1);
+
+	/* the first access reads the page, the second one doesn't */
+	preload_read_responses(remote, 0x80);
+	rc = jp2_mirror_read(m, 0x1004, 16, data);
+	t_assert(rc == 16);
+	t_assert(!memcmp(data, remote + 4, 16));
+	rc = jp2_mirror_read(m, 0x1010, 16, data);
+	t_assert(rc == 16);
+	t_assert(!memcmp(data, remote + 0x10, 16));
+	expect_frame(JP2_CMD_READ, 0x1000);
+	t_assert(test_tx_pending() == 0);
+
+	/* writes stay in the mirror */
+	memset(data, 0xee, sizeof(data));
+	t_assert(jp2_mirror_write(m, 0x1002, 4, data) == 4);
+	t_assert(jp2_mirror_write(m, 0x1006, 2, data) == 2);
+	t_assert(jp2_mirror_write(m, 0x1100, 0x90, data) == 0x90);
+	t_assert(jp2_mirror_write(m, 0x1040, 4, remote + 0x40) == 4);
+	t_assert(test_tx_pending() == 0);
+
+	/* the pages 2 and 3 are read first, then two runs are flashed */
+	preload_read_responses(remote + 0x100, 0x100);
+	for (i = 0; i < 5; i++) {
+		test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	}
+	rc = jp2_mirror_commit(m);
+	t_assert(rc == 3);
+	expect_frame(JP2_CMD_READ, 0x1100);
+	expect_frame(JP2_CMD_READ, 0x1180);
+	expect_frame(JP2_CMD_ERASE, 0x1000);
+	expect_frame(JP2_CMD_WRITE, 0x1000);
+	expect_frame(JP2_CMD_ERASE, 0x1100);
+	expect_frame(JP2_CMD_WRITE, 0x1100);
+	expect_frame(JP2_CMD_WRITE, 0x1180);
+	t_assert(test_tx_pending() == 0);
+	t_assert(test_rx_pending() == 0);
+
+	/* the bytes written were kept when the pages were read */
+	rc = jp2_mirror_read(m, 0x1000, 8, data);
+	t_assert(rc == 8);
+	t_assert(!memcmp(data, remote, 2));
+	t_assert(!memcmp(data + 2, "\xee\xee\xee\xee\xee\xee", 6));
+	rc = jp2_mirror_read(m, 0x1180, 0x20, data);
+	t_assert(rc == 0x20);
+	t_assert(!memcmp(data, "\xee\xee\xee\xee\xee\xee\xee\xee", 8));
+	t_assert(!memcmp(data + 0x10, remote + 0x190, 0x10));
+
+	/* nothing left to do, and writing what is there already is free */
+	t_assert(jp2_mirror_commit(m) == 0);
+	t_assert(jp2_mirror_write(m, 0x1040, 4, remote + 0x40) == 4);
+	t_assert(jp2_mirror_commit(m) == 0);
+	t_assert(test_tx_pending() == 0);
+
+	/* the next access reads the page again */
+	jp2_mirror_invalidate(m);
+	preload_read_responses(remote + 0x80, 0x80);
+	rc = jp2_mirror_read(m, 0x1080, 4, data);
+	t_assert(rc == 4);
+	t_assert(!memcmp(data, remote + 0x80, 4));
+	expect_frame(JP2_CMD_READ, 0x1080);
+	t_assert(test_tx_pending() == 0);
+	t_assert(jp2_mirror_cached(m, 0x1080, 0x80));
+	t_assert(!jp2_mirror_cached(m, 0x1000, 0x100));
+
+	/* content written by other means is taken for whole pages */
+	memset(data, 0x77, sizeof(data));
+	t_assert(jp2_mirror_update(m, 0x1100, 0x90, data) == 0x90);
+	t_assert(jp2_mirror_cached(m, 0x1100, 0x80));
+	t_assert(!jp2_mirror_cached(m, 0x1180, 1));
+	memset(data, 0, sizeof(data));
+	rc = jp2_mirror_read(m, 0x1100, 0x80, data);
+	t_assert(rc == 0x80);
+	t_assert(data[0] == 0x77 && data[0x7f] == 0x77);
+	t_assert(test_tx_pending() == 0);
+
+	/* a change the remote refused is dropped */
+	t_assert(jp2_mirror_write(m, 0x1104, 2, (uint8_t*)"\x12\x34") == 2);
+	test_tx_frame(JP2_ERR_INVALID_ARGUMENT, NULL, 0);
+	rc = jp2_mirror_commit(m);
+	t_assert(rc == -JP2_ERR_INVALID_ARGUMENT);
+	expect_frame(JP2_CMD_ERASE, 0x1100);
+	jp2_mirror_discard(m);
+	preload_read_responses(remote + 0x100, 0x80);
+	rc = jp2_mirror_read(m, 0x1100, 8, data);
+	t_assert(rc == 8);
+	t_assert(!memcmp(data, remote + 0x100, 8));
+	expect_frame(JP2_CMD_READ, 0x1100);
+	t_assert(jp2_mirror_commit(m) == 0);
+	t_assert(test_tx_pending() == 0);
+	t_assert(test_rx_pending() == 0);
+
+	jp2_mirror_free(m);
+}
+
+void test_plan(void)
+{
+	int i;
+	int rc;
+	int n;
+	uint8_t *rx;
+	uint8_t a[4] = { 1, 2, 3, 4 };
+	uint8_t c[2] = { 5, 6 };
+	uint8_t b[0x100];
+	uint8_t ff[0x40];
+	uint8_t remote[0x80];
+	const struct jp2_plan_step *steps;
+	struct jp2_plan_cost cost;
+	struct jp2_plan *p;
+	struct jp2_write writes[] = {
+		{ 0x1010, sizeof(a), a },
+		{ 0x1100, sizeof(b), b },
+		{ 0x1012, sizeof(c), c },
+		{ 0x1300, sizeof(ff), ff },
+	};
+	static const struct jp2_plan_step expected[] = {
+		{ JP2_CMD_READ, 0x1000, 0x80 },
+		{ JP2_CMD_ERASE, 0x1000, 0x80 },
+		{ JP2_CMD_WRITE, 0x1000, 0x80 },
+		{ JP2_CMD_ERASE, 0x1100, 0x100 },
+		{ JP2_CMD_WRITE, 0x1100, 0x40 },
+		{ JP2_CMD_WRITE, 0x1180, 0x80 },
+		{ JP2_CMD_READ, 0x1340, 0x40 },
+		{ JP2_CMD_ERASE, 0x1300, 0x80 },
+		{ JP2_CMD_WRITE, 0x1340, 0x40 },
+	};
+
+	test_clear_buffers();
+
+	memset(b, 0x11, sizeof(b));
+	memset(b + 0x40, 0xff, 0x40);
+	memset(ff, 0xff, sizeof(ff));
+	for (i = 0; i < sizeof(remote); i++) {
+		remote[i] = i;
+	}
+
+	t_assert(jp2_plan_writes(r, writes, 4, 0x81) == NULL);
+
+	/* the partial blocks are read, erased bytes are left out */
+	p = jp2_plan_writes(r, writes, 4, 0x80);
+	t_assert(p);
+	n = jp2_plan_steps(p, &steps);
+	t_assert(n == sizeof(expected) / sizeof(expected[0]));
+	for (i = 0; i < n; i++) {
+		t_assert(steps[i].cmd == expected[i].cmd);
+		t_assert(steps[i].address == expected[i].address);
+		t_assert(steps[i].len == expected[i].len);
+	}
+
+	jp2_plan_cost(p, &cost);
+	t_assert(cost.commands == 9);
+	t_assert(cost.erase_blocks == 4);
+	t_assert(cost.rx_bytes == 9 * 4 + 0x80 + 0x40);
+	t_assert(cost.time_ms > 0);
+
+	test_tx_frame(JP2_ERR_NO_ERR, remote, 0x80);
+	for (i = 0; i < 5; i++) {
+		test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	}
+	test_tx_frame(JP2_ERR_NO_ERR, remote, 0x40);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+
+	rc = jp2_plan_execute(p);
+	t_assert(rc == 4);
+	t_assert(test_rx_pending() == 0);
+	t_assert(test_tx_pending() == cost.tx_bytes);
+
+	/* one frame per step, the first block keeps what was read around
+	 * the later write */
+	for (i = 0; i < n; i++) {
+		rx = expect_frame(steps[i].cmd, steps[i].address);
+		if (i == 2) {
+			t_assert(!memcmp(rx + 5, remote, 0x10));
+			t_assert(!memcmp(rx + 0x15, "\x01\x02\x05\x06", 4));
+			t_assert(!memcmp(rx + 0x19, remote + 0x14, 0x6c));
+		}
+	}
+	t_assert(test_tx_pending() == 0);
+
+	jp2_plan_free(p);
+}
+
+#define PROBE_AREA 8192
+
+/* The responses to a probe of the erase block size on a remote with the
+ * given block size, which refuses the first CHECKSUM if fail is set. */
+static void preload_probe(int block, bool fail)
+{
+	int i;
+	uint8_t data[128];
+	uint8_t csum;
+
+	memset(data, 0x5a, sizeof(data));
+	for (i = 0; i < PROBE_AREA / 128; i++) {
+		test_tx_frame(JP2_ERR_NO_ERR, data, 128);
+	}
+	/* erase, the zeros from 32 to 4096 bytes in, erase */
+	for (i = 0; i < 1 + 8 + 1; i++) {
+		test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	}
+	if (fail) {
+		test_tx_frame(JP2_ERR_INVALID_ARGUMENT, NULL, 0);
+	} else {
+		for (i = 32; i <= 4096; i *= 2) {
+			csum = (i < block) ? 0xff : 0x00;
+			test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+			if (csum == 0x00) {
+				break;
+			}
+		}
+	}
+	/* the scratch area is restored */
+	for (i = 0; i < 1 + PROBE_AREA / 128; i++) {
+		test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	}
+}
+
+static void expect_probe(int block, bool fail)
+{
+	int i;
+
+	for (i = 0; i < PROBE_AREA / 128; i++) {
+		expect_frame(JP2_CMD_READ, 0x11000 + i * 128);
+	}
+	expect_frame(JP2_CMD_ERASE, 0x11000);
+	for (i = 32; i <= 4096; i *= 2) {
+		expect_frame(JP2_CMD_WRITE, 0x11000 + i);
+	}
+	expect_frame(JP2_CMD_ERASE, 0x11000);
+	for (i = 32; i <= 4096; i *= 2) {
+		expect_frame(JP2_CMD_CHECKSUM, 0x11000 + i);
+		if (fail || i >= block) {
+			break;
+		}
+	}
+	expect_frame(JP2_CMD_ERASE, 0x11000);
+	for (i = 0; i < PROBE_AREA / 128; i++) {
+		expect_frame(JP2_CMD_WRITE, 0x11000 + i * 128);
+	}
+	t_assert(test_tx_pending() == 0);
+	t_assert(test_rx_pending() == 0);
+}
+
+void test_probe_erase_block(void)
+{
+	int rc;
+	struct jp2_info info = {
+		.update_area_begin = 0x10100,
+		.update_area_end = 0x1ffff,
+	};
+
+	test_clear_buffers();
+	preload_probe(256, false);
+	rc = jp2_probe_erase_block(r, &info);
+	t_assert(rc == 256);
+	t_assert(jp2_get_erase_block_size(r) == 256);
+	expect_probe(256, false);
+
+	/* the largest candidate */
+	test_clear_buffers();
+	preload_probe(4096, false);
+	rc = jp2_probe_erase_block(r, &info);
+	t_assert(rc == 4096);
+	t_assert(jp2_get_erase_block_size(r) == 4096);
+	expect_probe(4096, false);
+
+	/* larger and smaller blocks aren't taken for a candidate */
+	test_clear_buffers();
+	preload_probe(8192, false);
+	rc = jp2_probe_erase_block(r, &info);
+	t_assert(rc == -JP2_ERR_UNSUPPORTED);
+	expect_probe(8192, false);
+
+	test_clear_buffers();
+	preload_probe(32, false);
+	rc = jp2_probe_erase_block(r, &info);
+	t_assert(rc == -JP2_ERR_UNSUPPORTED);
+	t_assert(jp2_get_erase_block_size(r) == 4096);
+	expect_probe(32, false);
+
+	/* the scratch area is restored after an error */
+	test_clear_buffers();
+	preload_probe(256, true);
+	rc = jp2_probe_erase_block(r, &info);
+	t_assert(rc == -JP2_ERR_INVALID_ARGUMENT);
+	t_assert(jp2_get_erase_block_size(r) == 4096);
+	expect_probe(256, true);
+
+	/* no room for the scratch area */
+	info.update_area_begin = 0x10001;
+	info.update_area_end = 0x11fff;
+	t_assert(jp2_probe_erase_block(r, &info) == -JP2_ERR_UNSUPPORTED);
+	t_assert(test_tx_pending() == 0);
+
+	t_assert(jp2_set_erase_block_size(r, 100) < 0);
+	t_assert(jp2_set_erase_block_size(r, 256) == 0);
+}
+
+struct async_results {
+	int calls;
+	int rc[JP2_MAX_INFLIGHT];
+	uint8_t *data[JP2_MAX_INFLIGHT];
+};
+
+static void async_done(void *priv, int rc, uint8_t *data)
+{
+	struct async_results *res = priv;
+
+	res->rc[res->calls] = rc;
+	res->data[res->calls] = data;
+	res->calls++;
+}
+
+void test_async_read(void)
+{
+	int rc;
+	uint8_t *rx;
+	uint8_t data[2][16];
+	uint8_t pattern[16];
+	uint8_t csum = 0x42;
+	struct async_results res = { 0 };
+
+	test_clear_buffers();
+
+	memset(pattern, 0x5a, sizeof(pattern));
+	test_rx_barrier(2);
+	test_tx_frame(JP2_ERR_NO_ERR, pattern, 16);
+	test_tx_frame(JP2_ERR_NO_ERR, pattern, 16);
+	test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+
+	rc = jp2_submit_read(r, 0x1000, 16, data[0], async_done, &res);
+	t_assert(rc == 0);
+
+	/* nothing has arrived yet, which is no timeout */
+	rc = jp2_process_events(r, 0);
+	t_assert(rc == 0);
+	t_assert(jp2_pending(r) == 1);
+	t_assert(jp2_next_timeout(r) > 0);
+
+	rc = jp2_submit_read(r, 0x1010, 16, data[1], async_done, &res);
+	t_assert(rc == 0);
+	rc = jp2_submit_checksum(r, 0x1000, 0x100f, async_done, &res);
+	t_assert(rc == 0);
+	t_assert(jp2_pending(r) == 3);
+
+	/* one read picks up all the responses */
+	test_read_calls();
+	rc = jp2_process_events(r, 0);
+	t_assert(rc == 3);
+	t_assert(test_read_calls() == 1);
+	t_assert(jp2_pending(r) == 0);
+	t_assert(jp2_next_timeout(r) == -1);
+
+	t_assert(res.calls == 3);
+	t_assert(res.rc[0] == 16 && res.data[0] == data[0]);
+	t_assert(res.rc[1] == 16 && res.data[1] == data[1]);
+	t_assert(!memcmp(data[0], pattern, 16));
+	t_assert(!memcmp(data[1], pattern, 16));
+	t_assert(res.rc[2] == 1 && res.data[2][0] == 0x42);
+
+	rx = test_rx(10);
+	t_assert(!memcmp(rx, "\x00\x08\x01\x00\x00\x10\x00\x00\x10\x09", 10));
+	rx = test_rx(10);
+	t_assert(!memcmp(rx, "\x00\x08\x01\x00\x00\x10\x10\x00\x10\x19", 10));
+	rx = test_rx(12);
+	t_assert(!memcmp(rx, "\x00\x0a\x04\x00\x00\x10\x00\x00\x00\x10\x0f\x01",
+				12));
+	t_assert(test_tx_pending() == 0);
+	t_assert(test_rx_pending() == 0);
+
+	/* the test remote has no descriptor to poll */
+	t_assert(jp2_get_fd(r) == -1);
+}
+
+void test_async_errors(void)
+{
+	int i;
+	int rc;
+	struct async_results res = { 0 };
+
+	test_clear_buffers();
+
+	/* a bad checksum only fails its own request */
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	test_tx_s("\x00\x02\00\x00", 4);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	for (i = 0; i < 3; i++) {
+		rc = jp2_submit_erase(r, 0x1000, 0x1fff, async_done, &res);
+		t_assert(rc == 0);
+	}
+	rc = jp2_process_events(r, 0);
+	t_assert(rc == 3);
+	t_assert(res.rc[0] == 0);
+	t_assert(res.rc[1] == -JP2_ERR_WRONG_CHECKSUM);
+	t_assert(res.rc[2] == 0);
+
+	/* a timeout fails everything in flight */
+	memset(&res, 0, sizeof(res));
+	jp2_set_timeout(r, JP2_CMD_CHECKSUM, 0);
+	for (i = 0; i < JP2_MAX_INFLIGHT; i++) {
+		rc = jp2_submit_checksum(r, 0x1000, 0x1fff, async_done, &res);
+		t_assert(rc == 0);
+	}
+	rc = jp2_submit_checksum(r, 0x1000, 0x1fff, async_done, &res);
+	t_assert(rc < 0);
+	t_assert(jp2_next_timeout(r) == 0);
+
+	rc = jp2_process_events(r, -1);
+	t_assert(rc == JP2_MAX_INFLIGHT);
+	t_assert(res.calls == JP2_MAX_INFLIGHT);
+	for (i = 0; i < JP2_MAX_INFLIGHT; i++) {
+		t_assert(res.rc[i] == -JP2_ERR_TIMEOUT);
+	}
+	t_assert(jp2_pending(r) == 0);
+
+	jp2_set_timeout(r, JP2_CMD_CHECKSUM, 1000);
+}
+
+static int busy_rc[2];
+
+static void busy_progress(void *priv, int done, int total)
+{
+	if (done == 1) {
+		busy_rc[0] = jp2_submit_checksum(r, 0x1000, 0x1fff,
+				async_done, priv);
+		busy_rc[1] = jp2_process_events(r, 0);
+	}
+}
+
+void test_async_busy(void)
+{
+	int rc;
+	uint8_t *rx;
+	uint8_t data[256];
+	uint8_t csum = 0x42;
+	struct async_results res = { 0 };
+
+	test_clear_buffers();
+
+	/* no synchronous calls while requests are in flight */
+	rc = jp2_submit_checksum(r, 0x1000, 0x1fff, async_done, &res);
+	t_assert(rc == 0);
+	rc = jp2_read_block(r, 0x1000, 16, data);
+	t_assert(rc == -JP2_ERR_BUSY);
+	rc = jp2_erase_block(r, 0x1000, 0x1fff);
+	t_assert(rc == -JP2_ERR_BUSY);
+	rc = jp2_enter_loader(r, false);
+	t_assert(rc == -JP2_ERR_BUSY);
+	rx = test_rx(12);
+	t_assert(rx[2] == JP2_CMD_CHECKSUM);
+	t_assert(test_tx_pending() == 0);
+
+	/* the request in flight isn't disturbed */
+	test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+	rc = jp2_process_events(r, 0);
+	t_assert(rc == 1);
+	t_assert(res.calls == 1 && res.rc[0] == 1);
+
+	/* nor asynchronous ones while a synchronous call waits */
+	memset(data, 0x11, sizeof(data));
+	preload_read_responses(data, sizeof(data));
+	jp2_set_read_window(r, 2);
+	jp2_set_progress_cb(r, busy_progress, &res);
+	rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	t_assert(busy_rc[0] == -JP2_ERR_BUSY);
+	t_assert(busy_rc[1] == -JP2_ERR_BUSY);
+	t_assert(res.calls == 1);
+	t_assert(test_rx_pending() == 0);
+	jp2_set_progress_cb(r, NULL, NULL);
+	jp2_set_read_window(r, 1);
+}
+
+void test_probe_chunk_size(void)
+{
+	int rc;
+	uint8_t *rx;
+	uint8_t data[1024];
+
+	test_clear_buffers();
+
+	/* 1024 bytes are rejected, 512 bytes are fine */
+	memset(data, 0x55, sizeof(data));
+	test_tx_frame(JP2_ERR_INVALID_ARGUMENT, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, data, 512);
+
+	rc = jp2_probe_chunk_size(r);
+	t_assert(rc == 512);
+	t_assert(jp2_get_read_chunk_size(r) == 512);
+	t_assert(jp2_get_write_chunk_size(r) == 512);
+
+	/* both probes read from the info area */
+	rx = test_rx(10);
+	t_assert(!memcmp(rx, "\x00\x08\x01\x00\x00\xc4\x4e\x04\x00\x87", 10));
+	rx = test_rx(10);
+	t_assert(!memcmp(rx, "\x00\x08\x01\x00\x00\xc4\x4e\x02\x00\x81", 10));
+
+	/* reads are now split into 512 byte chunks */
+	test_tx_frame(JP2_ERR_NO_ERR, data, 512);
+	test_tx_frame(JP2_ERR_NO_ERR, data, 88);
+	rc = jp2_read_block(r, 0x1000, 600, data);
+	t_assert(rc == 600);
+	t_assert(test_rx_pending() == 0);
+	rx = test_rx(10);
+	t_assert(!memcmp(rx + 7, "\x02\x00", 2));
+	rx = test_rx(10);
+	t_assert(!memcmp(rx + 7, "\x00\x58", 2));
+}
+
+void test_write_chunk_fallback(void)
+{
+	int rc;
+	uint8_t *rx;
+	uint8_t data[1024];
+
+	test_clear_buffers();
+
+	/* the first 512 byte write is rejected, then 256 bytes are used */
+	memset(data, 0x55, sizeof(data));
+	test_tx_frame(JP2_ERR_INVALID_ARGUMENT, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+
+	rc = jp2_write_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	t_assert(jp2_get_write_chunk_size(r) == 256);
+	t_assert(jp2_get_read_chunk_size(r) == 512);
+	t_assert(test_rx_pending() == 0);
+
+	rx = test_rx(8 + 512);
+	t_assert(!memcmp(rx, "\x02\x06\x02\x00\x00\x10\x00", 7));
+	rx = test_rx(8 + 256);
+	t_assert(!memcmp(rx, "\x01\x06\x02\x00\x00\x10\x00", 7));
+
+	t_assert(jp2_set_chunk_size(r, 4096) < 0);
+	t_assert(jp2_set_chunk_size(r, 127) < 0);
+	t_assert(jp2_set_chunk_size(r, 128) == 0);
+}
+
+/* a length which is a multiple of 64 KiB must not be truncated */
+void test_write_large(void)
+{
+	int rc;
+	int i;
+	int chunk = jp2_get_write_chunk_size(r);
+	uint8_t *rx;
+	static uint8_t data[0x10000];
+
+	test_clear_buffers();
+
+	for (i = 0; i < sizeof(data) / chunk; i++) {
+		test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	}
+
+	rc = jp2_write_block(r, 0x10000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	t_assert(test_rx_pending() == 0);
+
+	rx = test_rx(8 + chunk);
+	t_assert(!memcmp(rx + 2, "\x02\x00\x01\x00\x00", 5));
+	test_rx((sizeof(data) / chunk - 2) * (8 + chunk));
+	rx = test_rx(8 + chunk);
+	t_assert(!memcmp(rx + 2, "\x02\x00\x01\xff\x80", 5));
+	t_assert(test_tx_pending() == 0);
+}
+
+void test_probe_host_baudrate(void)
+{
+	int rc;
+	struct jp2_stats stats;
+
+	test_clear_buffers();
+	jp2_reset_stats(r);
+
+	/* the remote answers up to 115200 baud, each ping once it is sent */
+	test_set_baudrates(38400, 115200);
+	test_rx_barrier(1);
+	test_tx_s("\x00\x08\x00\x03\x15\x00\x00\xc4\x4e\x94", 10);
+	test_rx_barrier(2);
+	test_tx_s("\x00\x08\x00\x03\x15\x00\x00\xc4\x4e\x94", 10);
+	/* response to the ping after the fallback */
+	test_rx_barrier(4);
+	test_tx_s("\x00\x08\x00\x03\x15\x00\x00\xc4\x4e\x94", 10);
+
+	rc = jp2_probe_host_baudrate(r, 921600);
+	t_assert(rc == 115200);
+	t_assert(jp2_get_baudrate(r) == 115200);
+	t_assert(test_get_baudrate() == 115200);
+	t_assert(test_rx_pending() == 0);
+
+	/* the ping at 230400 baud timed out */
+	jp2_get_stats(r, &stats);
+	t_assert(stats.cmd[JP2_STATS_INFO].count == 4);
+	t_assert(stats.cmd[JP2_STATS_INFO].timeouts == 1);
+	t_assert(stats.cmd[JP2_STATS_INFO].errors == 1);
+
+	/* limited by the caller */
+	test_clear_buffers();
+	jp2_set_baudrate(r, 38400);
+	test_tx_s("\x00\x08\x00\x03\x15\x00\x00\xc4\x4e\x94", 10);
+	rc = jp2_probe_host_baudrate(r, 57600);
+	t_assert(rc == 57600);
+	t_assert(test_get_baudrate() == 57600);
+
+	/* the remote is lost after the fallback, the port goes back to where
+	 * it started */
+	test_clear_buffers();
+	jp2_set_baudrate(r, 38400);
+	test_set_baudrates(38400, 57600);
+	test_tx_s("\x00\x08\x00\x03\x15\x00\x00\xc4\x4e\x94", 10);
+	rc = jp2_probe_host_baudrate(r, 115200);
+	t_assert(rc < 0);
+	t_assert(jp2_get_baudrate(r) == 38400);
+	t_assert(test_get_baudrate() == 38400);
+
+	jp2_set_baudrate(r, 38400);
+	test_set_baudrates(38400, 38400);
+}
+
+static uint8_t xor(uint8_t *data, int len)
+{
+	uint8_t csum = 0;
+
+	while (len--) {
+		csum ^= *data++;
+	}
+
+	return csum;
+}
+
+void test_write_delta(void)
+{
+	int rc;
+	int i;
+	uint8_t *rx;
+	uint8_t csum;
+	uint8_t data[1024];
+
+	test_clear_buffers();
+
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = i * 3 + 1;
+	}
+
+	/* the third of four blocks differs */
+	for (i = 0; i < 4; i++) {
+		csum = xor(data + i * 256, 256) ^ ((i == 2) ? 0x01 : 0);
+		test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+	}
+	/* ack for erase and two 128 byte writes */
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	/* everything matches afterwards, the checksums are those of erased
+	 * blocks, so they are read back */
+	for (i = 0; i < 4; i++) {
+		csum = xor(data + i * 256, 256);
+		test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+	}
+	preload_read_responses(data, sizeof(data));
+
+	rc = jp2_write_delta(r, 0x1000, sizeof(data), data, 256);
+	t_assert(rc == 1);
+	t_assert(test_rx_pending() == 0);
+
+	rx = test_rx(12);
+	t_assert(!memcmp(rx, "\x00\x0a\x04\x00\x00\x10\x00\x00\x00\x10\xff", 11));
+	test_rx(3 * 12);
+	rx = test_rx(12);
+	t_assert(!memcmp(rx, "\x00\x0a\x03\x00\x00\x12\x00\x00\x00\x12\xff", 11));
+	rx = test_rx(8 + 128);
+	t_assert(!memcmp(rx, "\x00\x86\x02\x00\x00\x12\x00", 7));
+	t_assert(!memcmp(rx + 7, data + 512, 128));
+}
+
+void test_write_delta_wiped_neighbour(void)
+{
+	int rc;
+	int i;
+	uint8_t csum;
+	uint8_t data[512];
+	uint8_t wiped[256];
+
+	test_clear_buffers();
+
+	memset(data, 0, sizeof(data));
+	data[0] = 0x42;
+	memset(wiped, 0xff, sizeof(wiped));
+
+	/* first block differs */
+	test_tx_frame(JP2_ERR_NO_ERR, (uint8_t*)"\x00", 1);
+	test_tx_frame(JP2_ERR_NO_ERR, (uint8_t*)"\x00", 1);
+	/* erase and write of the first block */
+	for (i = 0; i < 3; i++) {
+		test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	}
+	/* the erase wiped the second one, which has the same checksum as
+	 * its data, so it is read back */
+	csum = 0x42;
+	test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+	test_tx_frame(JP2_ERR_NO_ERR, (uint8_t*)"\x00", 1);
+	preload_read_responses(wiped, sizeof(wiped));
+	/* second block is written without erasing */
+	for (i = 0; i < 2; i++) {
+		test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	}
+	test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+	test_tx_frame(JP2_ERR_NO_ERR, (uint8_t*)"\x00", 1);
+	preload_read_responses(data + 256, 256);
+
+	rc = jp2_write_delta(r, 0x1000, sizeof(data), data, 256);
+	t_assert(rc == 2);
+	t_assert(test_rx_pending() == 0);
+}
+
+void test_verify(void)
+{
+	int rc;
+	int i;
+	uint32_t bad_address;
+	uint8_t csum;
+	uint8_t data[512];
+	uint8_t remote[512];
+
+	test_clear_buffers();
+
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = i * 5 + 3;
+	}
+
+	/* clean verify is a single round trip */
+	csum = xor(data, sizeof(data));
+	test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+	rc = jp2_verify(r, 0x1000, sizeof(data), data, &bad_address);
+	t_assert(rc == 0);
+	t_assert(test_rx_pending() == 0);
+	t_assert(test_tx_pending() == 12);
+
+	/* one byte differs in the third quarter */
+	test_clear_buffers();
+	memcpy(remote, data, sizeof(remote));
+	remote[300] ^= 0x10;
+	csum = xor(remote, sizeof(remote));
+	test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+	for (i = 0; i < 4; i++) {
+		csum = xor(remote + i * 128, 128);
+		test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+	}
+	test_tx_frame(JP2_ERR_NO_ERR, remote + 256, 128);
+
+	rc = jp2_verify(r, 0x1000, sizeof(data), data, &bad_address);
+	t_assert(rc == 1);
+	t_assert(bad_address == 0x1000 + 300);
+	t_assert(test_rx_pending() == 0);
+}
+
+static int progress_done;
+static int progress_total;
+
+static void progress(void *priv, int done, int total)
+{
+	progress_done = done;
+	progress_total = total;
+}
+
+void test_checksum_dump(void)
+{
+	int rc;
+	int i;
+	uint8_t *rx;
+	uint8_t data[4];
+
+	test_clear_buffers();
+
+	for (i = 0; i < sizeof(data); i++) {
+		test_tx_frame(JP2_ERR_NO_ERR, (uint8_t*)"\xa0\xa1\xa2\xa3" + i, 1);
+	}
+
+	jp2_set_read_window(r, 4);
+	jp2_set_progress_cb(r, progress, NULL);
+	rc = jp2_checksum_dump(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	t_assert(!memcmp(data, "\xa0\xa1\xa2\xa3", 4));
+	t_assert(progress_done == 4 && progress_total == 4);
+	t_assert(test_rx_pending() == 0);
+
+	rx = test_rx(12);
+	t_assert(!memcmp(rx, "\x00\x0a\x04\x00\x00\x10\x00\x00\x00\x10\x00", 11));
+	test_rx(2 * 12);
+	rx = test_rx(12);
+	t_assert(!memcmp(rx, "\x00\x0a\x04\x00\x00\x10\x03\x00\x00\x10\x03", 11));
+
+	jp2_set_progress_cb(r, NULL, NULL);
+	jp2_set_read_window(r, 1);
+}
+
+void test_no_allocations(void)
+{
+	int rc;
+	uint8_t data[300];
+
+	test_clear_buffers();
+	preload_read_responses(data, sizeof(data));
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+	test_tx_frame(JP2_ERR_NO_ERR, (uint8_t*)"\x00", 1);
+
+	test_allocations();
+
+	rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	rc = jp2_write_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	rc = jp2_erase_block(r, 0x1000, 0x10ff);
+	t_assert(rc == 0);
+	rc = jp2_checksum_block(r, 0x1000, 0x10ff);
+	t_assert(rc == 0);
+
+	t_assert(test_allocations() == 0);
+	t_assert(test_rx_pending() == 0);
+}
+
+void test_read_retry(void)
+{
+	int rc;
+	int i;
+	uint8_t *rx;
+	uint8_t expected[300];
+	uint8_t data[300];
+	uint8_t csum;
+	struct jp2_stats stats;
+
+	test_clear_buffers();
+	jp2_reset_stats(r);
+
+	for (i = 0; i < sizeof(expected); i++) {
+		expected[i] = i * 5;
+	}
+
+	/* first response is corrupted */
+	csum = 0x82 ^ xor(expected, 128) ^ 0x40;
+	test_tx_s("\x00\x82\x00", 3);
+	test_tx(expected, 128);
+	test_tx(&csum, 1);
+	test_rx_barrier(2);
+	preload_read_responses(expected, sizeof(expected));
+
+	rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	t_assert(!memcmp(data, expected, sizeof(data)));
+	t_assert(test_rx_pending() == 0);
+
+	/* the first chunk is requested twice */
+	rx = test_rx(10);
+	t_assert(!memcmp(rx, "\x00\x08\x01\x00\x00\x10\x00\x00\x80\x99", 10));
+	rx = test_rx(10);
+	t_assert(!memcmp(rx, "\x00\x08\x01\x00\x00\x10\x00\x00\x80\x99", 10));
+	test_rx(20);
+	t_assert(test_tx_pending() == 0);
+
+	jp2_get_stats(r, &stats);
+	t_assert(stats.cmd[JP2_STATS_READ].retries == 1);
+	t_assert(stats.cmd[JP2_STATS_READ].checksum_errors == 1);
+}
+
+void test_read_resync(void)
+{
+	int rc;
+	uint8_t expected[256];
+	uint8_t data[256];
+
+	test_clear_buffers();
+
+	memset(expected, 0x5a, sizeof(expected));
+
+	/* garbage instead of the first response, the second response is
+	 * discarded as well, as the stream can't be trusted anymore */
+	test_tx_s("\x00\x01\xff\x12\x34", 5);
+	test_tx_frame(JP2_ERR_NO_ERR, expected, 128);
+	test_rx_barrier(3);
+	preload_read_responses(expected, sizeof(expected));
+
+	jp2_set_read_window(r, 2);
+	rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	t_assert(!memcmp(data, expected, sizeof(data)));
+	t_assert(test_rx_pending() == 0);
+	t_assert(test_tx_pending() == 4 * 10);
+	test_rx(4 * 10);
+
+	/* a persistent error gives up after some retries */
+	test_clear_buffers();
+	for (rc = 0; rc < 8; rc++) {
+		test_tx_s("\x00\x01\xff", 3);
+		test_rx_barrier(rc + 2);
+	}
+	rc = jp2_read_block(r, 0x1000, 16, data);
+	t_assert(rc == -JP2_ERR_FRAMING);
+
+	jp2_set_read_window(r, 1);
+}
+
+void test_read_short_reply(void)
+{
+	int rc;
+	int i;
+	uint8_t expected[64];
+	uint8_t data[64];
+	struct jp2_stats stats;
+
+	test_clear_buffers();
+	jp2_reset_stats(r);
+
+	memset(expected, 0x3c, sizeof(expected));
+
+	/* the checksum is fine, but a byte is missing */
+	test_tx_frame(JP2_ERR_NO_ERR, expected, sizeof(expected) - 1);
+	test_rx_barrier(2);
+	test_tx_frame(JP2_ERR_NO_ERR, expected, sizeof(expected));
+
+	rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	t_assert(!memcmp(data, expected, sizeof(data)));
+	t_assert(test_rx_pending() == 0);
+
+	jp2_get_stats(r, &stats);
+	t_assert(stats.cmd[JP2_STATS_READ].retries == 1);
+
+	/* a remote which keeps doing so gives up */
+	test_clear_buffers();
+	for (i = 0; i < 8; i++) {
+		test_tx_frame(JP2_ERR_NO_ERR, expected, 1);
+		test_rx_barrier(i + 2);
+	}
+	rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == -JP2_ERR_FRAMING);
+}
+
+void test_write_retry(void)
+{
+	int rc;
+	uint8_t *rx;
+	uint8_t data[128];
+	uint8_t csum;
+
+	memset(data, 0x11, sizeof(data));
+	data[0] = 0x33;
+	csum = xor(data, sizeof(data));
+
+	/* the response is lost, but the data was written */
+	test_clear_buffers();
+	test_tx_s("\x00\x02\x00\x00", 4);
+	test_rx_barrier(2);
+	test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+
+	rc = jp2_write_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	rx = test_rx(8 + sizeof(data));
+	t_assert(rx[2] == JP2_CMD_WRITE);
+	rx = test_rx(12);
+	t_assert(rx[2] == JP2_CMD_CHECKSUM);
+	t_assert(test_tx_pending() == 0);
+
+	/* the data wasn't written, so the WRITE is sent again */
+	test_clear_buffers();
+	test_tx_s("\x00\x02\x00\x00", 4);
+	test_rx_barrier(2);
+	csum ^= 1;
+	test_tx_frame(JP2_ERR_NO_ERR, &csum, 1);
+	test_tx_frame(JP2_ERR_NO_ERR, NULL, 0);
+
+	rc = jp2_write_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	rx = test_rx(8 + sizeof(data));
+	t_assert(rx[2] == JP2_CMD_WRITE);
+	rx = test_rx(12);
+	t_assert(rx[2] == JP2_CMD_CHECKSUM);
+	rx = test_rx(8 + sizeof(data));
+	t_assert(rx[2] == JP2_CMD_WRITE);
+	t_assert(test_tx_pending() == 0);
+	t_assert(test_rx_pending() == 0);
+}
+
+void test_timeout(void)
+{
+	int rc;
+	uint8_t data[16];
+	struct jp2_stats stats;
+
+	test_clear_buffers();
+	jp2_reset_stats(r);
+
+	/* no response at all */
+	rc = jp2_simple_command(r, JP2_CMD_INFO);
+	t_assert(rc == -JP2_ERR_TIMEOUT);
+	rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == -JP2_ERR_TIMEOUT);
+
+	jp2_get_stats(r, &stats);
+	t_assert(stats.cmd[JP2_STATS_INFO].timeouts == 1);
+	t_assert(stats.cmd[JP2_STATS_READ].timeouts == 4);
+	t_assert(stats.cmd[JP2_STATS_READ].retries == 3);
+
+	/* the first request gets lost */
+	test_clear_buffers();
+	test_rx_barrier(2);
+	test_tx_frame(JP2_ERR_NO_ERR, data, sizeof(data));
+	rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	t_assert(test_rx_pending() == 0);
+}
+
+void test_stats(void)
+{
+	int rc;
+	uint8_t data[300];
+	struct jp2_stats stats;
+	struct jp2_cmd_stats *c;
+
+	test_clear_buffers();
+	jp2_reset_stats(r);
+
+	preload_ack();
+	test_tx_s("\x00\x02\x00\x00", 4);
+	preload_read_responses(data, sizeof(data));
+
+	rc = jp2_simple_command(r, JP2_CMD_INFO);
+	t_assert(rc == 0);
+	rc = jp2_simple_command(r, JP2_CMD_INFO);
+	t_assert(rc == -JP2_ERR_WRONG_CHECKSUM);
+	jp2_set_read_window(r, 4);
+	rc = jp2_read_block(r, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	jp2_set_read_window(r, 1);
+
+	jp2_get_stats(r, &stats);
+	c = &stats.cmd[JP2_STATS_INFO];
+	t_assert(c->count == 2);
+	t_assert(c->tx_bytes == 8);
+	t_assert(c->rx_bytes == 8);
+	t_assert(c->checksum_errors == 1);
+	t_assert(c->errors == 0);
+
+	c = &stats.cmd[JP2_STATS_READ];
+	t_assert(c->count == 3);
+	t_assert(c->tx_bytes == 3 * 10);
+	t_assert(c->rx_bytes == sizeof(data) + 3 * 4);
+	t_assert(c->latency_max <= jp2_stats_percentile(c, 100));
+	t_assert(jp2_stats_percentile(c, 50) > 0);
+
+	jp2_reset_stats(r);
+	jp2_get_stats(r, &stats);
+	t_assert(stats.cmd[JP2_STATS_READ].count == 0);
+	t_assert(stats.cmd[JP2_STATS_READ].latency_sum == 0);
+}
+
+/* a session recorded with a read window of 4 is replayed with a window of 1 */
+void test_capture_replay(void)
+{
+	int rc;
+	int i;
+	char filename[] = "/tmp/jp2capXXXXXX";
+	struct jp2_remote *c;
+	struct jp2_info info;
+	struct osapi_ops *capture;
+	uint8_t expected[300];
+	uint8_t data[300];
+	extern struct osapi_ops test_ops;
+
+	rc = mkstemp(filename);
+	t_assert(rc >= 0);
+	close(rc);
+
+	test_clear_buffers();
+	test_tx_s("\x00\x02\x00\x02", 4);
+	test_tx_s("\x00\x06\x00\x03\x15\xc4\x4e\x9a", 8);
+	test_tx_s("\x00\x28\x00\x33\x32\x32\x34\x30\x33\x42", 10);
+	test_tx_s("\x56\x20\x4f\x46\x41\x20\x49\x6e\x66\x20", 10);
+	test_tx_s("\x20\x20\x20\x20\x20\x20\x20\x20\x20\x05", 10);
+	test_tx_s("\x00\x4b\x7f\x4b\x80\xdf\xff\xe0\x00\xef", 10);
+	test_tx_s("\xff\x1b", 2);
+	for (i = 0; i < sizeof(expected); i++) {
+		expected[i] = i * 3;
+	}
+	preload_read_responses(expected, sizeof(expected));
+
+	capture = osapi_capture(&test_ops, filename);
+	t_assert(capture);
+	osapi = capture;
+	c = jp2_open_remote("/dev/null");
+	t_assert(c);
+	/* a second device would mix up the records */
+	t_assert(jp2_open_remote("/dev/null") == NULL);
+	rc = jp2_enter_loader(c, false);
+	t_assert(rc == 0);
+	rc = jp2_get_info(c, &info);
+	t_assert(rc == 0);
+	jp2_set_read_window(c, 4);
+	rc = jp2_read_block(c, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	jp2_close_remote(c);
+	t_assert(test_rx_pending() == 0);
+	osapi_capture_free(capture);
+
+	osapi = &osapi_replay_ops;
+	c = jp2_open_remote(filename);
+	t_assert(c);
+	rc = jp2_enter_loader(c, false);
+	t_assert(rc == 0);
+	memset(&info, 0, sizeof(info));
+	rc = jp2_get_info(c, &info);
+	t_assert(rc == 0);
+	t_assert(info.id == 0x0315);
+	t_assert(info.update_area_end == 0xefff);
+	memset(data, 0, sizeof(data));
+	rc = jp2_read_block(c, 0x1000, sizeof(data), data);
+	t_assert(rc == sizeof(data));
+	t_assert(!memcmp(data, expected, sizeof(data)));
+
+	/* end of the capture */
+	rc = jp2_read_block(c, 0x1000, 1, data);
+	t_assert(rc == -JP2_ERR_TIMEOUT);
+	jp2_close_remote(c);
+
+	osapi = &test_ops;
+	unlink(filename);
+}
+
+#ifdef JP2_TRACE
+static int trace_types[32];
+
+static void trace_count(void *priv, const struct jp2_trace_event *ev)
+{
+	char buf[128];
+
+	trace_types[ev->type]++;
+	t_assert(jp2_trace_format(ev, buf, sizeof(buf)) > 0);
+}
+
+void test_trace(void)
+{
+	int rc;
+
+	test_clear_buffers();
+	jp2_trace_drain(r, trace_count, NULL);
+	memset(trace_types, 0, sizeof(trace_types));
+
+	preload_ack();
+	test_tx_s("\x00\x02\x00\x00", 4);
+	rc = jp2_simple_command(r, JP2_CMD_INFO);
+	t_assert(rc == 0);
+	rc = jp2_simple_command(r, JP2_CMD_INFO);
+	t_assert(rc == -JP2_ERR_WRONG_CHECKSUM);
+
+	rc = jp2_trace_drain(r, trace_count, NULL);
+	t_assert(rc == 5);
+	t_assert(trace_types[JP2_TRACE_TX] == 2);
+	t_assert(trace_types[JP2_TRACE_RX] == 2);
+	t_assert(trace_types[JP2_TRACE_BAD_CHECKSUM] == 1);
+
+	/* nothing left */
+	t_assert(jp2_trace_drain(r, trace_count, NULL) == 0);
+}
+#endif
+
+#ifdef JP2_TRACE
+static uint32_t reset_pulse;
+
+static void trace_reset(void *priv, const struct jp2_trace_event *ev)
+{
+	if (ev->type == JP2_TRACE_RESET) {
+		reset_pulse = ev->a;
+	}
+}
+
+static void connect_pulse(struct jp2_remote *c, uint32_t expected)
+{
+	int rc;
+	struct jp2_info info;
+	uint8_t area[JP2_SIGNATURE_LEN + 12];
+
+	test_clear_buffers();
+	memset(area, 0, sizeof(area));
+	memcpy(area, "PULSE", 5);
+	test_tx_frame(0, NULL, 0);
+	test_tx_frame(0, (uint8_t*)"\x03\x15\x10\x00", 4);
+	test_tx_frame(0, area, sizeof(area));
+
+	rc = jp2_connect(c, false, &info);
+	t_assert(rc == 0);
+	t_assert(!strcmp(info.signature, "PULSE"));
+	t_assert(reset_pulse == expected);
+}
+
+void test_reset_pulse(void)
+{
+	struct jp2_remote *c;
+
+	c = jp2_open_remote("/dev/ttyPULSE");
+	t_assert(c);
+	jp2_set_trace_sink(c, trace_reset, NULL);
+
+	/* halved every time the remote comes up */
+	connect_pulse(c, 100000);
+	connect_pulse(c, 50000);
+	connect_pulse(c, 25000);
+	jp2_close_remote(c);
+
+	/* known by the device name, before the signature is read */
+	c = jp2_open_remote("/dev/ttyPULSE");
+	t_assert(c);
+	jp2_set_trace_sink(c, trace_reset, NULL);
+	connect_pulse(c, 12500);
+
+	jp2_set_reset_pulse(c, 30000);
+	connect_pulse(c, 30000);
+	connect_pulse(c, 30000);
+	jp2_close_remote(c);
+}
+#endif
+
 int main()
 {
 	jp2_init();
@@ -216,8 +1735,40 @@ int main()
 	t_run_test(test_command_exit_programming_mode);
 	t_run_test(test_simple_command_with_error);
 	t_run_test(test_simple_command_with_wrong_checksum);
+	t_run_test(test_connect_pipelined);
+	t_run_test(test_info_cache);
 	t_run_test(test_connect_16bit);
 	t_run_test(test_connect_32bit);
+	t_run_test(test_read_block_pipelined);
+	t_run_test(test_read_block_split);
+	t_run_test(test_read_block_pipelined_error);
+	t_run_test(test_read_window_range);
+	t_run_test(test_async_read);
+	t_run_test(test_async_errors);
+	t_run_test(test_async_busy);
+	t_run_test(test_mirror);
+	t_run_test(test_plan);
+	t_run_test(test_probe_erase_block);
+	t_run_test(test_probe_chunk_size);
+	t_run_test(test_write_chunk_fallback);
+	t_run_test(test_write_large);
+	t_run_test(test_probe_host_baudrate);
+	t_run_test(test_write_delta);
+	t_run_test(test_write_delta_wiped_neighbour);
+	t_run_test(test_verify);
+	t_run_test(test_checksum_dump);
+	t_run_test(test_no_allocations);
+	t_run_test(test_read_retry);
+	t_run_test(test_read_resync);
+	t_run_test(test_read_short_reply);
+	t_run_test(test_write_retry);
+	t_run_test(test_timeout);
+	t_run_test(test_stats);
+	t_run_test(test_capture_replay);
+#ifdef JP2_TRACE
+	t_run_test(test_trace);
+	t_run_test(test_reset_pulse);
+#endif
 
-	return 0;
+	return t_tests_failed;
 }
@@ -0,0 +1,523 @@
+/*
+ * JP2 remote protocol library.
+ *
+ * Copyright (c) 2013 Michael Walle <michael@walle.cc>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Stress test. Many sessions run in parallel threads, each against its own
+ * simulated remote, while sharing the learned reset pulses and the info
+ * cache. Auto-detection probes the simulated remotes in parallel, too.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "jp2library.h"
+#include "osapi.h"
+#include "test.h"
+
+T_DEFS;
+
+#define SIM_MEM_SIZE 0x20000
+#define SIM_INFO_AREA 0xf000
+#define SIM_UPDATE_BEGIN 0x8000
+#define SIM_UPDATE_END 0xbfff
+#define SIM_OUT_SIZE 8192
+#define SIM_REMOTES 8
+
+#define THREADS SIM_REMOTES
+#define SESSIONS 16
+#define READ_LEN 0x4000
+/* the remaining length is a multiple of 64 KiB after the first chunk */
+#define IMAGE_ADDRESS 0x800
+#define IMAGE_LEN (SIM_MEM_SIZE - IMAGE_ADDRESS)
+
+/* a remote which answers right away, each thread has its own */
+struct sim_remote {
+	uint8_t mem[SIM_MEM_SIZE];
+	uint8_t in[2048];
+	int inlen;
+	uint8_t out[SIM_OUT_SIZE];
+	int outlen;
+	int outpos;
+	bool booting;
+	bool noisy;
+	bool dead;			/* nothing attached */
+	unsigned int seed;
+};
+
+static uint8_t sim_pattern(const char *devname, uint32_t address)
+{
+	return address * 7 + devname[strlen(devname) - 1];
+}
+
+static void put_u32(uint8_t *buf, uint32_t val)
+{
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val;
+}
+
+static uint32_t get_u32(const uint8_t *buf)
+{
+	return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+static int sim_enumerate(void (*cb)(void *priv,
+			const struct osapi_port *port), void *priv)
+{
+	int i;
+	char devname[16];
+	struct osapi_port port = { .devname = devname };
+
+	for (i = 0; i < SIM_REMOTES; i++) {
+		snprintf(devname, sizeof(devname), "sim%d", i);
+		cb(priv, &port);
+	}
+	port.devname = "dead0";
+	cb(priv, &port);
+
+	return SIM_REMOTES + 1;
+}
+
+static void *sim_open(struct osapi_ops *ops, const char *devname,
+		int flags)
+{
+	struct sim_remote *s;
+	uint8_t *area;
+	uint32_t i;
+
+	s = calloc(1, sizeof(*s));
+	assert(s);
+
+	for (i = 0; i < SIM_MEM_SIZE; i++) {
+		s->mem[i] = sim_pattern(devname, i);
+	}
+	s->seed = devname[strlen(devname) - 1];
+	s->dead = !strncmp(devname, "dead", 4);
+
+	area = s->mem + SIM_INFO_AREA;
+	memset(area, ' ', JP2_SIGNATURE_LEN);
+	memcpy(area, "STRESS", 6);
+	area += JP2_SIGNATURE_LEN;
+	put_u32(area, 0x0000);
+	put_u32(area + 4, 0x7fff);
+	put_u32(area + 8, 0xc000);
+	put_u32(area + 12, 0xefff);
+	put_u32(area + 16, SIM_UPDATE_BEGIN);
+	put_u32(area + 20, SIM_UPDATE_END);
+
+	return s;
+}
+
+static void sim_close(void *handle)
+{
+	free(handle);
+}
+
+static int sim_reset(void *handle, bool assert_pin)
+{
+	struct sim_remote *s = handle;
+
+	s->booting = !assert_pin;
+	s->inlen = 0;
+	return 0;
+}
+
+static int sim_flush(void *handle)
+{
+	struct sim_remote *s = handle;
+
+	s->outlen = 0;
+	s->outpos = 0;
+	return 0;
+}
+
+static int sim_set_baudrate(void *handle, int baudrate)
+{
+	return 0;
+}
+
+static void sim_reply(struct sim_remote *s, uint8_t err, const uint8_t *data,
+		int len, bool noisy)
+{
+	uint8_t *frame = s->out + s->outlen;
+	uint8_t csum = 0;
+	int i;
+
+	assert(s->outlen + len + 4 <= SIM_OUT_SIZE);
+
+	frame[0] = (len + 2) >> 8;
+	frame[1] = len + 2;
+	frame[2] = err;
+	memcpy(frame + 3, data, len);
+	for (i = 0; i < len + 3; i++) {
+		csum ^= frame[i];
+	}
+	frame[len + 3] = csum;
+
+	/* flip a bit now and then, which is retried */
+	if (noisy && rand_r(&s->seed) % 100 == 0) {
+		frame[3 + rand_r(&s->seed) % len] ^= 0x10;
+	}
+
+	s->outlen += len + 4;
+}
+
+static void sim_command(struct sim_remote *s, uint8_t *cmd, int len)
+{
+	uint32_t start;
+	uint32_t end;
+	uint32_t i;
+	uint8_t csum;
+	uint8_t info[6] = { 0x03, 0x15 };
+
+	switch (cmd[0]) {
+	case JP2_CMD_INFO:
+		put_u32(info + 2, SIM_INFO_AREA);
+		sim_reply(s, JP2_ERR_NO_ERR, info, sizeof(info), false);
+		break;
+	case JP2_CMD_READ:
+		start = get_u32(cmd + 1);
+		end = (cmd[5] << 8) | cmd[6];
+		if (end > 1024 || start + end > SIM_MEM_SIZE) {
+			sim_reply(s, JP2_ERR_INVALID_ARGUMENT, NULL, 0, false);
+			break;
+		}
+		sim_reply(s, JP2_ERR_NO_ERR, s->mem + start, end, s->noisy);
+		break;
+	case JP2_CMD_WRITE:
+		start = get_u32(cmd + 1);
+		if (start + len - 5 > SIM_MEM_SIZE) {
+			sim_reply(s, JP2_ERR_INVALID_ARGUMENT, NULL, 0, false);
+			break;
+		}
+		memcpy(s->mem + start, cmd + 5, len - 5);
+		sim_reply(s, JP2_ERR_NO_ERR, NULL, 0, false);
+		break;
+	case JP2_CMD_ERASE:
+	case JP2_CMD_CHECKSUM:
+		start = get_u32(cmd + 1);
+		end = get_u32(cmd + 5);
+		csum = 0;
+		for (i = start; i <= end; i++) {
+			if (cmd[0] == JP2_CMD_ERASE) {
+				s->mem[i] = 0xff;
+			}
+			csum ^= s->mem[i];
+		}
+		if (cmd[0] == JP2_CMD_ERASE) {
+			sim_reply(s, JP2_ERR_NO_ERR, NULL, 0, false);
+		} else {
+			sim_reply(s, JP2_ERR_NO_ERR, &csum, 1, false);
+		}
+		break;
+	case JP2_CMD_ENTER_LOADER:
+		s->noisy = true;
+		/* fall through */
+	case JP2_CMD_EXIT_LOADER:
+		sim_reply(s, JP2_ERR_NO_ERR, NULL, 0, false);
+		break;
+	default:
+		sim_reply(s, JP2_ERR_UNKNOWN_COMMAND, NULL, 0, false);
+		break;
+	}
+}
+
+static ssize_t sim_writev(void *handle, const struct iovec *iov, int iovcnt)
+{
+	struct sim_remote *s = handle;
+	ssize_t count = 0;
+	int len;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		assert(s->inlen + iov[i].iov_len <= sizeof(s->in));
+		memcpy(s->in + s->inlen, iov[i].iov_base, iov[i].iov_len);
+		s->inlen += iov[i].iov_len;
+		count += iov[i].iov_len;
+	}
+
+	if (s->dead) {
+		s->inlen = 0;
+		return count;
+	}
+
+	/* the loader answers the first poll after a reset */
+	if (s->booting) {
+		s->booting = false;
+		s->inlen = 0;
+		sim_reply(s, JP2_ERR_NO_ERR, NULL, 0, false);
+		return count;
+	}
+
+	while (s->inlen >= 2) {
+		len = (s->in[0] << 8) | s->in[1];
+		if (s->inlen < len + 2) {
+			break;
+		}
+		sim_command(s, s->in + 2, len - 1);
+		s->inlen -= len + 2;
+		memmove(s->in, s->in + len + 2, s->inlen);
+	}
+
+	return count;
+}
+
+static ssize_t sim_write(void *handle, void *buf, size_t count)
+{
+	struct iovec iov = { buf, count };
+	return sim_writev(handle, &iov, 1);
+}
+
+static ssize_t sim_read_some(void *handle, void *buf, size_t count,
+		int timeout_ms)
+{
+	struct sim_remote *s = handle;
+
+	if (count > s->outlen - s->outpos) {
+		count = s->outlen - s->outpos;
+	}
+	if (count == 0) {
+		return OSAPI_ERR_TIMEOUT;
+	}
+	memcpy(buf, s->out + s->outpos, count);
+	s->outpos += count;
+	if (s->outpos == s->outlen) {
+		s->outlen = 0;
+		s->outpos = 0;
+	}
+
+	return count;
+}
+
+static struct osapi_ops sim_ops = {
+	.enumerate = sim_enumerate,
+	.open = sim_open,
+	.close = sim_close,
+	.reset = sim_reset,
+	.flush = sim_flush,
+	.set_baudrate = sim_set_baudrate,
+	.read_some = sim_read_some,
+	.write = sim_write,
+	.writev = sim_writev,
+};
+
+struct worker {
+	pthread_t thread;
+	char devname[16];
+	const char *cache;
+	int sessions;
+	int failures;
+	int checksums;
+};
+
+static void find_port(void *priv, const struct osapi_port *port)
+{
+	struct worker *w = priv;
+
+	if (!strcmp(port->devname, w->devname)) {
+		w->sessions++;
+	}
+}
+
+static void checksum_done(void *priv, int rc, uint8_t *data)
+{
+	struct worker *w = priv;
+
+	if (rc == 1) {
+		w->checksums++;
+	}
+}
+
+/* a full session, returns the step which failed */
+static int session(struct worker *w, uint8_t *data)
+{
+	int i;
+	int rc;
+	uint32_t bad;
+	struct jp2_remote *r;
+	struct jp2_info info;
+	struct jp2_stats stats;
+
+	r = jp2_open_remote_ops(w->devname, JP2_DEFAULT_BAUDRATE, &sim_ops);
+	if (!r) {
+		return 1;
+	}
+	jp2_set_info_cache(r, w->cache);
+
+	rc = -2;
+	if (jp2_connect(r, false, &info) < 0
+			|| strncmp(info.signature, "STRESS ", 7)
+			|| info.update_area_end != SIM_UPDATE_END) {
+		goto out;
+	}
+
+	rc = -3;
+	if (jp2_probe_chunk_size(r) != 1024) {
+		goto out;
+	}
+	jp2_set_read_window(r, 4);
+
+	rc = -4;
+	if (jp2_read_block(r, 0, READ_LEN, data) != READ_LEN) {
+		goto out;
+	}
+	for (i = 0; i < READ_LEN; i++) {
+		if (data[i] != sim_pattern(w->devname, i)) {
+			goto out;
+		}
+	}
+
+	rc = -5;
+	memset(data, w->sessions, 0x1000);
+	if (jp2_write_delta(r, SIM_UPDATE_BEGIN, 0x1000, data, 0x400) < 0
+			|| jp2_verify(r, SIM_UPDATE_BEGIN, 0x1000, data,
+				&bad) != 0) {
+		goto out;
+	}
+
+	rc = -6;
+	for (i = 0; i < 8; i++) {
+		if (jp2_submit_checksum(r, i * 0x100, i * 0x100 + 0xff,
+					checksum_done, w) < 0) {
+			goto out;
+		}
+	}
+	while (jp2_pending(r)) {
+		jp2_process_events(r, -1);
+	}
+
+	rc = -7;
+	jp2_get_stats(r, &stats);
+	if (stats.cmd[JP2_STATS_READ].count < READ_LEN / 1024) {
+		goto out;
+	}
+
+	/* a whole image, as written by jp2cli */
+	rc = -8;
+	for (i = 0; i < IMAGE_LEN; i++) {
+		data[i] = i * 7 + w->sessions;
+	}
+	if (jp2_write_block(r, IMAGE_ADDRESS, IMAGE_LEN, data) != IMAGE_LEN
+			|| jp2_verify(r, IMAGE_ADDRESS, IMAGE_LEN, data,
+				&bad) != 0) {
+		goto out;
+	}
+
+	rc = jp2_exit_loader(r);
+out:
+	jp2_close_remote(r);
+	return rc;
+}
+
+static void *worker(void *priv)
+{
+	struct worker *w = priv;
+	uint8_t *data;
+	int i;
+
+	data = malloc(IMAGE_LEN);
+	assert(data);
+
+	for (i = 0; i < SESSIONS; i++) {
+		sim_ops.enumerate(find_port, w);
+		if (session(w, data) < 0) {
+			w->failures++;
+		}
+	}
+
+	free(data);
+	return NULL;
+}
+
+void test_parallel_sessions(void)
+{
+	int i;
+	int fd;
+	int rc;
+	char cache[] = "/tmp/jp2_test_002.XXXXXX";
+	struct worker workers[THREADS];
+
+	fd = mkstemp(cache);
+	t_assert(fd >= 0);
+	close(fd);
+
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < THREADS; i++) {
+		snprintf(workers[i].devname, sizeof(workers[i].devname),
+				"sim%d", i);
+		workers[i].cache = cache;
+		rc = pthread_create(&workers[i].thread, NULL, worker,
+				&workers[i]);
+		t_assert(rc == 0);
+	}
+
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	unlink(cache);
+
+	for (i = 0; i < THREADS; i++) {
+		t_assert(workers[i].sessions == SESSIONS);
+		t_assert(workers[i].failures == 0);
+		t_assert(workers[i].checksums == SESSIONS * 8);
+	}
+}
+
+void test_detect(void)
+{
+	int i;
+	int rc;
+	struct timespec start;
+	struct timespec end;
+	struct jp2_port ports[4];
+
+	osapi = &sim_ops;
+
+	/* all remotes are found, although there is room for some only */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = jp2_detect(ports, 4, 300);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	t_assert(rc == SIM_REMOTES);
+	for (i = 0; i < 4; i++) {
+		t_assert(!strncmp(ports[i].devname, "sim", 3));
+		t_assert(!strncmp(ports[i].signature, "STRESS ", 7));
+	}
+
+	/* the ports are probed at once, the dead one takes longest */
+	t_assert((end.tv_sec - start.tv_sec) * 1000
+			+ (end.tv_nsec - start.tv_nsec) / 1000000 < 1000);
+}
+
+int main()
+{
+	jp2_init();
+
+	t_run_test(test_parallel_sessions);
+	t_run_test(test_detect);
+
+	return t_tests_failed;
+}
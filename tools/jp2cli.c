@@ -24,11 +24,28 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "jp2library.h"
+#include "osapi.h"
 
-static struct jp2_remote *r;
+/* each device is handled by its own thread */
+static __thread struct jp2_remote *r;
+static __thread const char *dev;
 static const char *prog;
+static bool multi;
+
+/* input file of write, update and verify, shared by all devices */
+static const uint8_t *image;
+static size_t image_len;
 
 void usage()
 {
@@ -36,9 +53,27 @@ void usage()
 		"usage: %s <options> <command> ..\n"
 		"\n"
 		"Available options:\n"
+		"\t-b baud Open the device with the given line speed.\n"
+		"\t-B baud Probe for the highest line speed up to <baud>. Only\n"
+		"\t        works with remotes which follow the rate of the host.\n"
+		"\t-c num  Use READ/WRITE chunks of <num> bytes instead of probing.\n"
+		"\t-C file Record the session into <file>. Only works with one\n"
+		"\t        device.\n"
 		"\t-D dev  Specify device to use. Default is /dev/ttyUSB0.\n"
+		"\t        Given several times or as a glob pattern, the command\n"
+		"\t        runs on all devices at once. read appends the device\n"
+		"\t        name to <outfile>. \"auto\" looks for remotes on all\n"
+		"\t        serial ports.\n"
+		"\t-F      Forget the cached info of the device first.\n"
 		"\t-h      Print this help.\n"
-		"\t-v      Be more verbose.\n"
+		"\t-I file Cache the remote info in <file>, which saves a round\n"
+		"\t        trip on every connect. Default is $JP2_INFO_CACHE.\n"
+		"\t-j num  Number of devices handled at once. Default is all.\n"
+		"\t-P us   Hold the remote in reset for <us> microseconds.\n"
+		"\t-R file Replay a recorded session instead of using a device.\n"
+		"\t-T      Replay with the timing of the recorded session.\n"
+		"\t-v      Be more verbose, print statistics at the end.\n"
+		"\t-w num  Number of READ requests kept in flight. Default is 1.\n"
 		"\n"
 		"Available commands:\n"
 		"\tinfo\n"
@@ -50,11 +85,39 @@ void usage()
 		"\t        erase blocks can be erased.\n"
 		"\twrite <infile> <address>\n"
 		"\t        Write to offset <address>.\n"
+		"\tpatch <infile> <address> [blocksize]\n"
+		"\t        Erase and write <infile> to offset <address>. The\n"
+		"\t        rest of the erase blocks is kept.\n"
+		"\tupdate <infile> <address> [blocksize]\n"
+		"\t        Erase and write only the blocks which differ from\n"
+		"\t        <infile>. The area should be aligned to erase blocks.\n"
+		"\tgeometry\n"
+		"\t        Find the erase block size. The start of the update\n"
+		"\t        area is erased and restored.\n"
+		"\tverify <infile> <address>\n"
+		"\t        Compare the remote with <infile> by using checksums.\n"
 		"\traw [bytes..]\n"
 		"\t        Send an raw command to the remote.\n"
 		, prog);
 }
 
+/* print a line, prefixed by the device if there are several */
+static void fmsg(FILE *f, const char *fmt, ...)
+{
+	va_list ap;
+
+	flockfile(f);
+	if (multi) {
+		fprintf(f, "%s: ", dev);
+	}
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+	funlockfile(f);
+}
+
+#define msg(...) fmsg(stdout, __VA_ARGS__)
+
 static int cmd_info(int argc, char **argv)
 {
 	int rc;
@@ -62,21 +125,66 @@ static int cmd_info(int argc, char **argv)
 
 	rc = jp2_get_info(r, &info);
 	if (rc < 0) {
-		printf("GET_INFO command failed\n");
+		msg("GET_INFO command failed\n");
 		return rc;
 	}
 
-	printf("Found remote: %s\n", info.signature);
-	printf("Program area: %05x - %05x\n",
+	msg("Found remote: %s\n", info.signature);
+	msg("Program area: %05x - %05x\n",
 			info.program_area_begin, info.program_area_end);
-	printf("Protocol area: %05x - %05x\n",
+	msg("Protocol area: %05x - %05x\n",
 			info.protocol_area_begin, info.protocol_area_end);
-	printf("Update area: %05x - %05x\n",
+	msg("Update area: %05x - %05x\n",
 			info.update_area_begin, info.update_area_end);
+	msg("Line speed: %d baud\n", jp2_get_baudrate(r));
+	msg("Chunk size: %d bytes (read), %d bytes (write)\n",
+			jp2_get_read_chunk_size(r),
+			jp2_get_write_chunk_size(r));
 
 	return 0;
 }
 
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)
+		+ (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void print_stats(void)
+{
+	struct jp2_stats stats;
+	struct jp2_cmd_stats *c;
+	int i;
+
+	jp2_get_stats(r, &stats);
+
+	fmsg(stderr, "%-9s %7s %9s %9s %5s %5s %5s %5s %8s %8s %8s\n",
+			"command", "count", "tx", "rx", "csum", "err", "tmo",
+			"retry", "avg(us)", "p99(us)", "max(us)");
+	for (i = 0; i < JP2_STATS_CMDS; i++) {
+		c = &stats.cmd[i];
+		if (!c->count) {
+			continue;
+		}
+		fmsg(stderr, "%-9s %7llu %9llu %9llu %5llu %5llu %5llu %5llu "
+				"%8llu %8llu %8llu\n",
+				jp2_stats_name(i),
+				(unsigned long long)c->count,
+				(unsigned long long)c->tx_bytes,
+				(unsigned long long)c->rx_bytes,
+				(unsigned long long)c->checksum_errors,
+				(unsigned long long)c->errors,
+				(unsigned long long)c->timeouts,
+				(unsigned long long)c->retries,
+				(unsigned long long)(c->latency_sum / c->count),
+				(unsigned long long)jp2_stats_percentile(c, 99),
+				(unsigned long long)c->latency_max);
+	}
+}
+
 static int cmd_read(int argc, char **argv)
 {
 	int rc;
@@ -84,6 +192,10 @@ static int cmd_read(int argc, char **argv)
 	int address;
 	int length;
 	char *endptr;
+	uint8_t *buf;
+	struct timespec start;
+	double t;
+	char path[PATH_MAX];
 
 	if (argc != 4) {
 		usage();
@@ -92,45 +204,57 @@ static int cmd_read(int argc, char **argv)
 
 	address = strtoul(argv[2], &endptr, 0);
 	if (*argv[2] != '\0' && *endptr != '\0') {
-		printf("could not parse start address\n");
+		msg("could not parse start address\n");
 		return -1;
 	}
 
 	length = strtoul(argv[3], &endptr, 0);
 	if (*argv[3] != '\0' && *endptr != '\0') {
-		printf("could not parse length\n");
+		msg("could not parse length\n");
 		return -1;
 	}
 
-	f = fopen(argv[1], "wb");
-	if (!f) {
-		printf("could not open %s: %s", argv[1], strerror(errno));
+	buf = malloc(length);
+	if (!buf) {
+		msg("could not allocate %d bytes\n", length);
 		return -1;
 	}
 
-	while (length > 0) {
-		uint8_t buf[128];
+	/* one file per device */
+	if (multi) {
+		snprintf(path, sizeof(path), "%s.%s", argv[1],
+				strrchr(dev, '/') ? strrchr(dev, '/') + 1 : dev);
+	} else {
+		snprintf(path, sizeof(path), "%s", argv[1]);
+	}
 
-		printf("Reading %05Xh\n", address);
-		rc = jp2_read_block(r, address, sizeof(buf), buf);
-		if (rc < 0) {
-			printf("could not read from remote (%d)\n", rc);
-			break;
-		}
+	f = fopen(path, "wb");
+	if (!f) {
+		msg("could not open %s: %s\n", path, strerror(errno));
+		free(buf);
+		return -1;
+	}
 
-		length -= rc;
-		address += rc;
+	msg("Reading %05Xh - %05Xh\n", address, address + length - 1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = jp2_read_block(r, address, length, buf);
+	t = elapsed(&start);
+	if (rc < 0) {
+		msg("could not read from remote (%d)\n", rc);
+		goto out;
+	}
+	msg("Read %d bytes in %.2fs (%.0f bytes/s)\n", rc, t, rc / t);
 
-		rc = fwrite(buf, rc, 1, f);
-		if (rc < 0) {
-			printf("could not write to file\n");
-			break;
-		}
+	if (fwrite(buf, rc, 1, f) != 1) {
+		msg("could not write to file\n");
+		rc = -1;
 	}
 
+out:
 	fclose(f);
+	free(buf);
 
-	return rc;
+	return (rc < 0) ? rc : 0;
 }
 
 static int cmd_erase(int argc, char **argv)
@@ -147,19 +271,19 @@ static int cmd_erase(int argc, char **argv)
 
 	address = strtoul(argv[1], &endptr, 0);
 	if (*argv[1] != '\0' && *endptr != '\0') {
-		printf("could not parse start address\n");
+		msg("could not parse start address\n");
 		return -1;
 	}
 
 	length = strtoul(argv[2], &endptr, 0);
 	if (*argv[2] != '\0' && *endptr != '\0') {
-		printf("could not parse length\n");
+		msg("could not parse length\n");
 		return -1;
 	}
 
 	rc = jp2_erase_block(r, address, address + length);
 	if (rc < 0) {
-		printf("could not erase block (%d)\n", rc);
+		msg("could not erase block (%d)\n", rc);
 		return -1;
 	}
 
@@ -171,7 +295,6 @@ static int cmd_write(int argc, char **argv)
 	int rc;
 	int address;
 	char *endptr;
-	FILE *f;
 
 	if (argc != 3) {
 		usage();
@@ -180,32 +303,216 @@ static int cmd_write(int argc, char **argv)
 
 	address = strtoul(argv[2], &endptr, 0);
 	if (*argv[2] != '\0' && *endptr != '\0') {
-		printf("could not parse address\n");
+		msg("could not parse address\n");
 		return -1;
 	}
 
-	f = fopen(argv[1], "rb");
-	if (!f) {
-		printf("could not open %s: %s", argv[1], strerror(errno));
+	rc = jp2_write_block(r, address, image_len, (uint8_t*)image);
+	if (rc < 0) {
+		msg("could not write to the remote (%d)\n", rc);
 		return -1;
 	}
 
-	while (!feof(f)) {
-		uint8_t buf[128];
-		rc = fread(buf, 1, sizeof(buf), f);
-		if (rc < 0) {
-			printf("could not read from file: %s\n", strerror(errno));
-			return -1;
-		}
+	return 0;
+}
 
-		rc = jp2_write_block(r, address, rc, buf);
-		if (rc < 0) {
-			printf("could not write to the remote (%d)\n", rc);
-			return -1;
-		}
+/* map the whole file, it is only read */
+static int map_file(const char *path)
+{
+	int fd;
+	struct stat st;
+	void *p;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		printf("could not read from file: %s\n",
+				(st.st_size == 0) ? "empty" : strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		printf("could not map %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	image = p;
+	image_len = st.st_size;
+
+	return 0;
+}
+
+/* the erase block size given on the command line, the one known for the
+ * remote or the default */
+static int erase_block_size(int argc, char **argv, int arg)
+{
+	int block_size;
+	char *endptr;
+
+	if (argc <= arg) {
+		block_size = jp2_get_erase_block_size(r);
+		return (block_size > 0) ? block_size : JP2_DELTA_BLOCK_SIZE;
+	}
+
+	block_size = strtoul(argv[arg], &endptr, 0);
+	if (*argv[arg] != '\0' && *endptr != '\0') {
+		msg("could not parse block size\n");
+		return -1;
+	}
+
+	return block_size;
+}
+
+static int cmd_geometry(int argc, char **argv)
+{
+	int rc;
+	struct jp2_info info;
+
+	rc = jp2_get_info(r, &info);
+	if (rc >= 0) {
+		rc = jp2_probe_erase_block(r, &info);
+	}
+	if (rc < 0) {
+		msg("could not find the erase block size (%d)\n", rc);
+		return -1;
+	}
+	msg("Erase block size: %d bytes\n", rc);
+
+	return 0;
+}
+
+static int cmd_patch(int argc, char **argv)
+{
+	int rc;
+	int address;
+	int block_size;
+	char *endptr;
+	struct timespec start;
+	struct jp2_write w;
+	struct jp2_plan *plan;
+	struct jp2_plan_cost cost;
+
+	if (argc != 3 && argc != 4) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	address = strtoul(argv[2], &endptr, 0);
+	if (*argv[2] != '\0' && *endptr != '\0') {
+		msg("could not parse address\n");
+		return -1;
+	}
+
+	block_size = erase_block_size(argc, argv, 3);
+	if (block_size < 0) {
+		return -1;
+	}
+
+	w.address = address;
+	w.len = image_len;
+	w.data = (uint8_t*)image;
+	plan = jp2_plan_writes(r, &w, 1, block_size);
+	if (!plan) {
+		msg("could not plan the write\n");
+		return -1;
+	}
+	jp2_plan_cost(plan, &cost);
+	msg("Erasing %d blocks with %d commands, about %.2fs\n",
+			cost.erase_blocks, cost.commands, cost.time_ms / 1000.0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = jp2_plan_execute(plan);
+	jp2_plan_free(plan);
+	if (rc < 0) {
+		msg("could not write to the remote (%d)\n", rc);
+		return -1;
+	}
+	msg("Wrote %d blocks in %.2fs\n", rc, elapsed(&start));
+
+	return 0;
+}
+
+static int cmd_update(int argc, char **argv)
+{
+	int rc;
+	int address;
+	int length;
+	int block_size;
+	char *endptr;
+	struct timespec start;
+
+	if (argc != 3 && argc != 4) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	address = strtoul(argv[2], &endptr, 0);
+	if (*argv[2] != '\0' && *endptr != '\0') {
+		msg("could not parse address\n");
+		return -1;
+	}
+
+	block_size = erase_block_size(argc, argv, 3);
+	if (block_size < 0) {
+		return -1;
+	}
+
+	length = image_len;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = jp2_write_delta(r, address, length, (uint8_t*)image, block_size);
+	if (rc < 0) {
+		msg("could not update the remote (%d)\n", rc);
+		return -1;
+	}
+	msg("Wrote %d of %d blocks in %.2fs\n", rc,
+			(length + block_size - 1) / block_size, elapsed(&start));
+
+	return 0;
+}
+
+static int cmd_verify(int argc, char **argv)
+{
+	int rc;
+	int address;
+	int length;
+	uint32_t bad_address;
+	char *endptr;
+	struct timespec start;
+
+	if (argc != 3) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	address = strtoul(argv[2], &endptr, 0);
+	if (*argv[2] != '\0' && *endptr != '\0') {
+		msg("could not parse address\n");
+		return -1;
+	}
+
+	length = image_len;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = jp2_verify(r, address, length, (uint8_t*)image, &bad_address);
+	if (rc < 0) {
+		msg("could not verify the remote (%d)\n", rc);
+		return -1;
+	}
 
-		address += rc;
+	if (rc) {
+		msg("Verify failed, %d bytes differ, first at %05Xh\n",
+				rc, bad_address);
+		return -1;
 	}
+	msg("Verify ok (%.2fs)\n", elapsed(&start));
 
 	return 0;
 }
@@ -224,27 +531,338 @@ static int cmd_raw(int argc, char **argv)
 	return 0;
 }
 
-int main(int argc, char **argv)
+/* options, shared by all devices */
+static bool o_noenter = false;
+static bool o_noleave = false;
+static bool o_verbose = false;
+static int o_window = 1;
+static int o_chunk = 0;
+static int o_baudrate = JP2_DEFAULT_BAUDRATE;
+static int o_max_baudrate = 0;
+static int o_reset_pulse = 0;
+static const char *o_info_cache;
+static bool o_forget = false;
+
+static int cmd_argc;
+static char **cmd_argv;
+
+struct job {
+	const char *dev;
+	int rc;
+	double seconds;
+	uint64_t bytes;			/* on the wire */
+};
+
+static struct job *jobs;
+static int njobs;
+static atomic_int next_job;
+
+static int run_command(int argc, char **argv)
+{
+	if (!strcmp(argv[0], "info")) {
+		return cmd_info(argc, argv);
+	} else if (!strcmp(argv[0], "read")) {
+		return cmd_read(argc, argv);
+	} else if (!strcmp(argv[0], "erase")) {
+		return cmd_erase(argc, argv);
+	} else if (!strcmp(argv[0], "write")) {
+		return cmd_write(argc, argv);
+	} else if (!strcmp(argv[0], "patch")) {
+		return cmd_patch(argc, argv);
+	} else if (!strcmp(argv[0], "update")) {
+		return cmd_update(argc, argv);
+	} else if (!strcmp(argv[0], "geometry")) {
+		return cmd_geometry(argc, argv);
+	} else if (!strcmp(argv[0], "verify")) {
+		return cmd_verify(argc, argv);
+	} else if (!strcmp(argv[0], "raw")) {
+		return cmd_raw(argc, argv);
+	}
+
+	return 0;
+}
+
+/* connect to the remote at dev and run the command */
+static int session(void)
 {
 	int rc;
-	int opt;
 	struct jp2_info info;
-	const char *dev = "/dev/ttyUSB0";
-	bool o_noenter = false;
-	bool o_noleave = false;
+
+	rc = jp2_set_read_window(r, o_window);
+	if (rc) {
+		fmsg(stderr, "Invalid read window %d\n", o_window);
+		return 1;
+	}
+
+	if (o_info_cache) {
+		if (o_forget) {
+			jp2_forget_info(o_info_cache, dev);
+		}
+		jp2_set_info_cache(r, o_info_cache);
+	}
+
+	if (o_reset_pulse) {
+		rc = jp2_set_reset_pulse(r, o_reset_pulse);
+		if (rc) {
+			fmsg(stderr, "Invalid reset pulse %d\n", o_reset_pulse);
+			return 1;
+		}
+	}
+
+	if (!o_noenter) {
+		rc = jp2_connect(r, true, &info);
+		if (rc) {
+			fmsg(stderr, "Could not enter bootloader mode\n");
+			return 1;
+		}
+	} else {
+		jp2_get_info(r, &info);
+	}
+
+	if (o_max_baudrate) {
+		rc = jp2_probe_host_baudrate(r, o_max_baudrate);
+		if (rc < 0) {
+			fmsg(stderr, "Line speed probing failed (%d)\n", rc);
+			return 1;
+		}
+		msg("Using %d baud\n", rc);
+	}
+
+	if (o_chunk) {
+		rc = jp2_set_chunk_size(r, o_chunk);
+		if (rc) {
+			fmsg(stderr, "Invalid chunk size %d\n", o_chunk);
+			return 1;
+		}
+	} else {
+		rc = jp2_probe_chunk_size(r);
+		if (rc < 0) {
+			fmsg(stderr, "Chunk size probing failed (%d)\n", rc);
+		}
+	}
+
+	rc = run_command(cmd_argc, cmd_argv);
+
+	if (!o_noleave) {
+		jp2_exit_loader(r);
+	}
+
+	return rc;
+}
+
+static void run_job(struct job *job)
+{
+	int i;
+	struct timespec start;
+	struct jp2_stats stats;
+
+	dev = job->dev;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	r = jp2_open_remote_baudrate(dev, o_baudrate);
+	if (!r) {
+		fmsg(stderr, "Could not open %s\n", dev);
+		job->rc = 1;
+		return;
+	}
+
+	job->rc = session();
+	job->seconds = elapsed(&start);
+
+	jp2_get_stats(r, &stats);
+	for (i = 0; i < JP2_STATS_CMDS; i++) {
+		job->bytes += stats.cmd[i].tx_bytes + stats.cmd[i].rx_bytes;
+	}
+
+	if (o_verbose) {
+		print_stats();
+	}
+
+	jp2_close_remote(r);
+	r = NULL;
+}
+
+/* take the next device until all are done, a slow one only keeps its own
+ * worker busy */
+static void *worker(void *priv)
+{
+	int i;
+
+	while ((i = atomic_fetch_add(&next_job, 1)) < njobs) {
+		run_job(&jobs[i]);
+	}
+
+	return NULL;
+}
+
+static int run_jobs(int workers)
+{
+	int i;
+	int failed = 0;
+	uint64_t bytes = 0;
+	pthread_t *threads;
+	struct timespec start;
+	double t;
+
+	if (workers <= 0 || workers > njobs) {
+		workers = njobs;
+	}
+
+	threads = calloc(workers, sizeof(*threads));
+	assert(threads);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < workers; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL)) {
+			fprintf(stderr, "Could not start worker\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < workers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	t = elapsed(&start);
+	free(threads);
+
+	printf("\n%-32s %6s %8s %9s %9s\n", "device", "result", "time(s)",
+			"bytes", "bytes/s");
+	for (i = 0; i < njobs; i++) {
+		printf("%-32s %6s %8.2f %9llu %9.0f\n", jobs[i].dev,
+				jobs[i].rc ? "failed" : "ok", jobs[i].seconds,
+				(unsigned long long)jobs[i].bytes,
+				jobs[i].seconds ? jobs[i].bytes / jobs[i].seconds : 0);
+		failed += !!jobs[i].rc;
+		bytes += jobs[i].bytes;
+	}
+	printf("%d of %d remotes ok, %llu bytes in %.2fs (%.0f bytes/s)\n",
+			njobs - failed, njobs, (unsigned long long)bytes, t,
+			bytes / t);
+
+	return failed ? EXIT_FAILURE : 0;
+}
+
+#define MAX_DETECT 32
+#define DETECT_TIMEOUT_MS 300
+
+/* the devices with a remote attached */
+static void add_detected(void)
+{
+	int i;
+	int found;
+	struct jp2_port ports[MAX_DETECT];
+
+	found = jp2_detect(ports, MAX_DETECT, DETECT_TIMEOUT_MS);
+	if (found > MAX_DETECT) {
+		found = MAX_DETECT;
+	}
+	if (found <= 0) {
+		fprintf(stderr, "No remote found\n");
+		exit(1);
+	}
+
+	jobs = realloc(jobs, (njobs + found) * sizeof(*jobs));
+	assert(jobs);
+	for (i = 0; i < found; i++) {
+		if (o_verbose) {
+			fprintf(stderr, "%s: %04x:%04x %s\n", ports[i].devname,
+					ports[i].usb_vendor,
+					ports[i].usb_product,
+					ports[i].signature);
+		}
+		memset(&jobs[njobs], 0, sizeof(*jobs));
+		jobs[njobs++].dev = strdup(ports[i].devname);
+	}
+}
+
+/* a device argument may be a glob pattern, or "auto" */
+static void add_devices(const char *pattern)
+{
+	int i;
+	glob_t g;
+
+	if (!strcmp(pattern, "auto")) {
+		add_detected();
+		return;
+	}
+
+	if (glob(pattern, 0, NULL, &g) != 0) {
+		g.gl_pathc = 0;
+	}
+
+	/* no match, take it as it is */
+	if (g.gl_pathc == 0) {
+		jobs = realloc(jobs, (njobs + 1) * sizeof(*jobs));
+		assert(jobs);
+		memset(&jobs[njobs], 0, sizeof(*jobs));
+		jobs[njobs++].dev = pattern;
+		globfree(&g);
+		return;
+	}
+
+	jobs = realloc(jobs, (njobs + g.gl_pathc) * sizeof(*jobs));
+	assert(jobs);
+	for (i = 0; i < g.gl_pathc; i++) {
+		memset(&jobs[njobs], 0, sizeof(*jobs));
+		jobs[njobs++].dev = strdup(g.gl_pathv[i]);
+	}
+	globfree(&g);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int o_workers = 0;
+	const char *o_capture = NULL;
+	bool o_replay = false;
 
 	prog = argv[0];
+	o_info_cache = getenv("JP2_INFO_CACHE");
 
-	while ((opt = getopt(argc, argv, "D:hvLE")) != -1) {
+	while ((opt = getopt(argc, argv, "b:B:c:C:D:FhI:j:P:R:Tvw:LE")) != -1) {
 		switch (opt) {
+		case 'b':
+			o_baudrate = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			o_max_baudrate = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			o_chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			o_capture = optarg;
+			break;
 		case 'D':
-			dev = optarg;
+			add_devices(optarg);
+			break;
+		case 'F':
+			o_forget = true;
+			break;
+		case 'I':
+			o_info_cache = optarg;
+			break;
+		case 'j':
+			o_workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			o_reset_pulse = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			add_devices(optarg);
+			o_replay = true;
+			break;
+		case 'T':
+			osapi_replay_timing(true);
 			break;
 		case 'h':
 			usage();
 			exit(EXIT_SUCCESS);
 		case 'v':
 			setenv("JP2_DEBUG", "1", 1);
+			o_verbose = true;
+			break;
+		case 'w':
+			o_window = strtoul(optarg, NULL, 0);
 			break;
 		case 'E':
 			o_noenter = true;
@@ -262,35 +880,45 @@ int main(int argc, char **argv)
 		usage();
 		exit(EXIT_FAILURE);
 	}
+	cmd_argc = argc - optind;
+	cmd_argv = argv + optind;
 
-	jp2_init();
-	r = jp2_open_remote(dev);
+	if (njobs == 0) {
+		add_devices("/dev/ttyUSB0");
+	}
+	multi = (njobs > 1);
+	if (multi && (o_capture || o_replay)) {
+		fprintf(stderr, "Capture and replay only work with one device\n");
+		exit(1);
+	}
 
-	if (!o_noenter) {
-		rc = jp2_enter_loader(r, true);
-		if (rc) {
-			fprintf(stderr, "Could not enter bootloader mode\n");
+	/* not before the devices are known, "auto" probes all ports */
+	if (o_capture) {
+		osapi = osapi_capture(osapi, o_capture);
+		if (!osapi) {
 			exit(1);
 		}
 	}
+	if (o_replay) {
+		osapi = &osapi_replay_ops;
+	}
 
-	jp2_get_info(r, &info);
-
-	if (!strcmp(argv[optind], "info")) {
-		rc = cmd_info(argc - optind, argv + optind);
-	} else if (!strcmp(argv[optind], "read")) {
-		rc = cmd_read(argc - optind, argv + optind);
-	} else if (!strcmp(argv[optind], "erase")) {
-		rc = cmd_erase(argc - optind, argv + optind);
-	} else if (!strcmp(argv[optind], "write")) {
-		rc = cmd_write(argc - optind, argv + optind);
-	} else if (!strcmp(argv[optind], "raw")) {
-		rc = cmd_raw(argc - optind, argv + optind);
+	/* the input file is mapped once for all devices */
+	if (cmd_argc >= 2 && (!strcmp(cmd_argv[0], "write") ||
+			!strcmp(cmd_argv[0], "patch") ||
+			!strcmp(cmd_argv[0], "update") ||
+			!strcmp(cmd_argv[0], "verify"))) {
+		if (map_file(cmd_argv[1]) < 0) {
+			exit(1);
+		}
 	}
 
-	if (!o_noleave) {
-		jp2_exit_loader(r);
+	jp2_init();
+
+	if (!multi) {
+		run_job(&jobs[0]);
+		return jobs[0].rc;
 	}
 
-	return rc;
+	return run_jobs(o_workers);
 }
@@ -26,9 +26,23 @@
 
 #include "jp2library.h"
 
+static int dumped;
+
 void usage(const char *prog)
 {
-	printf("usage: %s <ttydev> <outfile> <start offset> <length>\n", prog);
+	printf("usage: %s <ttydev> <outfile> <start offset> <length> [window]\n",
+			prog);
+}
+
+static void progress(void *priv, int done, int total)
+{
+	uint32_t start = *(uint32_t*)priv;
+
+	dumped = done;
+	if ((done & 0xff) == 0) {
+		printf("\rDumping address %05Xh..", start + done);
+		fflush(stdout);
+	}
 }
 
 int main(int argc, char **argv)
@@ -36,9 +50,9 @@ int main(int argc, char **argv)
 	int rc;
 	uint32_t start;
 	uint32_t length;
+	int window = 8;
 	char *endptr;
 	FILE *f;
-	uint32_t addr;
 	uint8_t *data;
 	static struct jp2_remote *r;
 
@@ -59,6 +73,14 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (argc > 5) {
+		window = strtoul(argv[5], &endptr, 0);
+		if (*endptr != 0) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
 	/* try normal read first */
 	f = fopen(argv[2], "w");
 	if (!f) {
@@ -74,6 +96,11 @@ int main(int argc, char **argv)
 		return 3;
 	}
 
+	if (jp2_set_read_window(r, window)) {
+		fprintf(stderr, "Invalid window %d\n", window);
+		return 1;
+	}
+
 	jp2_enter_loader(r, true);
 
 	data = malloc(length);
@@ -87,19 +114,13 @@ int main(int argc, char **argv)
 
 	/* didn't work out, try using checksum method */
 	printf("\nRead command returned error code. Trying alternative method.\n");
-	for (addr = start; addr < start + length; addr++) {
-		uint8_t b;
-
-		if ((addr & 0xff) == 0) {
-			printf("\rDumping address %05Xh..", addr);
-			fflush(stdout);
-		}
-		rc = jp2_checksum_block(r, addr, addr);
-		if (rc < 0) {
-			break;
-		}
-		b = rc & 0xff;
-		fwrite(&b, 1, 1, f);
+	jp2_set_progress_cb(r, progress, &start);
+	rc = jp2_checksum_dump(r, start, length, data);
+	if (rc < 0) {
+		/* keep what we have got so far */
+		fwrite(data, 1, dumped, f);
+	} else {
+		fwrite(data, 1, length, f);
 	}
 
 out: